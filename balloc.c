@@ -0,0 +1,267 @@
+#include "balloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// Longest-run value of a group whose free space changed in a way
+// that may have made its longest run longer, it has to be rescanned
+#define RUN_UNKNOWN INT_MAX
+
+static uint64_t *bitmap = NULL; // Owned by the caller, one bit per block
+static int total = 0;           // Number of blocks the bitmap covers
+static int cursor = 0;          // Next-fit position, where the last allocation ended
+
+static int ngroups = 0;
+static int *group_free = NULL;    // Free blocks in each group
+static int *group_max_run = NULL; // Upper bound of the longest free run starting in each group
+
+static int group_of(int block)
+{
+    return block / BALLOC_GROUP_BLOCKS;
+}
+
+static int group_end(int g)
+{
+    long end = (long)(g + 1) * BALLOC_GROUP_BLOCKS;
+    return end < total ? end : total;
+}
+
+int balloc_is_used(int block)
+{
+    return (bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+// Return the first clear bit in [from, limit), or limit if there is none
+static int find_zero(int from, int limit)
+{
+    while (from < limit)
+    {
+        // Set bits are used blocks, look for a zero in what is left of this word
+        uint64_t free_bits = ~bitmap[from / 64] >> (from % 64);
+        if (free_bits != 0)
+        {
+            int found = from + __builtin_ctzll(free_bits);
+            return found < limit ? found : limit;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return limit;
+}
+
+// Return the first set bit in [from, limit), or limit if there is none
+static int find_one(int from, int limit)
+{
+    while (from < limit)
+    {
+        uint64_t used_bits = bitmap[from / 64] >> (from % 64);
+        if (used_bits != 0)
+        {
+            int found = from + __builtin_ctzll(used_bits);
+            return found < limit ? found : limit;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return limit;
+}
+
+// Set or clear the bits [start, start + len), a whole word at a time where possible
+static void set_range(int start, int len, int used)
+{
+    int end = start + len;
+    while (start < end)
+    {
+        int bit = start % 64;
+        int n = 64 - bit < end - start ? 64 - bit : end - start;
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        if (used)
+        {
+            bitmap[start / 64] |= mask;
+        }
+        else
+        {
+            bitmap[start / 64] &= ~mask;
+        }
+        start += n;
+    }
+}
+
+// Adjust the per-group free counts for [start, start + len) changing by sign
+static void count_range(int start, int len, int sign)
+{
+    int end = start + len;
+    while (start < end)
+    {
+        int g = group_of(start);
+        int n = group_end(g) < end ? group_end(g) - start : end - start;
+        group_free[g] += sign * n;
+        start += n;
+    }
+}
+
+// Scan group g from position from for a free run of at least want blocks
+// Runs may extend past the end of the group, and are only measured up to want blocks
+// Return the start of the run, or -1, and the longest run seen in *longest
+// (exact when no run was found)
+static int scan_group(int g, int from, int want, int *longest)
+{
+    int end = group_end(g);
+    *longest = 0;
+    while (from < end)
+    {
+        int start = find_zero(from, end);
+        if (start >= end)
+        {
+            break;
+        }
+        int limit = want >= total - start ? total : start + want;
+        int run_end = find_one(start, limit);
+        int len = run_end - start;
+        if (len > *longest)
+        {
+            *longest = len;
+        }
+        if (len >= want)
+        {
+            return start;
+        }
+        from = run_end;
+    }
+    return -1;
+}
+
+// Take the bitmap of nblocks blocks into use, and build the group summary
+void balloc_init(uint64_t *map, int nblocks)
+{
+    bitmap = map;
+    total = nblocks;
+    cursor = 0;
+
+    free(group_free);
+    free(group_max_run);
+    ngroups = (nblocks + BALLOC_GROUP_BLOCKS - 1) / BALLOC_GROUP_BLOCKS;
+    group_free = calloc(ngroups, sizeof(int));
+    group_max_run = malloc(ngroups * sizeof(int));
+
+    for (int g = 0; g < ngroups; g++)
+    {
+        int begin = g * BALLOC_GROUP_BLOCKS;
+        for (int b = find_zero(begin, group_end(g)); b < group_end(g);)
+        {
+            int run_end = find_one(b, group_end(g));
+            group_free[g] += run_end - b;
+            b = find_zero(run_end, group_end(g));
+        }
+        group_max_run[g] = RUN_UNKNOWN;
+    }
+}
+
+// Mark [start, start + len) used without going through the allocator,
+// for the blocks holding the superblock and tables
+void balloc_reserve(int start, int len)
+{
+    for (int b = start; b < start + len; b++)
+    {
+        if (!balloc_is_used(b))
+        {
+            set_range(b, 1, 1);
+            count_range(b, 1, -1);
+        }
+    }
+}
+
+// Allocate a contiguous run of want blocks
+// If goal >= 0 and a full run starts free there, it is taken first, so a file can grow in place
+// Otherwise the search is next-fit from the cursor. When no run of want
+// blocks exists, the longest run available is returned instead
+// Return the first block and the run length in *got, or -1 if the bitmap is full
+int balloc_alloc(int want, int goal, int *got)
+{
+    int start = -1;
+    int len = want;
+
+    if (want <= 0 || total == 0)
+    {
+        return -1;
+    }
+
+    if (goal >= 0 && goal < total && !balloc_is_used(goal) &&
+        find_one(goal, want >= total - goal ? total : goal + want) - goal == want)
+    {
+        start = goal;
+    }
+
+    // Every group once from the cursor on, then the start of the first group again
+    int first_from = cursor < total ? cursor : 0;
+    for (int k = 0; k <= ngroups && start < 0; k++)
+    {
+        int g = (group_of(first_from) + k) % ngroups;
+        int from = (k == 0) ? first_from : g * BALLOC_GROUP_BLOCKS;
+        if (group_free[g] == 0 || group_max_run[g] < want)
+        {
+            continue;
+        }
+
+        int longest;
+        start = scan_group(g, from, want, &longest);
+        if (start < 0 && from == g * BALLOC_GROUP_BLOCKS)
+        {
+            // Scanned the whole group without finding want, so longest is exact
+            group_max_run[g] = longest;
+        }
+    }
+
+    // No run long enough anywhere, settle for the longest one
+    // Only groups whose summary could beat the best run so far need a scan
+    if (start < 0)
+    {
+        int best_group = -1;
+        int best_run = 0;
+        for (int g = 0; g < ngroups; g++)
+        {
+            if (group_free[g] == 0 || group_max_run[g] <= best_run)
+            {
+                continue;
+            }
+            int longest;
+            scan_group(g, g * BALLOC_GROUP_BLOCKS, INT_MAX, &longest);
+            group_max_run[g] = longest;
+            if (longest > best_run)
+            {
+                best_run = longest;
+                best_group = g;
+            }
+        }
+        if (best_group < 0)
+        {
+            return -1;
+        }
+
+        int longest;
+        start = scan_group(best_group, best_group * BALLOC_GROUP_BLOCKS, best_run, &longest);
+        len = best_run;
+    }
+
+    set_range(start, len, 1);
+    count_range(start, len, -1);
+    cursor = start + len;
+    *got = len;
+    return start;
+}
+
+// Give back the run [start, start + len)
+void balloc_free(int start, int len)
+{
+    set_range(start, len, 0);
+    count_range(start, len, 1);
+
+    // The freed run may lengthen runs of its own groups, and one running in from the previous group
+    int g = group_of(start);
+    if (g > 0)
+    {
+        group_max_run[g - 1] = RUN_UNKNOWN;
+    }
+    for (; g <= group_of(start + len - 1); g++)
+    {
+        group_max_run[g] = RUN_UNKNOWN;
+    }
+}
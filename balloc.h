@@ -0,0 +1,19 @@
+#ifndef BALLOC_H
+#define BALLOC_H
+
+#include <stdint.h>
+
+// Block allocator over the free block bitmap (bit set = block used)
+// The bitmap is scanned 64 bits at a time, allocation is next-fit from a
+// rotating cursor, and a per-group summary (free count, longest free run)
+// lets the scan skip groups that can not satisfy a request
+
+#define BALLOC_GROUP_BLOCKS 32768 // One 4 KiB bitmap block worth of blocks
+
+void balloc_init(uint64_t *bitmap, int nblocks);
+int balloc_alloc(int want, int goal, int *got);
+void balloc_free(int start, int len);
+void balloc_reserve(int start, int len);
+int balloc_is_used(int block);
+
+#endif // BALLOC_H
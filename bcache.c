@@ -0,0 +1,529 @@
+#include "bcache.h"
+#include "disk.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef struct
+{
+    int block;            // Block held, -1 when the frame is empty
+    int next;             // Next frame in the same hash chain, -1 at the end
+    int pins;             // Callers using the frame, it is never reused while > 0
+    char referenced;      // CLOCK bit, set on every access, cleared as the hand passes
+    char dirty;           // data is newer than the image
+    char valid;           // data holds the block, guarded by lock
+    pthread_mutex_t lock; // Held while data is loaded, copied or written back
+    char *data;
+} frame_t;
+
+// Locking: cache_lock guards the hash chains, the CLOCK hand, the stats, and
+// block, next, pins, referenced and dirty of every frame
+// A frame's lock is only taken with the frame pinned, so a frame with no pins
+// is not locked by anyone and cache_lock alone is enough to reuse it
+// Frame locks are taken in increasing block order, and never while holding cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static frame_t *frames = NULL;
+static char *pool = NULL;      // bsize bytes of data for every frame
+static int nframes = 0;        // 0 when the cache is disabled
+static int *buckets = NULL;    // First frame of each hash chain, or -1
+static unsigned nbuckets = 0;  // Always a power of two
+static int hand = 0;           // CLOCK hand
+static int bsize = 0;          // Bytes per block
+static int write_back = 0;     // Keep writes in the cache until flushed or evicted
+static bcache_stats_t stats;
+
+// Allocate frames for budget bytes of blocks of block_size bytes
+// Return 0, or -ENOMEM
+int bcache_init(size_t budget, int block_size, int write_back_mode)
+{
+    bsize = block_size;
+    write_back = write_back_mode;
+    nframes = budget / block_size;
+    memset(&stats, 0, sizeof(stats));
+    if (nframes == 0)
+    {
+        return 0;
+    }
+
+    nbuckets = 1;
+    while (nbuckets < (unsigned)nframes)
+    {
+        nbuckets *= 2;
+    }
+    frames = calloc(nframes, sizeof(frame_t));
+    buckets = malloc(nbuckets * sizeof(int));
+    // Aligned, so frames go to an O_DIRECT image as they are
+    if (posix_memalign((void **)&pool, block_size, (size_t)nframes * block_size) != 0)
+    {
+        pool = NULL;
+    }
+    if (!frames || !buckets || !pool)
+    {
+        bcache_destroy();
+        return -ENOMEM;
+    }
+    disk_register_buffers(pool, (size_t)nframes * block_size);
+
+    memset(buckets, -1, nbuckets * sizeof(int));
+    for (int f = 0; f < nframes; f++)
+    {
+        frames[f].block = -1;
+        frames[f].next = -1;
+        frames[f].data = pool + (size_t)f * block_size;
+        pthread_mutex_init(&frames[f].lock, NULL);
+    }
+    hand = 0;
+    return 0;
+}
+
+// Release the frames, anything still dirty has to be flushed before
+void bcache_destroy()
+{
+    for (int f = 0; frames && f < nframes; f++)
+    {
+        pthread_mutex_destroy(&frames[f].lock);
+    }
+    if (pool)
+    {
+        disk_register_buffers(NULL, 0);
+    }
+    free(frames);
+    free(buckets);
+    free(pool);
+    frames = NULL;
+    buckets = NULL;
+    pool = NULL;
+    nframes = 0;
+}
+
+static unsigned bucket_of(int block)
+{
+    return ((unsigned)block * 2654435761u) & (nbuckets - 1);
+}
+
+// Return the frame holding block, or -1, with cache_lock held
+static int find_frame(int block)
+{
+    for (int f = buckets[bucket_of(block)]; f >= 0; f = frames[f].next)
+    {
+        if (frames[f].block == block)
+        {
+            return f;
+        }
+    }
+    return -1;
+}
+
+// Take frame f out of its hash chain, with cache_lock held
+static void unhash_frame(int f)
+{
+    int *link = &buckets[bucket_of(frames[f].block)];
+    while (*link != f)
+    {
+        link = &frames[*link].next;
+    }
+    *link = frames[f].next;
+    frames[f].block = -1;
+    frames[f].next = -1;
+}
+
+// Pick a frame to reuse with CLOCK, with cache_lock held
+// Clean frames go first, a dirty one is only taken after two full sweeps
+// Return the frame, or -1 if every frame is pinned
+static int clock_victim()
+{
+    for (int step = 0; step < 3 * nframes; step++)
+    {
+        int f = hand;
+        hand = (hand + 1) % nframes;
+        if (frames[f].pins > 0)
+        {
+            continue;
+        }
+        if (frames[f].referenced)
+        {
+            frames[f].referenced = 0;
+            continue;
+        }
+        if (frames[f].dirty && step < 2 * nframes)
+        {
+            continue;
+        }
+        return f;
+    }
+    return -1;
+}
+
+// Pin the frame of block, giving it a frame if it has none
+// If only_absent is set, a block already in the cache is left alone and -1 returned
+// Return the pinned frame, or -1 when no frame can be had
+static int grab_frame(int block, int only_absent)
+{
+    pthread_mutex_lock(&cache_lock);
+    int f = find_frame(block);
+    if (f >= 0)
+    {
+        if (only_absent)
+        {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        frames[f].pins++;
+        frames[f].referenced = 1;
+        pthread_mutex_unlock(&cache_lock);
+        return f;
+    }
+
+    f = clock_victim();
+    if (f < 0)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (frames[f].dirty)
+    {
+        // Unpinned, so nobody holds its lock or touches its data
+        if (disk_write(frames[f].data, bsize, (off_t)frames[f].block * bsize) < 0)
+        {
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        frames[f].dirty = 0;
+        stats.writebacks++;
+    }
+    if (frames[f].block >= 0)
+    {
+        unhash_frame(f);
+        stats.evictions++;
+    }
+
+    unsigned b = bucket_of(block);
+    frames[f].block = block;
+    frames[f].next = buckets[b];
+    buckets[b] = f;
+    frames[f].valid = 0;
+    frames[f].pins = 1;
+    frames[f].referenced = 1;
+    pthread_mutex_unlock(&cache_lock);
+    return f;
+}
+
+// Unlock and unpin frame f, marking it dirty if it was written
+static void release_frame(int f, int dirtied)
+{
+    pthread_mutex_unlock(&frames[f].lock);
+
+    pthread_mutex_lock(&cache_lock);
+    frames[f].pins--;
+    if (dirtied)
+    {
+        frames[f].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void count(long hits, long misses)
+{
+    pthread_mutex_lock(&cache_lock);
+    stats.hits += hits;
+    stats.misses += misses;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Read size bytes at offset of the image into buf
+// A run of blocks missing from the cache is loaded with a single vector read
+// Return size, or -errno
+int bcache_read(void *buf, size_t size, off_t offset)
+{
+    if (nframes == 0)
+    {
+        return disk_read(buf, size, offset);
+    }
+
+    off_t end = offset + size;
+    off_t pos = offset;
+    long hits = 0;
+    long misses = 0;
+    int rv = 0;
+
+    while (pos < end && rv >= 0)
+    {
+        int block = pos / bsize;
+        int f = grab_frame(block, 0);
+        if (f < 0)
+        {
+            // Every frame is busy, go around the cache for this block
+            off_t to = (off_t)(block + 1) * bsize < end ? (off_t)(block + 1) * bsize : end;
+            rv = disk_read((char *)buf + (pos - offset), to - pos, pos);
+            pos = to;
+            continue;
+        }
+        pthread_mutex_lock(&frames[f].lock);
+
+        int run[DISK_IOV_MAX];
+        int n = 1;
+        run[0] = f;
+        if (frames[f].valid)
+        {
+            hits++;
+        }
+        else
+        {
+            // Take the blocks right after this one too, as long as they are not cached either
+            int last = (end - 1) / bsize;
+            while (n < DISK_IOV_MAX && block + n <= last)
+            {
+                int g = grab_frame(block + n, 1);
+                if (g < 0)
+                {
+                    break;
+                }
+                pthread_mutex_lock(&frames[g].lock);
+                if (frames[g].valid)
+                {
+                    release_frame(g, 0);
+                    break;
+                }
+                run[n++] = g;
+            }
+
+            struct iovec iov[DISK_IOV_MAX];
+            for (int k = 0; k < n; k++)
+            {
+                iov[k].iov_base = frames[run[k]].data;
+                iov[k].iov_len = bsize;
+            }
+            rv = disk_readv(iov, n, (off_t)block * bsize);
+            for (int k = 0; k < n && rv >= 0; k++)
+            {
+                frames[run[k]].valid = 1;
+            }
+            misses += n;
+        }
+
+        for (int k = 0; k < n; k++)
+        {
+            if (rv >= 0)
+            {
+                off_t block_start = (off_t)(block + k) * bsize;
+                off_t to = block_start + bsize < end ? block_start + bsize : end;
+                memcpy((char *)buf + (pos - offset), frames[run[k]].data + (pos - block_start), to - pos);
+                pos = to;
+            }
+            release_frame(run[k], 0);
+        }
+    }
+
+    count(hits, misses);
+    return rv < 0 ? -EIO : (int)size;
+}
+
+// Update the cached blocks of [offset, offset + size) with buf, marking them dirty in
+// write-back mode, otherwise the caller writes buf to the image after
+// Return 0, or -errno
+static int cache_write(const void *buf, size_t size, off_t offset)
+{
+    off_t end = offset + size;
+    off_t pos = offset;
+    long hits = 0;
+    long misses = 0;
+    int rv = 0;
+
+    while (pos < end && rv >= 0)
+    {
+        int block = pos / bsize;
+        off_t block_start = (off_t)block * bsize;
+        off_t to = block_start + bsize < end ? block_start + bsize : end;
+
+        int f = grab_frame(block, 0);
+        if (f < 0)
+        {
+            if (write_back)
+            {
+                rv = disk_write((const char *)buf + (pos - offset), to - pos, pos);
+            }
+            pos = to;
+            continue;
+        }
+        pthread_mutex_lock(&frames[f].lock);
+
+        // Part of a block not yet cached, the rest of it has to come from the image
+        if (!frames[f].valid && (pos > block_start || to < block_start + bsize))
+        {
+            rv = disk_read(frames[f].data, bsize, block_start);
+            misses++;
+        }
+        else if (frames[f].valid)
+        {
+            hits++;
+        }
+        if (rv >= 0)
+        {
+            memcpy(frames[f].data + (pos - block_start), (const char *)buf + (pos - offset), to - pos);
+            frames[f].valid = 1;
+        }
+        release_frame(f, rv >= 0 && write_back);
+        pos = to;
+    }
+    count(hits, misses);
+    return rv < 0 ? rv : 0;
+}
+
+// Write size bytes from buf at offset of the image
+// The blocks are updated in the cache, and written to the image right away unless in write-back mode
+// Return size, or -errno
+int bcache_write(const void *buf, size_t size, off_t offset)
+{
+    if (nframes == 0)
+    {
+        return disk_write(buf, size, offset);
+    }
+
+    int rv = cache_write(buf, size, offset);
+    if (rv >= 0 && !write_back)
+    {
+        rv = disk_write(buf, size, offset);
+    }
+    return rv < 0 ? rv : (int)size;
+}
+
+// Run the transfers of reqs as bcache_read and bcache_write would, independent of each
+// other: what goes to the image, all of it without the cache, goes out as one batch
+// Return 0, -EIO, or -ENOMEM
+int bcache_submit(disk_req_t *reqs, int n)
+{
+    if (nframes == 0)
+    {
+        return disk_submit(reqs, n) < 0 ? -EIO : 0;
+    }
+
+    disk_req_t *through = malloc(n * sizeof(disk_req_t));
+    if (through == NULL && n > 0)
+    {
+        return -ENOMEM;
+    }
+    int nthrough = 0;
+    int rv = 0;
+    for (int k = 0; k < n && rv >= 0; k++)
+    {
+        if (!reqs[k].write)
+        {
+            rv = bcache_read(reqs[k].buf, reqs[k].size, reqs[k].offset);
+        }
+        else
+        {
+            rv = cache_write(reqs[k].buf, reqs[k].size, reqs[k].offset);
+            if (!write_back)
+            {
+                through[nthrough++] = reqs[k];
+            }
+        }
+    }
+    if (rv >= 0 && nthrough > 0)
+    {
+        rv = disk_submit(through, nthrough);
+    }
+    free(through);
+    return rv < 0 ? -EIO : 0;
+}
+
+static int compare_block(const void *a, const void *b)
+{
+    return frames[*(const int *)a].block - frames[*(const int *)b].block;
+}
+
+// Write every dirty block to the image, neighbouring blocks with one vector write
+// Does not sync, return 0 or -EIO
+int bcache_flush()
+{
+    if (nframes == 0 || !write_back)
+    {
+        return 0;
+    }
+
+    // Pin and claim every dirty frame, a write after this marks it dirty again
+    int *dirty = malloc(nframes * sizeof(int));
+    int n = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int f = 0; f < nframes; f++)
+    {
+        if (frames[f].dirty)
+        {
+            frames[f].dirty = 0;
+            frames[f].pins++;
+            dirty[n++] = f;
+        }
+    }
+    qsort(dirty, n, sizeof(int), compare_block);
+    pthread_mutex_unlock(&cache_lock);
+
+    int failed = 0;
+    for (int k = 0; k < n;)
+    {
+        int len = 1;
+        while (k + len < n && len < DISK_IOV_MAX && frames[dirty[k + len]].block == frames[dirty[k]].block + len)
+        {
+            len++;
+        }
+
+        struct iovec iov[DISK_IOV_MAX];
+        for (int j = 0; j < len; j++)
+        {
+            pthread_mutex_lock(&frames[dirty[k + j]].lock);
+            iov[j].iov_base = frames[dirty[k + j]].data;
+            iov[j].iov_len = bsize;
+        }
+        int rv = disk_writev(iov, len, (off_t)frames[dirty[k]].block * bsize);
+        if (rv < 0)
+        {
+            failed = 1;
+        }
+        for (int j = 0; j < len; j++)
+        {
+            release_frame(dirty[k + j], rv < 0);
+        }
+
+        pthread_mutex_lock(&cache_lock);
+        if (rv >= 0)
+        {
+            stats.writebacks += len;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        k += len;
+    }
+    free(dirty);
+    return failed ? -EIO : 0;
+}
+
+// Forget the blocks [start, start + len), they were freed
+// Dirty data for them is dropped instead of written back
+void bcache_invalidate(int start, int len)
+{
+    if (nframes == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int block = start; block < start + len; block++)
+    {
+        int f = find_frame(block);
+        if (f >= 0 && frames[f].pins == 0)
+        {
+            unhash_frame(f);
+            frames[f].dirty = 0;
+            frames[f].referenced = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Copy out the cache counters
+void bcache_get_stats(bcache_stats_t *out)
+{
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
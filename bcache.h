@@ -0,0 +1,32 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "disk.h"
+#include <sys/types.h>
+
+// Cache of image blocks in front of disk.c, for file data and indirect extent blocks
+// Frames come from a pool allocated once at mount, a hash maps a block number
+// to its frame, and CLOCK picks the frame to reuse when the pool is full
+//
+// Writes either go to the image immediately (write-through), or only mark
+// the frame dirty until bcache_flush or eviction writes it (write-back)
+// A budget of 0 disables the cache, every call then goes straight to disk.c
+
+typedef struct
+{
+    long hits;       // Blocks served from a frame
+    long misses;     // Blocks that had to be read from the image
+    long evictions;  // Frames reused for another block
+    long writebacks; // Dirty blocks written to the image
+} bcache_stats_t;
+
+int bcache_init(size_t budget, int block_size, int write_back);
+void bcache_destroy();
+int bcache_read(void *buf, size_t size, off_t offset);
+int bcache_write(const void *buf, size_t size, off_t offset);
+int bcache_submit(disk_req_t *reqs, int n);
+int bcache_flush();
+void bcache_invalidate(int start, int len);
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif // BCACHE_H
@@ -0,0 +1,545 @@
+// nufs-bench: measure the storage layer, or a mounted nufs, under simple workloads
+//
+//   nufs-bench [-n files] [-s size] [-a io-size] [-t threads] [-r readdirs] [-w workloads]
+//              [-c cache-kb] [-B buffer-kb] [-R readahead-kb] [-F sync|fsync|periodic] [-W writeback-ms]
+//              [-D] [-Z] [-U] [-O] [-i image] [-m mountpoint] [-o out.json]
+//
+// Without -m, the workloads call storage.c directly, on a fresh image made in a
+// temporary file (or at -i, which is left behind). With -m, the same workloads
+// run through the file system mounted there, so comparing both separates what
+// the kernel and FUSE cost from what the storage layer costs
+//
+// Options of the storage layer, without -m:
+//   -D  deduplication, the files of one thread all hold the same bytes
+//   -Z  compression, files of one block are too small for it
+//   -U  image I/O through io_uring
+//   -O  open the image O_DIRECT
+//   -F  when changes become durable (default sync, see storage_durability_t)
+//   -W  the period of -F periodic
+//   -B  the budget of the write buffers, only used without -F sync
+//   -R  the most read ahead of a file read in order
+//   -c  the budget of the block cache
+// And of the workloads:
+//   -a  write each file in appends, and read it back, that many bytes at a time
+//
+// Every thread works on files of its own directory; the workloads run in the
+// order given (default: create,write,stat,read,readdir,rename,unlink), each one
+// timed from the moment all threads start it until the last one is done
+// The results go to stdout (or -o) as JSON, see bench_compare.pl; without -o, what
+// the storage layer prints goes to stderr, so stdout holds nothing but the JSON
+#include "storage.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#define MAX_WORKLOADS 16
+
+typedef enum
+{
+    W_CREATE,
+    W_WRITE,
+    W_STAT,
+    W_READ,
+    W_READDIR,
+    W_RENAME,
+    W_UNLINK,
+    W_COUNT
+} workload_t;
+
+static const char *workload_names[W_COUNT] = {
+    "create", "write", "stat", "read", "readdir", "rename", "unlink",
+};
+
+static int nfiles = 1000;
+static long file_size = 4096;
+static long io_size = 0; // Bytes per write and per read of the write and read workloads, 0 for the whole file at once
+static int nthreads = 1;
+static int nreaddirs = 10;
+static const char *mountpoint = NULL;
+
+static workload_t workloads[MAX_WORKLOADS];
+static int nworkloads = 0;
+
+static int renamed = 0; // Whether the files already carry their new names
+
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t end_barrier;
+
+// What one workload measured, over all threads
+typedef struct
+{
+    workload_t workload;
+    int ops;
+    int errors;
+    double seconds;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+} result_t;
+
+// What one thread measured in the workload being run
+typedef struct
+{
+    int id;
+    uint64_t *latencies; // Nanoseconds of each operation
+    int count;
+    int errors;
+} thread_state_t;
+
+static uint64_t now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Files of thread t are /b<t>/f<k>, renamed to /b<t>/r<k>
+static void file_path(char *out, size_t cap, int t, int k, int new_name)
+{
+    snprintf(out, cap, "%s/b%d/%c%d", mountpoint ? mountpoint : "", t, new_name ? 'r' : 'f', k);
+}
+
+static void dir_path(char *out, size_t cap, int t)
+{
+    snprintf(out, cap, "%s/b%d", mountpoint ? mountpoint : "", t);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (*(int *)buf)++;
+    return 0;
+}
+
+// Run one operation of workload w on file k of thread t, through the storage
+// layer or the mount; return 0, or -1 if it failed
+static int run_op(workload_t w, int t, int k, char *data)
+{
+    char path[512];
+    char to[512];
+    file_path(path, sizeof(path), t, k, renamed);
+    long chunk = io_size > 0 ? io_size : file_size;
+    int rv = 0;
+
+    if (mountpoint == NULL)
+    {
+        struct stat st;
+        int entries = 0;
+        // The file creates and writes close on a mount get their storage_flush here too
+        switch (w)
+        {
+        case W_CREATE:
+            return storage_create(path, S_IFREG | 0644) < 0 || storage_flush(path) < 0 ? -1 : 0;
+        case W_WRITE:
+            for (long pos = 0; pos < file_size && rv == 0; pos += chunk)
+            {
+                long n = file_size - pos < chunk ? file_size - pos : chunk;
+                rv = storage_write(path, data + pos, n, pos) != n ? -1 : 0;
+            }
+            return rv < 0 || storage_flush(path) < 0 ? -1 : 0;
+        case W_STAT:
+            return storage_stat(path, &st) < 0 ? -1 : 0;
+        case W_READ:
+        {
+            storage_file_t *f = storage_file_open();
+            for (long pos = 0; pos < file_size && rv == 0; pos += chunk)
+            {
+                long n = file_size - pos < chunk ? file_size - pos : chunk;
+                rv = storage_read(path, data + pos, n, pos, f) != n ? -1 : 0;
+            }
+            storage_file_release(f);
+            return rv;
+        }
+        case W_READDIR:
+            dir_path(path, sizeof(path), t);
+            storage_list(path, &entries, count_entry);
+            return entries == nfiles / nthreads ? 0 : -1;
+        case W_RENAME:
+            file_path(to, sizeof(to), t, k, 1);
+            return storage_rename(path, to) < 0 ? -1 : 0;
+        case W_UNLINK:
+            return storage_unlink(path) < 0 ? -1 : 0;
+        default:
+            return -1;
+        }
+    }
+
+    int fd;
+    struct stat st;
+    switch (w)
+    {
+    case W_CREATE:
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        return fd < 0 ? -1 : close(fd);
+    case W_WRITE:
+        fd = open(path, O_WRONLY);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        for (long pos = 0; pos < file_size && rv == 0; pos += chunk)
+        {
+            long n = file_size - pos < chunk ? file_size - pos : chunk;
+            rv = pwrite(fd, data + pos, n, pos) != n ? -1 : 0;
+        }
+        close(fd);
+        return rv;
+    case W_STAT:
+        return stat(path, &st);
+    case W_READ:
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        for (long pos = 0; pos < file_size && rv == 0; pos += chunk)
+        {
+            long n = file_size - pos < chunk ? file_size - pos : chunk;
+            rv = pread(fd, data + pos, n, pos) != n ? -1 : 0;
+        }
+        close(fd);
+        return rv;
+    case W_READDIR:
+    {
+        dir_path(path, sizeof(path), t);
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+        {
+            return -1;
+        }
+        int entries = 0;
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL)
+        {
+            entries += strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0;
+        }
+        closedir(dir);
+        return entries == nfiles / nthreads ? 0 : -1;
+    }
+    case W_RENAME:
+        file_path(to, sizeof(to), t, k, 1);
+        return rename(path, to);
+    case W_UNLINK:
+        return unlink(path);
+    default:
+        return -1;
+    }
+}
+
+static workload_t current;
+
+static void *thread_main(void *arg)
+{
+    thread_state_t *ts = arg;
+    char *data = malloc(file_size > 0 ? file_size : 1);
+    memset(data, 'a' + ts->id % 26, file_size);
+    int per_thread = nfiles / nthreads;
+
+    for (int n = 0; n < nworkloads; n++)
+    {
+        pthread_barrier_wait(&start_barrier);
+        int ops = current == W_READDIR ? nreaddirs : per_thread;
+        ts->count = 0;
+        ts->errors = 0;
+        for (int k = 0; k < ops; k++)
+        {
+            uint64_t begin = now_ns();
+            ts->errors += run_op(current, ts->id, k, data) < 0;
+            ts->latencies[ts->count++] = now_ns() - begin;
+        }
+        pthread_barrier_wait(&end_barrier);
+    }
+    free(data);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Latency at quantile q of the n sorted samples, in microseconds
+static double quantile_us(const uint64_t *sorted, int n, double q)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    int k = (int)(q * n);
+    return sorted[k < n ? k : n - 1] / 1000.0;
+}
+
+static int parse_workloads(char *list)
+{
+    nworkloads = 0;
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        int w = 0;
+        while (w < W_COUNT && strcmp(workload_names[w], name) != 0)
+        {
+            w++;
+        }
+        if (w == W_COUNT || nworkloads == MAX_WORKLOADS)
+        {
+            return -1;
+        }
+        workloads[nworkloads++] = w;
+    }
+    return nworkloads > 0 ? 0 : -1;
+}
+
+// The durability mode named, or -1
+static int parse_durability(const char *name)
+{
+    static const char *names[] = {"sync", "fsync", "periodic"}; // In storage_durability_t order
+    for (int k = 0; k < 3; k++)
+    {
+        if (strcmp(name, names[k]) == 0)
+        {
+            return k;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n files] [-s size] [-a io-size] [-t threads] [-r readdirs] [-w workloads]\n"
+                    "       [-c cache-kb] [-B buffer-kb] [-R readahead-kb] [-F sync|fsync|periodic] [-W writeback-ms]\n"
+                    "       [-D] [-Z] [-U] [-O] [-i image] [-m mountpoint] [-o out.json]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    char default_workloads[] = "create,write,stat,read,readdir,rename,unlink";
+    char *workload_list = default_workloads;
+    const char *image = NULL;
+    const char *output = NULL;
+    storage_opts.cache_kb = 8192;
+    storage_opts.buffer_kb = 16384;
+    storage_opts.readahead_kb = 1024;
+    storage_opts.compress_min = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:a:t:r:w:c:B:R:F:W:DZUOi:m:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nfiles = atoi(optarg);
+            break;
+        case 's':
+            file_size = atol(optarg);
+            break;
+        case 'a':
+            io_size = atol(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            nreaddirs = atoi(optarg);
+            break;
+        case 'w':
+            workload_list = optarg;
+            break;
+        case 'c':
+            storage_opts.cache_kb = atoi(optarg);
+            break;
+        case 'B':
+            storage_opts.buffer_kb = atoi(optarg);
+            break;
+        case 'R':
+            storage_opts.readahead_kb = atoi(optarg);
+            break;
+        case 'F':
+            storage_opts.durability = parse_durability(optarg);
+            if (storage_opts.durability < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'W':
+            storage_opts.writeback_ms = atoi(optarg);
+            break;
+        case 'D':
+            storage_opts.dedup = 1;
+            break;
+        case 'Z':
+            storage_opts.compress = 1;
+            break;
+        case 'U':
+            storage_opts.use_uring = 1;
+            break;
+        case 'O':
+            storage_opts.direct = 1;
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 'm':
+            mountpoint = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || nthreads <= 0 || nfiles < nthreads || file_size < 0 || io_size < 0 || nreaddirs < 0 ||
+        parse_workloads(workload_list) < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Without -o the JSON keeps stdout to itself: what the storage layer prints goes to stderr
+    FILE *out = NULL;
+    if (output == NULL)
+    {
+        int fd = dup(STDOUT_FILENO);
+        out = fd < 0 ? NULL : fdopen(fd, "w");
+        if (out == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            perror("stdout");
+            return 1;
+        }
+    }
+
+    // A fresh image, big enough for the files with room to spare
+    char temp_image[] = "/tmp/nufs-bench-XXXXXX";
+    if (mountpoint == NULL)
+    {
+        if (image == NULL)
+        {
+            int fd = mkstemp(temp_image);
+            if (fd < 0)
+            {
+                perror("mkstemp");
+                return 1;
+            }
+            close(fd);
+            image = temp_image;
+        }
+        long long bytes = (long long)nfiles * (file_size + BLOCK_SIZE) * 2 + (64LL << 20);
+        int rv = storage_format(image, (int)(bytes / BLOCK_SIZE), nfiles + nthreads + 64, 0, 0);
+        if (rv == 0)
+        {
+            rv = storage_init(image);
+        }
+        // The image stays open until storage_close, a temporary one can go right away
+        if (image == temp_image)
+        {
+            unlink(temp_image);
+        }
+        if (rv < 0)
+        {
+            fprintf(stderr, "%s: can not set up %s: %s\n", argv[0], image, strerror(-rv));
+            return 1;
+        }
+        storage_start_flusher();
+    }
+
+    // Every thread gets a directory of its own
+    for (int t = 0; t < nthreads; t++)
+    {
+        char path[512];
+        dir_path(path, sizeof(path), t);
+        int rv = mountpoint ? mkdir(path, 0755) : storage_create(path, S_IFDIR | 0755);
+        if (rv < 0)
+        {
+            fprintf(stderr, "%s: can not make %s\n", argv[0], path);
+            return 1;
+        }
+    }
+
+    int per_thread = nfiles / nthreads;
+    int max_ops = per_thread > nreaddirs ? per_thread : nreaddirs;
+    thread_state_t *states = calloc(nthreads, sizeof(thread_state_t));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    uint64_t *all = malloc((size_t)max_ops * nthreads * sizeof(uint64_t) + 1);
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&end_barrier, NULL, nthreads + 1);
+    for (int t = 0; t < nthreads; t++)
+    {
+        states[t].id = t;
+        states[t].latencies = malloc((size_t)max_ops * sizeof(uint64_t));
+        pthread_create(&threads[t], NULL, thread_main, &states[t]);
+    }
+
+    result_t results[MAX_WORKLOADS];
+    int failed = 0;
+    for (int n = 0; n < nworkloads; n++)
+    {
+        current = workloads[n];
+        pthread_barrier_wait(&start_barrier);
+        uint64_t begin = now_ns();
+        pthread_barrier_wait(&end_barrier);
+        double seconds = (now_ns() - begin) / 1e9;
+        renamed |= current == W_RENAME;
+
+        int count = 0;
+        int errors = 0;
+        for (int t = 0; t < nthreads; t++)
+        {
+            memcpy(all + count, states[t].latencies, states[t].count * sizeof(uint64_t));
+            count += states[t].count;
+            errors += states[t].errors;
+        }
+        qsort(all, count, sizeof(uint64_t), compare_u64);
+        failed |= errors > 0;
+        results[n] = (result_t){current, count, errors, seconds,
+                                quantile_us(all, count, 0.5), quantile_us(all, count, 0.99), quantile_us(all, count, 0.999)};
+    }
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        pthread_join(threads[t], NULL);
+        free(states[t].latencies);
+    }
+    free(states);
+    free(threads);
+    free(all);
+
+    if (mountpoint == NULL)
+    {
+        storage_close();
+    }
+    if (output)
+    {
+        out = fopen(output, "w");
+        if (out == NULL)
+        {
+            perror(output);
+            return 1;
+        }
+    }
+    fprintf(out, "{\n  \"mode\": \"%s\",\n  \"files\": %d,\n  \"size\": %ld,\n  \"threads\": %d,\n  \"results\": [",
+            mountpoint ? "fuse" : "storage", per_thread * nthreads, file_size, nthreads);
+    for (int n = 0; n < nworkloads; n++)
+    {
+        result_t *r = &results[n];
+        fprintf(out, "%s\n    {\"workload\": \"%s\", \"ops\": %d, \"errors\": %d, \"seconds\": %.6f, "
+                     "\"ops_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+                n ? "," : "", workload_names[r->workload], r->ops, r->errors, r->seconds,
+                r->seconds > 0 ? r->ops / r->seconds : 0.0, r->p50_us, r->p99_us, r->p999_us);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+
+    if (failed)
+    {
+        fprintf(stderr, "%s: some operations failed\n", argv[0]);
+    }
+    return failed;
+}
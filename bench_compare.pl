@@ -0,0 +1,54 @@
+#!/usr/bin/perl
+# Compare two nufs-bench results, and fail if the second one regressed
+#
+#   perl bench_compare.pl [-t percent] [-p percent] baseline.json current.json
+#
+# A workload regresses when its ops/sec drops by more than -t percent (default 10),
+# or its p99 latency grows by more than -p percent (default 25)
+use strict;
+use warnings;
+use JSON::PP;
+use Getopt::Std;
+
+my %opts = (t => 10, p => 25);
+getopts('t:p:', \%opts) && @ARGV == 2
+    or die "usage: $0 [-t percent] [-p percent] baseline.json current.json\n";
+
+sub load {
+    my ($file) = @_;
+    open(my $fh, '<', $file) or die "$file: $!\n";
+    local $/;
+    my $data = decode_json(<$fh>);
+    return { map { $_->{workload} => $_ } @{$data->{results}} }, $data;
+}
+
+my ($base, $base_run) = load($ARGV[0]);
+my ($cur, $cur_run) = load($ARGV[1]);
+
+for my $key (qw(mode files size threads)) {
+    warn "warning: $key differs ($base_run->{$key} vs $cur_run->{$key}), the runs may not be comparable\n"
+        if $base_run->{$key} ne $cur_run->{$key};
+}
+
+sub change {
+    my ($old, $new) = @_;
+    return $old > 0 ? ($new - $old) / $old * 100 : 0;
+}
+
+my $regressed = 0;
+printf "%-10s %14s %14s %8s %12s %12s %8s\n", 'workload', 'base ops/s', 'ops/s', 'change', 'base p99us', 'p99us', 'change';
+for my $name (map { $_->{workload} } @{$cur_run->{results}}) {
+    my ($b, $c) = ($base->{$name}, $cur->{$name});
+    if (!$b) {
+        printf "%-10s %14s %14.1f\n", $name, '-', $c->{ops_per_sec};
+        next;
+    }
+    my $ops = change($b->{ops_per_sec}, $c->{ops_per_sec});
+    my $p99 = change($b->{p99_us}, $c->{p99_us});
+    my $bad = $ops < -$opts{t} || $p99 > $opts{p};
+    $regressed ||= $bad;
+    printf "%-10s %14.1f %14.1f %+7.1f%% %12.3f %12.3f %+7.1f%%%s\n", $name,
+        $b->{ops_per_sec}, $c->{ops_per_sec}, $ops, $b->{p99_us}, $c->{p99_us}, $p99,
+        $bad ? '  REGRESSED' : '';
+}
+exit($regressed ? 1 : 0);
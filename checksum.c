@@ -0,0 +1,148 @@
+#include "checksum.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78 // The Castagnoli polynomial, bit-reflected
+#define LANE 1360       // Bytes per lane of the hardware loop: three lanes and 16 bytes make a 4 KiB block
+
+// Both paths update the CRC register as it is, checksum_crc32c adds the inversions
+static uint32_t table[8][256];       // table[k][b]: byte b followed by k zero bytes
+static uint32_t shift_table[4][256]; // Advances a register past LANE zero bytes, a byte of it at a time
+static int hardware = 0;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Slicing-by-8: eight table lookups per 8 bytes, none depending on the one before
+static uint32_t update_tables(uint32_t crc, const unsigned char *p, size_t size)
+{
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v ^= crc;
+        crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+              table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+    }
+    for (; size > 0; p++, size--)
+    {
+        crc = table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t shift_lane(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^ shift_table[2][(crc >> 16) & 0xff] ^
+           shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction takes 3 cycles but issues every cycle: three lanes over
+// neighbouring stretches keep it busy, then their registers are chained together,
+// the CRC being linear: the register after A then B is A's advanced past |B| zero
+// bytes, xor B's from 0
+__attribute__((target("sse4.2"))) static uint32_t update_hardware(uint32_t crc, const unsigned char *p, size_t size)
+{
+    for (; size >= 3 * LANE; p += 3 * LANE, size -= 3 * LANE)
+    {
+        uint64_t c0 = crc;
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (int k = 0; k < LANE; k += 8)
+        {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + k, sizeof(v0));
+            memcpy(&v1, p + LANE + k, sizeof(v1));
+            memcpy(&v2, p + 2 * LANE + k, sizeof(v2));
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        crc = shift_lane(shift_lane((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+    }
+    uint64_t c = crc;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; size > 0; p++, size--)
+    {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+static void build_tables()
+{
+    for (int b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+        }
+        table[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+        }
+    }
+
+    // Advancing past zeros is linear too: build it from where each single bit ends up
+    static const unsigned char zeros[LANE];
+    uint32_t bits[32];
+    for (int bit = 0; bit < 32; bit++)
+    {
+        bits[bit] = update_tables(1u << bit, zeros, LANE);
+    }
+    for (int k = 0; k < 4; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            uint32_t crc = 0;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc ^= b & (1 << bit) ? bits[8 * k + bit] : 0;
+            }
+            shift_table[k][b] = crc;
+        }
+    }
+
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+// Build the tables and pick the path, once per process
+void checksum_init()
+{
+    pthread_once(&init_once, build_tables);
+}
+
+// Whether checksum_crc32c runs on the crc32 instruction
+int checksum_hardware()
+{
+    return hardware;
+}
+
+// The CRC32C of size bytes of data, continuing from crc (0 to start)
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t size)
+{
+#if defined(__x86_64__)
+    if (hardware)
+    {
+        return ~update_hardware(~crc, data, size);
+    }
+#endif
+    return ~update_tables(~crc, data, size);
+}
@@ -0,0 +1,15 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), as iSCSI and ext4 use it: the crc32 instruction of SSE4.2 where
+// the CPU has it, slicing-by-8 tables otherwise, both giving the same values
+// Safe to call from any thread once checksum_init returned
+
+void checksum_init();
+int checksum_hardware();
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif // CHECKSUM_H
@@ -0,0 +1,200 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+// A block is a series of sequences: a token byte (literal count in the high nibble,
+// match length - MIN_MATCH in the low one, 15 meaning more length bytes follow),
+// the literals, then the match as a 2-byte little-endian offset back into the output;
+// the last sequence stops after its literals
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // A block ends on at least this many literals
+#define MATCH_LIMIT 12   // and no match starts closer than this to the end
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define SKIP_SHIFT 6     // Every 2^SKIP_SHIFT probes without a match, probe one byte further apart,
+                         // so data that does not compress is skimmed rather than searched
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Append the bytes of a length past the 15 its token nibble holds
+static unsigned char *put_length(unsigned char *op, int len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Append a sequence: nlit literals from lit, then a match of mlen bytes offset back,
+// or no match if mlen is 0
+// Return the new end of the output, or NULL if the sequence does not fit before end
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *end, const unsigned char *lit, int nlit,
+                                   int offset, int mlen)
+{
+    int mcode = mlen > 0 ? mlen - MIN_MATCH : 0;
+    int need = 1 + nlit + nlit / 255 + 1 + (mlen > 0 ? 2 + mcode / 255 + 1 : 0);
+    if (need > end - op)
+    {
+        return NULL;
+    }
+
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+    if (nlit >= 15)
+    {
+        op = put_length(op, nlit);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen > 0)
+    {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (mcode >= 15)
+        {
+            op = put_length(op, mcode);
+        }
+    }
+    return op;
+}
+
+// Compress size bytes of src into at most cap bytes at dst, greedily taking the
+// match a hash of the next 4 bytes finds
+// Return the compressed size, or 0 as soon as it would not fit in cap
+int compress_encode(const void *src, int size, void *dst, int cap)
+{
+    const unsigned char *in = src;
+    unsigned char *op = dst;
+    const unsigned char *end = op + cap;
+    int table[1 << HASH_BITS]; // Where each hash of 4 bytes was last seen, -1 for nowhere
+    memset(table, 0xff, sizeof(table));
+
+    int anchor = 0; // The first byte not emitted yet
+    int pos = 0;
+    int misses = 0; // Probes since the last match
+    while (pos <= size - MATCH_LIMIT)
+    {
+        uint32_t seq = read32(in + pos);
+        unsigned h = hash4(seq);
+        int cand = table[h];
+        table[h] = pos;
+        if (cand < 0 || pos - cand > MAX_OFFSET || read32(in + cand) != seq)
+        {
+            pos += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+
+        // Grow the match backwards over the pending literals, then forwards
+        while (pos > anchor && cand > 0 && in[pos - 1] == in[cand - 1])
+        {
+            pos--;
+            cand--;
+        }
+        int len = MIN_MATCH;
+        while (pos + len < size - LAST_LITERALS && in[pos + len] == in[cand + len])
+        {
+            len++;
+        }
+
+        op = put_sequence(op, end, in + anchor, pos - anchor, pos - cand, len);
+        if (op == NULL)
+        {
+            return 0;
+        }
+        pos += len;
+        anchor = pos;
+        misses = 0;
+    }
+
+    op = put_sequence(op, end, in + anchor, size - anchor, 0, 0);
+    return op == NULL ? 0 : op - (unsigned char *)dst;
+}
+
+// Add the bytes extending a token nibble of 15 to *len, which must stay within limit
+// Return 0, or -1 if they run past iend or over limit
+static int get_length(const unsigned char **ip, const unsigned char *iend, int *len, int limit)
+{
+    if (*len != 15)
+    {
+        return 0;
+    }
+    int b;
+    do
+    {
+        if (*ip == iend || *len > limit)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Decompress the size bytes at src into at most cap bytes at dst
+// Every length and offset is checked, whatever src holds
+// Return the decompressed size, or -1 if src is not a valid block or does not fit in cap
+int compress_decode(const void *src, int size, void *dst, int cap)
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = ip + size;
+    unsigned char *out = dst;
+    int pos = 0;
+
+    while (ip < iend)
+    {
+        int token = *ip++;
+        int nlit = token >> 4;
+        if (get_length(&ip, iend, &nlit, cap) < 0 || nlit > iend - ip || nlit > cap - pos)
+        {
+            return -1;
+        }
+        memcpy(out + pos, ip, nlit);
+        ip += nlit;
+        pos += nlit;
+        if (ip == iend)
+        {
+            break; // The last sequence has no match
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int mlen = token & 15;
+        if (get_length(&ip, iend, &mlen, cap) < 0)
+        {
+            return -1;
+        }
+        mlen += MIN_MATCH;
+        if (offset == 0 || offset > pos || mlen > cap - pos)
+        {
+            return -1;
+        }
+
+        // A match closer than its length repeats its last offset bytes: copy from where it
+        // starts in chunks that never overlap their source, each twice the one before
+        int from = pos - offset;
+        while (mlen > 0)
+        {
+            int chunk = mlen < pos - from ? mlen : pos - from;
+            memcpy(out + pos, out + from, chunk);
+            pos += chunk;
+            mlen -= chunk;
+        }
+    }
+    return pos;
+}
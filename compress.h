@@ -0,0 +1,11 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// A fast LZ77 codec in the LZ4 block format: byte-aligned literal runs and matches,
+// no entropy coding, so both directions run at memory-copy speeds
+// Stateless, safe to call from any thread
+
+int compress_encode(const void *src, int size, void *dst, int cap);
+int compress_decode(const void *src, int size, void *dst, int cap);
+
+#endif // COMPRESS_H
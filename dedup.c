@@ -0,0 +1,248 @@
+#include "dedup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// The XXH64 hash: four independent lanes over 32-byte stripes, so the multiplies
+// of one stripe overlap, at several GB/s on one core; far from cryptographic,
+// which is fine as long as nothing is shared on the hash alone
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t lane_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static uint64_t merge_lane(uint64_t h, uint64_t lane)
+{
+    h ^= lane_round(0, lane);
+    return h * PRIME1 + PRIME4;
+}
+
+// Hash size bytes of data, never 0: the hash table of storage.c uses 0 for "no hash"
+uint64_t dedup_hash(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+        uint64_t v1 = PRIME1 + PRIME2;
+        uint64_t v2 = PRIME2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -PRIME1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = lane_round(v1, read64(p));
+            v2 = lane_round(v2, read64(p + 8));
+            v3 = lane_round(v3, read64(p + 16));
+            v4 = lane_round(v4, read64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_lane(h, v1);
+        h = merge_lane(h, v2);
+        h = merge_lane(h, v3);
+        h = merge_lane(h, v4);
+    }
+    else
+    {
+        h = PRIME5;
+    }
+    h += size;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= lane_round(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h != 0 ? h : 1;
+}
+
+// Open addressing with linear probing, one block per hash
+// block EMPTY is a free slot, TOMBSTONE a removed entry
+#define EMPTY -1
+#define TOMBSTONE -2
+
+typedef struct
+{
+    uint64_t hash;
+    int block;
+} entry_t;
+
+static entry_t *slots = NULL;
+static unsigned capacity = 0; // Always a power of two, 0 until dedup_init
+static unsigned count = 0;    // Live entries
+static unsigned tombstones = 0;
+
+// Reallocate the slots with room for new_capacity, and re-insert every live entry
+// Return 0, or -ENOMEM with the old slots kept
+static int resize(unsigned new_capacity)
+{
+    entry_t *fresh = malloc((size_t)new_capacity * sizeof(entry_t));
+    if (fresh == NULL)
+    {
+        return -ENOMEM;
+    }
+    for (unsigned pos = 0; pos < new_capacity; pos++)
+    {
+        fresh[pos].block = EMPTY;
+    }
+
+    unsigned mask = new_capacity - 1;
+    for (unsigned k = 0; k < capacity; k++)
+    {
+        if (slots[k].block >= 0)
+        {
+            unsigned pos = (unsigned)slots[k].hash & mask;
+            while (fresh[pos].block != EMPTY)
+            {
+                pos = (pos + 1) & mask;
+            }
+            fresh[pos] = slots[k];
+        }
+    }
+    free(slots);
+    slots = fresh;
+    capacity = new_capacity;
+    tombstones = 0;
+    return 0;
+}
+
+// Start an empty index, sized for about hint entries before it has to grow
+// Return 0, or -ENOMEM
+int dedup_init(int hint)
+{
+    dedup_destroy();
+    unsigned want = 256;
+    while (want < (unsigned)hint * 2 && want < (1u << 30))
+    {
+        want *= 2;
+    }
+    return resize(want);
+}
+
+void dedup_destroy()
+{
+    free(slots);
+    slots = NULL;
+    capacity = 0;
+    count = 0;
+    tombstones = 0;
+}
+
+// Return the block indexed for hash, or -1
+int dedup_find(uint64_t hash)
+{
+    if (capacity == 0)
+    {
+        return -1;
+    }
+    unsigned mask = capacity - 1;
+    for (unsigned pos = (unsigned)hash & mask; slots[pos].block != EMPTY; pos = (pos + 1) & mask)
+    {
+        if (slots[pos].block >= 0 && slots[pos].hash == hash)
+        {
+            return slots[pos].block;
+        }
+    }
+    return -1;
+}
+
+// Index block under hash, unless some block already is
+// Return 1 if block was indexed, 0 if another one keeps the hash, or -ENOMEM
+int dedup_insert(uint64_t hash, int block)
+{
+    if (capacity == 0 || dedup_find(hash) >= 0)
+    {
+        return 0;
+    }
+    // Keep the load (including tombstones) under 3/4, grow only if live entries need it
+    if ((count + tombstones + 1) * 4 > capacity * 3)
+    {
+        unsigned want = capacity;
+        while ((count + 1) * 2 > want)
+        {
+            want *= 2;
+        }
+        if (resize(want) < 0)
+        {
+            return -ENOMEM;
+        }
+    }
+
+    unsigned mask = capacity - 1;
+    unsigned pos = (unsigned)hash & mask;
+    while (slots[pos].block >= 0)
+    {
+        pos = (pos + 1) & mask;
+    }
+    if (slots[pos].block == TOMBSTONE)
+    {
+        tombstones--;
+    }
+    slots[pos] = (entry_t){hash, block};
+    count++;
+    return 1;
+}
+
+// Drop the entry of block under hash, if it is the one indexed
+void dedup_remove(uint64_t hash, int block)
+{
+    if (capacity == 0)
+    {
+        return;
+    }
+    unsigned mask = capacity - 1;
+    for (unsigned pos = (unsigned)hash & mask; slots[pos].block != EMPTY; pos = (pos + 1) & mask)
+    {
+        if (slots[pos].block == block && slots[pos].hash == hash)
+        {
+            slots[pos].block = TOMBSTONE;
+            count--;
+            tombstones++;
+            return;
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content index for deduplication: maps the hash of a full data block to the one
+// block indexed for those contents, so a write of the same bytes can share it
+// The hash only nominates a candidate, the caller compares the bytes before sharing
+// Not thread safe, the caller serializes every call (storage.c holds alloc_lock)
+
+uint64_t dedup_hash(const void *data, size_t size);
+int dedup_init(int hint);
+void dedup_destroy();
+int dedup_find(uint64_t hash);
+int dedup_insert(uint64_t hash, int block);
+void dedup_remove(uint64_t hash, int block);
+
+#endif // DEDUP_H
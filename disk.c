@@ -0,0 +1,556 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "disk.h"
+#include "uring.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DIRECT_ALIGN 4096 // Buffers, sizes and offsets of O_DIRECT transfers are multiples of this
+
+// An I/O backend, every transfer positioned at a byte offset of the image
+typedef struct
+{
+    const char *name;
+    // Transfer the buffers of iov back to back from offset, return 0 or -errno
+    int (*vector)(const struct iovec *iov, int iovcnt, off_t offset, int write);
+    // Run transfers independent of each other, return 0 or the first -errno
+    int (*submit)(disk_req_t *reqs, int n);
+    // Write the buffers of iov back to back from offset, then make them and everything
+    // written before durable, return 0 or -errno
+    int (*write_sync)(const struct iovec *iov, int iovcnt, off_t offset);
+    // Make everything written so far durable, return 0 or -errno
+    int (*sync)();
+} backend_t;
+
+static int disk_fd = -1;        // Descriptor of the disk image, open for the life of the mount
+static char *disk_map = NULL;   // The whole image mapped shared, or NULL when not mapped
+static off_t disk_size = 0;     // Size of the image in bytes
+static int direct_io = 0;       // The image is open O_DIRECT
+static const backend_t *backend;
+static char backend_name[32];
+
+// Transfers of O_DIRECT that are not aligned go through a bounce buffer: writing part of
+// a block reads it first, and no other such write may come in between
+static pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Positioned I/O, one system call per transfer, a short one carries on from where it stopped
+
+static int pio_vector(const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+    struct iovec local[DISK_IOV_MAX];
+    size_t size = 0;
+    for (int k = 0; k < iovcnt; k++)
+    {
+        local[k] = iov[k];
+        size += iov[k].iov_len;
+    }
+
+    struct iovec *cur = local;
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = write ? pwritev(disk_fd, cur, iovcnt, offset + done)
+                          : preadv(disk_fd, cur, iovcnt, offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0)
+        {
+            // Past the written end of a sparse image reads back as zeros
+            for (int k = 0; k < iovcnt; k++)
+            {
+                memset(cur[k].iov_base, 0, cur[k].iov_len);
+            }
+            break;
+        }
+        done += n;
+
+        // Skip the buffers completed, and the done part of the next one
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len)
+        {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int pio_submit(disk_req_t *reqs, int n)
+{
+    int rv = 0;
+    for (int k = 0; k < n; k++)
+    {
+        struct iovec iov = {reqs[k].buf, reqs[k].size};
+        int err = pio_vector(&iov, 1, reqs[k].offset, reqs[k].write);
+        rv = rv == 0 ? err : rv;
+    }
+    return rv;
+}
+
+static int pio_sync()
+{
+    return fdatasync(disk_fd) < 0 ? -errno : 0;
+}
+
+static int pio_write_sync(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    int rv = pio_vector(iov, iovcnt, offset, 1);
+    return rv == 0 ? pio_sync() : rv;
+}
+
+static const backend_t pio_backend = {"pread/pwrite", pio_vector, pio_submit, pio_write_sync, pio_sync};
+
+// The shared mapping, reads and writes are memcpy
+
+static int map_vector(const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+    for (int k = 0; k < iovcnt; k++)
+    {
+        if (write)
+        {
+            memcpy(disk_map + offset, iov[k].iov_base, iov[k].iov_len);
+        }
+        else
+        {
+            memcpy(iov[k].iov_base, disk_map + offset, iov[k].iov_len);
+        }
+        offset += iov[k].iov_len;
+    }
+    return 0;
+}
+
+static int map_submit(disk_req_t *reqs, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        struct iovec iov = {reqs[k].buf, reqs[k].size};
+        map_vector(&iov, 1, reqs[k].offset, reqs[k].write);
+    }
+    return 0;
+}
+
+static int map_sync()
+{
+    if (msync(disk_map, disk_size, MS_SYNC) < 0)
+    {
+        return -errno;
+    }
+    return pio_sync();
+}
+
+static int map_write_sync(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    map_vector(iov, iovcnt, offset, 1);
+    return map_sync();
+}
+
+static const backend_t map_backend = {"mmap", map_vector, map_submit, map_write_sync, map_sync};
+
+// io_uring, every batch one system call on the calling thread's ring
+// Whatever the ring did not complete in full (a short transfer, or no ring for this
+// thread) is redone with positioned I/O, in order: transfers are idempotent, and a
+// sync redone after the transfers before it still covers them
+
+static int uring_finish(uring_op_t *ops, int n)
+{
+    int rv = 0;
+    for (int k = 0; k < n; k++)
+    {
+        size_t size = 0;
+        for (int j = 0; j < ops[k].iovcnt; j++)
+        {
+            size += ops[k].iov[j].iov_len;
+        }
+        if (ops[k].result >= 0 && (size_t)ops[k].result == size)
+        {
+            continue;
+        }
+        int err = ops[k].sync ? pio_sync() : pio_vector(ops[k].iov, ops[k].iovcnt, ops[k].offset, ops[k].write);
+        rv = rv == 0 ? err : rv;
+    }
+    return rv;
+}
+
+static int uring_vector(const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+    uring_op_t op = {write, 0, iov, iovcnt, offset, 0, -ECANCELED};
+    uring_run(&op, 1);
+    return uring_finish(&op, 1);
+}
+
+static int uring_submit(disk_req_t *reqs, int n)
+{
+    int rv = 0;
+    for (int done = 0; done < n; done += URING_ENTRIES)
+    {
+        int batch = n - done < URING_ENTRIES ? n - done : URING_ENTRIES;
+        struct iovec iov[URING_ENTRIES];
+        uring_op_t ops[URING_ENTRIES];
+        for (int k = 0; k < batch; k++)
+        {
+            iov[k] = (struct iovec){reqs[done + k].buf, reqs[done + k].size};
+            ops[k] = (uring_op_t){reqs[done + k].write, 0, &iov[k], 1, reqs[done + k].offset, 0, -ECANCELED};
+        }
+        uring_run(ops, batch);
+        int err = uring_finish(ops, batch);
+        rv = rv == 0 ? err : rv;
+    }
+    return rv;
+}
+
+static int uring_sync()
+{
+    uring_op_t op = {0, 1, NULL, 0, 0, 0, -ECANCELED};
+    uring_run(&op, 1);
+    return uring_finish(&op, 1);
+}
+
+// The write and the sync behind it go out linked, with one system call
+static int uring_write_sync(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    uring_op_t ops[2] = {{1, 0, iov, iovcnt, offset, 1, -ECANCELED}, {0, 1, NULL, 0, 0, 0, -ECANCELED}};
+    uring_run(ops, 2);
+    return uring_finish(ops, 2);
+}
+
+static const backend_t uring_backend = {"io_uring", uring_vector, uring_submit, uring_write_sync, uring_sync};
+
+// Whether a transfer can go to an O_DIRECT image as it is
+static int direct_aligned(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    uintptr_t bits = offset;
+    for (int k = 0; k < iovcnt; k++)
+    {
+        bits |= (uintptr_t)iov[k].iov_base | iov[k].iov_len;
+    }
+    return bits % DIRECT_ALIGN == 0;
+}
+
+// Transfer the buffers of iov back to back from offset through an aligned bounce
+// buffer covering whole blocks, then sync if asked
+// Return 0, or -errno
+static int bounce(const struct iovec *iov, int iovcnt, off_t offset, int write, int sync)
+{
+    size_t size = 0;
+    for (int k = 0; k < iovcnt; k++)
+    {
+        size += iov[k].iov_len;
+    }
+    off_t from = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    off_t to = (offset + size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    char *buf = NULL;
+    if (posix_memalign((void **)&buf, DIRECT_ALIGN, to - from) != 0)
+    {
+        return -ENOMEM;
+    }
+    struct iovec whole = {buf, to - from};
+
+    if (write)
+    {
+        pthread_mutex_lock(&bounce_lock);
+    }
+    int rv = 0;
+    if (!write || from < offset || to > offset + (off_t)size)
+    {
+        rv = backend->vector(&whole, 1, from, 0);
+    }
+    char *p = buf + (offset - from);
+    for (int k = 0; k < iovcnt && rv == 0; k++)
+    {
+        if (write)
+        {
+            memcpy(p, iov[k].iov_base, iov[k].iov_len);
+        }
+        else
+        {
+            memcpy(iov[k].iov_base, p, iov[k].iov_len);
+        }
+        p += iov[k].iov_len;
+    }
+    if (write && rv == 0)
+    {
+        rv = sync ? backend->write_sync(&whole, 1, from) : backend->vector(&whole, 1, from, 1);
+    }
+    if (write)
+    {
+        pthread_mutex_unlock(&bounce_lock);
+    }
+    free(buf);
+    return rv;
+}
+
+// Transfer through the backend, bouncing what O_DIRECT does not take as it is
+static int transfer(const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+    if (direct_io && !direct_aligned(iov, iovcnt, offset))
+    {
+        return bounce(iov, iovcnt, offset, write, 0);
+    }
+    return backend->vector(iov, iovcnt, offset, write);
+}
+
+// Open the disk image at path
+// If size is > 0, a fresh image of size bytes is made there instead, replacing any file
+// at path, every block of it reading back as zeros (the file stays sparse until written)
+// flags pick the backend, DISK_MMAP or DISK_URING, positioned I/O without either, and
+// DISK_DIRECT; what the kernel or file system does not support falls back, with a message
+// Return 0, or -errno on failure
+int disk_open(const char *path, off_t size, int flags)
+{
+    int mode = size > 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    direct_io = (flags & DISK_DIRECT) && !(flags & DISK_MMAP);
+    disk_fd = open(path, mode | (direct_io ? O_DIRECT : 0), 0644);
+    if (disk_fd < 0 && direct_io && errno == EINVAL)
+    {
+        perror("Failed opening disk image O_DIRECT, going through the page cache");
+        direct_io = 0;
+        disk_fd = open(path, mode, 0644);
+    }
+    if (disk_fd < 0)
+    {
+        int err = errno;
+        perror("Failed opening disk image");
+        return -err;
+    }
+
+    if (size > 0 && ftruncate(disk_fd, size) < 0)
+    {
+        int err = errno;
+        perror("Failed sizing disk image");
+        disk_close();
+        return -err;
+    }
+
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0)
+    {
+        int err = errno;
+        disk_close();
+        return -err;
+    }
+    disk_size = st.st_size;
+
+    backend = &pio_backend;
+    if (flags & DISK_MMAP)
+    {
+        void *map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("Failed mapping disk image, falling back to pread/pwrite");
+        }
+        else
+        {
+            disk_map = map;
+            backend = &map_backend;
+        }
+    }
+    else if (flags & DISK_URING)
+    {
+        int rv = uring_init(disk_fd);
+        if (rv < 0)
+        {
+            printf("io_uring not available (%s), falling back to pread/pwrite\n", strerror(-rv));
+        }
+        else
+        {
+            backend = &uring_backend;
+        }
+    }
+    snprintf(backend_name, sizeof(backend_name), "%s%s", backend->name, direct_io ? ", O_DIRECT" : "");
+    return 0;
+}
+
+// Size of the open image in bytes
+off_t disk_get_size()
+{
+    return disk_size;
+}
+
+// The backend disk_open picked, for reports
+const char *disk_backend()
+{
+    return backend_name;
+}
+
+// Unmap and close the disk image
+void disk_close()
+{
+    if (backend == &uring_backend)
+    {
+        uring_shutdown();
+    }
+    backend = &pio_backend;
+    if (disk_map)
+    {
+        munmap(disk_map, disk_size);
+        disk_map = NULL;
+    }
+    if (disk_fd >= 0)
+    {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    direct_io = 0;
+}
+
+// Long-lived buffers most transfers go to or from, the block cache's frames: the io_uring
+// backend registers them with the kernel once, NULL takes that back before they are freed
+void disk_register_buffers(void *base, size_t size)
+{
+    uring_register_buffers(base, size);
+}
+
+// Read size bytes at offset of the image into buf
+// Return the number of bytes read, or -errno
+int disk_read(void *buf, size_t size, off_t offset)
+{
+    if (offset < 0 || offset >= disk_size)
+    {
+        return 0;
+    }
+    if (offset + (off_t)size > disk_size)
+    {
+        size = disk_size - offset;
+    }
+
+    struct iovec iov = {buf, size};
+    int rv = transfer(&iov, 1, offset, 0);
+    return rv < 0 ? rv : (int)size;
+}
+
+// Write size bytes from buf at offset of the image
+// Return the number of bytes written, or -errno
+int disk_write(const void *buf, size_t size, off_t offset)
+{
+    if (offset < 0 || offset + (off_t)size > disk_size)
+    {
+        return -ENOSPC;
+    }
+
+    struct iovec iov = {(void *)buf, size};
+    int rv = transfer(&iov, 1, offset, 1);
+    return rv < 0 ? rv : (int)size;
+}
+
+// Positioned vector I/O of the buffers in iov, back to back from offset, with one system call
+// when possible
+// Return the number of bytes transferred, or -errno
+static int disk_vector(const struct iovec *iov, int iovcnt, off_t offset, int write)
+{
+    size_t size = 0;
+    if (iovcnt > DISK_IOV_MAX)
+    {
+        return -EINVAL;
+    }
+    for (int k = 0; k < iovcnt; k++)
+    {
+        size += iov[k].iov_len;
+    }
+    if (offset < 0 || offset + (off_t)size > disk_size)
+    {
+        return write ? -ENOSPC : -EINVAL;
+    }
+
+    int rv = transfer(iov, iovcnt, offset, write);
+    return rv < 0 ? rv : (int)size;
+}
+
+// Read from the image at offset into the buffers of iov, in order
+int disk_readv(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return disk_vector(iov, iovcnt, offset, 0);
+}
+
+// Write the buffers of iov to the image at offset, in order
+int disk_writev(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return disk_vector(iov, iovcnt, offset, 1);
+}
+
+// Run the transfers of reqs, independent of each other and in no particular order:
+// the io_uring backend has all of them in flight at once
+// Return 0, or the first -errno (every transfer is tried anyway)
+int disk_submit(disk_req_t *reqs, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        if (reqs[k].offset < 0 || reqs[k].offset + (off_t)reqs[k].size > disk_size)
+        {
+            return reqs[k].write ? -ENOSPC : -EINVAL;
+        }
+    }
+    if (!direct_io)
+    {
+        return backend->submit(reqs, n);
+    }
+
+    // The aligned ones go out together, the others bounce one by one
+    disk_req_t *direct = malloc(n * sizeof(disk_req_t));
+    if (direct == NULL && n > 0)
+    {
+        return -ENOMEM;
+    }
+    int ndirect = 0;
+    int rv = 0;
+    for (int k = 0; k < n; k++)
+    {
+        struct iovec iov = {reqs[k].buf, reqs[k].size};
+        if (direct_aligned(&iov, 1, reqs[k].offset))
+        {
+            direct[ndirect++] = reqs[k];
+        }
+        else
+        {
+            int err = bounce(&iov, 1, reqs[k].offset, reqs[k].write, 0);
+            rv = rv == 0 ? err : rv;
+        }
+    }
+    int err = backend->submit(direct, ndirect);
+    free(direct);
+    return rv == 0 ? err : rv;
+}
+
+// Write the buffers of iov at offset, in order, and sync the image behind them: the
+// io_uring backend submits both at once, the sync linked to the write
+// Return 0, or -errno
+int disk_write_sync(const struct iovec *iov, int iovcnt, off_t offset)
+{
+    size_t size = 0;
+    for (int k = 0; k < iovcnt; k++)
+    {
+        size += iov[k].iov_len;
+    }
+    if (iovcnt > DISK_IOV_MAX || offset < 0 || offset + (off_t)size > disk_size)
+    {
+        return -ENOSPC;
+    }
+    if (direct_io && !direct_aligned(iov, iovcnt, offset))
+    {
+        return bounce(iov, iovcnt, offset, 1, 1);
+    }
+    return backend->write_sync(iov, iovcnt, offset);
+}
+
+// Flush the image to stable storage
+int disk_sync()
+{
+    return backend->sync();
+}
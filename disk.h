@@ -0,0 +1,40 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// The disk image is opened once at mount and kept open until unmount.
+// All access goes through one backend: positioned I/O on that descriptor,
+// memcpy on a shared mapping of it, or io_uring submissions on it.
+
+#define DISK_IOV_MAX 64 // Most buffers one disk_readv or disk_writev takes
+
+// Flags of disk_open
+#define DISK_MMAP 1   // Map the whole image, reads and writes become memcpy
+#define DISK_URING 2  // Submit through io_uring, positioned I/O where the kernel has none
+#define DISK_DIRECT 4 // Open the image O_DIRECT, around the page cache (not when mapped)
+
+// One transfer of a batch, independent of the others in it
+typedef struct
+{
+    void *buf;
+    size_t size;
+    off_t offset;
+    int write;
+} disk_req_t;
+
+int disk_open(const char *path, off_t size, int flags);
+void disk_close();
+off_t disk_get_size();
+const char *disk_backend();
+void disk_register_buffers(void *base, size_t size);
+int disk_read(void *buf, size_t size, off_t offset);
+int disk_write(const void *buf, size_t size, off_t offset);
+int disk_readv(const struct iovec *iov, int iovcnt, off_t offset);
+int disk_writev(const struct iovec *iov, int iovcnt, off_t offset);
+int disk_submit(disk_req_t *reqs, int n);
+int disk_write_sync(const struct iovec *iov, int iovcnt, off_t offset);
+int disk_sync();
+
+#endif // DISK_H
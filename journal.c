@@ -0,0 +1,316 @@
+#include "journal.h"
+#include "disk.h"
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define JOURNAL_MAGIC 0x4a524e4c // "JRNL"
+#define TXN_MAGIC 0x54584e31     // "TXN1"
+#define TXN_ALIGN 512            // Transactions start on a sector boundary, so a torn one never clobbers the one before
+
+// First block of the region
+typedef struct
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t tail_seq; // Sequence number of the first transaction in the log
+} jheader_t;
+
+// Starts every transaction, followed by len bytes of records
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len;
+    uint64_t seq;
+    uint32_t crc; // CRC32C of the header (with crc = 0) and the records
+    uint32_t reserved;
+} jtxn_t;
+
+static off_t region_start = 0; // Byte offset of the header block in the image
+static off_t log_size = 0;     // Bytes available for transactions after the header block
+static journal_ops_t jops;
+
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+static uint64_t open_seq = 1;    // The sequence number the next commit will use
+static uint64_t durable_seq = 0; // Everything up to this sequence number is on stable storage
+static uint64_t failed_seq = 0;  // The last commit that failed, and how
+static int failed_rv = 0;
+static int committing = 0;       // A leader is writing a transaction
+static int want_checkpoint = 0;  // The next leader checkpoints instead of appending
+static off_t log_pos = 0;        // Where the next transaction goes, relative to the log start
+
+static long stat_commits = 0;
+static long stat_bytes = 0;
+static long stat_checkpoints = 0;
+
+static off_t log_offset(off_t pos)
+{
+    return region_start + 4096 + pos;
+}
+
+// Write the header saying the log starts over at tail_seq, and sync it
+// Nothing may be written to the log before this is durable, or a replay
+// could mistake older transactions for current ones
+static int write_header(uint64_t tail_seq)
+{
+    jheader_t header = {JOURNAL_MAGIC, 0, tail_seq};
+    struct iovec iov = {&header, sizeof(header)};
+    return disk_write_sync(&iov, 1, region_start) < 0 ? -EIO : 0;
+}
+
+// Use the blocks [start, start + blocks) of the image (byte offset start) as the journal
+int journal_init(off_t start, int blocks, const journal_ops_t *ops)
+{
+    checksum_init();
+    region_start = start;
+    log_size = (off_t)(blocks - 1) * 4096;
+    jops = *ops;
+    log_pos = 0;
+    return 0;
+}
+
+// Initialize an empty journal on a new image
+int journal_format()
+{
+    open_seq = 1;
+    durable_seq = 0;
+    failed_seq = 0;
+    log_pos = 0;
+    return write_header(open_seq);
+}
+
+// Append a record to a growing transaction buffer
+void journal_record(char **buf, size_t *len, size_t *cap, int type, uint32_t target, const void *data, uint32_t data_len)
+{
+    size_t need = *len + sizeof(jrecord_t) + ((data_len + 3) & ~3u);
+    if (need > *cap)
+    {
+        *cap = need * 2 > 4096 ? need * 2 : 4096;
+        *buf = realloc(*buf, *cap);
+    }
+
+    jrecord_t rec = {type, 0, target, data_len};
+    memcpy(*buf + *len, &rec, sizeof(rec));
+    memcpy(*buf + *len + sizeof(rec), data, data_len);
+    memset(*buf + *len + sizeof(rec) + data_len, 0, need - *len - sizeof(rec) - data_len);
+    *len = need;
+}
+
+// Replay every intact transaction in the log through ops->apply
+// Return the number of transactions replayed, or -errno: -EIO if the log could not
+// be read, or its header is damaged, which leaves no way to tell current transactions
+// from older ones
+int journal_replay()
+{
+    jheader_t header;
+    if (disk_read(&header, sizeof(header), region_start) < 0)
+    {
+        return -EIO;
+    }
+    if (header.magic != JOURNAL_MAGIC)
+    {
+        printf("journal header is damaged\n");
+        return -EIO;
+    }
+
+    uint64_t prev = header.tail_seq - 1;
+    off_t pos = 0;
+    int replayed = 0;
+    char *buf = NULL;
+    int rv = 0;
+
+    while (pos + (off_t)sizeof(jtxn_t) <= log_size)
+    {
+        jtxn_t txn;
+        if (disk_read(&txn, sizeof(txn), log_offset(pos)) < 0)
+        {
+            rv = -EIO;
+            break;
+        }
+        // Transactions from before the last checkpoint have smaller sequence numbers
+        if (txn.magic != TXN_MAGIC || txn.seq <= prev || pos + (off_t)sizeof(txn) + txn.len > log_size)
+        {
+            break;
+        }
+
+        buf = realloc(buf, txn.len > 0 ? txn.len : 1);
+        if (disk_read(buf, txn.len, log_offset(pos) + sizeof(txn)) < 0)
+        {
+            rv = -EIO;
+            break;
+        }
+        uint32_t crc = txn.crc;
+        txn.crc = 0;
+        if (checksum_crc32c(checksum_crc32c(0, &txn, sizeof(txn)), buf, txn.len) != crc)
+        {
+            // Torn by a crash while it was being written, so it was never committed
+            break;
+        }
+
+        for (size_t off = 0; off + sizeof(jrecord_t) <= txn.len;)
+        {
+            jrecord_t rec;
+            memcpy(&rec, buf + off, sizeof(rec));
+            jops.apply(&rec, buf + off + sizeof(rec));
+            off += sizeof(rec) + ((rec.len + 3) & ~3u);
+        }
+
+        replayed++;
+        prev = txn.seq;
+        pos += (sizeof(txn) + txn.len + TXN_ALIGN - 1) / TXN_ALIGN * TXN_ALIGN;
+    }
+    free(buf);
+    if (rv < 0)
+    {
+        return rv;
+    }
+
+    open_seq = prev + 1;
+    durable_seq = prev;
+    failed_seq = 0;
+    log_pos = 0;
+    return replayed;
+}
+
+// Write everything home and restart the log after seq
+static int checkpoint_locked(uint64_t seq)
+{
+    int rv = jops.checkpoint();
+    if (rv == 0)
+    {
+        rv = write_header(seq + 1);
+    }
+    if (rv == 0)
+    {
+        log_pos = 0;
+        stat_checkpoints++;
+        jops.committed();
+    }
+    return rv;
+}
+
+// Commit the pending changes as transaction seq, run by the leader only
+// Once the log is half full, or the transaction does not fit, a checkpoint is
+// taken instead, which also makes the pending changes durable
+static int commit_as_leader(uint64_t seq, int force_checkpoint)
+{
+    if (force_checkpoint || log_pos > log_size / 2)
+    {
+        return checkpoint_locked(seq);
+    }
+
+    char *buf = NULL;
+    size_t len = 0;
+    int rv = jops.collect(&buf, &len);
+    if (rv < 0 || len == 0)
+    {
+        free(buf);
+        if (rv == 0)
+        {
+            jops.committed();
+        }
+        return rv;
+    }
+
+    off_t span = (sizeof(jtxn_t) + len + TXN_ALIGN - 1) / TXN_ALIGN * TXN_ALIGN;
+    if (log_pos + span > log_size)
+    {
+        // The checkpoint's snapshot is taken after the collect, so it includes this transaction
+        free(buf);
+        return checkpoint_locked(seq);
+    }
+
+    jtxn_t txn = {TXN_MAGIC, len, seq, 0, 0};
+    txn.crc = checksum_crc32c(checksum_crc32c(0, &txn, sizeof(txn)), buf, len);
+
+    // One fdatasync makes the transaction, and the file data written before it, durable:
+    // io_uring takes the write and the sync in one submission
+    struct iovec iov[2] = {{&txn, sizeof(txn)}, {buf, len}};
+    rv = disk_write_sync(iov, 2, log_offset(log_pos)) < 0 ? -EIO : 0;
+    free(buf);
+    if (rv == 0)
+    {
+        log_pos += span;
+        stat_commits++;
+        stat_bytes += sizeof(txn) + len;
+        jops.committed();
+    }
+    return rv;
+}
+
+// Group commit: return once every change made before the call is durable, or the
+// error of the commit that should have made them durable
+// A failed transaction took its changes out of the pending ones, so the next leader
+// retries with a checkpoint, which writes every change since the last one home
+static int commit_locked()
+{
+    int rv = 0;
+    uint64_t target = open_seq;
+    while (durable_seq < target)
+    {
+        if (failed_seq >= target)
+        {
+            return failed_rv;
+        }
+        if (committing)
+        {
+            pthread_cond_wait(&jcond, &jlock);
+            continue;
+        }
+
+        // Become the leader for everything that is pending right now
+        committing = 1;
+        uint64_t seq = open_seq++;
+        int force_checkpoint = want_checkpoint;
+        want_checkpoint = 0;
+        pthread_mutex_unlock(&jlock);
+
+        rv = commit_as_leader(seq, force_checkpoint);
+
+        pthread_mutex_lock(&jlock);
+        if (rv == 0)
+        {
+            durable_seq = seq;
+        }
+        else
+        {
+            failed_seq = seq;
+            failed_rv = rv;
+            want_checkpoint = 1;
+        }
+        committing = 0;
+        pthread_cond_broadcast(&jcond);
+    }
+    return rv;
+}
+
+int journal_commit()
+{
+    pthread_mutex_lock(&jlock);
+    int rv = commit_locked();
+    pthread_mutex_unlock(&jlock);
+    return rv;
+}
+
+// Commit by checkpointing, leaving the log empty (used at unmount)
+int journal_checkpoint()
+{
+    pthread_mutex_lock(&jlock);
+    want_checkpoint = 1;
+    int rv = commit_locked();
+    pthread_mutex_unlock(&jlock);
+    return rv;
+}
+
+void journal_get_stats(long *commits, long *bytes, long *checkpoints)
+{
+    pthread_mutex_lock(&jlock);
+    *commits = stat_commits;
+    *bytes = stat_bytes;
+    *checkpoints = stat_checkpoints;
+    pthread_mutex_unlock(&jlock);
+}
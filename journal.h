@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Write-ahead metadata journal
+// The region starts with a header block, the rest is the log: transactions
+// are appended one after another, and the log restarts from its beginning
+// after every checkpoint, once everything it held is safely at home
+//
+// Commits are grouped: while one thread (the leader) writes and syncs a
+// transaction, others queue up, and the next leader commits all of their
+// changes with a single fdatasync
+
+#define JREC_SUPER 1  // Superblock header
+#define JREC_BITMAP 2 // A byte range of the block bitmap, target = byte offset
+#define JREC_INODE 3  // One whole inode, target = inode index
+#define JREC_DIRENT 4 // One directory slot, target = block, payload = byte offset in the block (uint32), then the slot
+#define JREC_SHARES 5 // A byte range of the share table, target = byte offset
+#define JREC_HASHES 6 // Consecutive entries of the hash table, target = the block of the first one
+#define JREC_LENGTHS 7 // Consecutive entries of the length table, target = the block of the first one
+#define JREC_SUMS 8    // Consecutive entries of the checksum table, target = the block of the first one
+
+// One record inside a transaction, followed by len bytes of payload
+typedef struct
+{
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t target;
+    uint32_t len;
+} jrecord_t;
+
+// What the journal asks of the storage layer
+typedef struct
+{
+    // Serialize every change since the last collect into *buf (len bytes, malloc'd),
+    // after writing out the data they point at; with nothing to log, sync that data
+    // The changes stay pending until committed() is called
+    // Return 0, or -errno if the data could not be written
+    int (*collect)(char **buf, size_t *len);
+    // Write all metadata to its home location and sync it, absorbing whatever is pending
+    int (*checkpoint)();
+    // Everything collected or checkpointed so far is durable
+    void (*committed)();
+    // Apply one record found while replaying the log on mount
+    void (*apply)(const jrecord_t *rec, const void *payload);
+} journal_ops_t;
+
+int journal_init(off_t start, int blocks, const journal_ops_t *ops);
+int journal_format();
+int journal_replay();
+int journal_commit();
+int journal_checkpoint();
+void journal_record(char **buf, size_t *len, size_t *cap, int type, uint32_t target, const void *data, uint32_t data_len);
+void journal_get_stats(long *commits, long *bytes, long *checkpoints);
+
+#endif // JOURNAL_H
@@ -0,0 +1,96 @@
+// mkfs.nufs: make an empty nufs file system in an image file
+//
+//   mkfs.nufs [-s size] [-i inodes] [-I inode-size] [-j journal-blocks] image
+//
+// size takes a K, M or G suffix, and is rounded down to whole blocks
+// inode-size is a power of two from 128 to the block size, what an inode has
+// past its 32-byte header holds the contents of small files
+#include "storage.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s size[K|M|G]] [-i inodes] [-I inode-size] [-j journal-blocks] image\n", prog);
+}
+
+// Parse a size like 4096, 64K, 512M or 20G into bytes, or return -1
+static long long parse_size(const char *text)
+{
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    if (end == text || size <= 0)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        size *= 1024;
+        // fall through
+    case 'M':
+    case 'm':
+        size *= 1024;
+        // fall through
+    case 'K':
+    case 'k':
+        size *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    long long size = (long long)DEFAULT_BLOCKS * BLOCK_SIZE;
+    int inodes = 0;
+    int inode_size = 0;
+    int journal_blocks = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:i:I:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'i':
+            inodes = atoi(optarg);
+            break;
+        case 'I':
+            inode_size = atoi(optarg);
+            break;
+        case 'j':
+            journal_blocks = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || size < 0 || inodes < 0 || inode_size < 0 || journal_blocks < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long long blocks = size / BLOCK_SIZE;
+    if (blocks > 0x7fffffff)
+    {
+        fprintf(stderr, "%s: at most %lld bytes\n", argv[0], 0x7fffffffLL * BLOCK_SIZE);
+        return 1;
+    }
+
+    int rv = storage_format(argv[optind], (int)blocks, inodes, inode_size, journal_blocks);
+    if (rv < 0)
+    {
+        fprintf(stderr, "%s: can not make %s: %s\n", argv[0], argv[optind], strerror(-rv));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+// The command line of the FUSE frontends, and the worker threads that serve their session
+// Both nufs and nufs_ll take
+//   [fuse options] [-o nufs options] mountpoint image
+// nufs options come out here, everything else goes on to libfuse untouched
+
+#define FUSE_USE_VERSION 26
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "mount.h"
+
+// Passed to libfuse ahead of the command line, which can still override them:
+// writes reach us in requests of up to 128 KiB instead of one page at a time
+#define DEFAULT_FUSE_OPTS "-obig_writes,max_write=131072"
+
+#define DEFAULT_CACHE_KB 8192
+#define DEFAULT_BUFFER_KB 16384
+#define DEFAULT_READAHEAD_KB 1024
+#define DEFAULT_COMPRESS_MIN 10
+
+enum
+{
+    KEY_HELP,
+};
+
+#define MOUNT_OPT(templ, field, value) {templ, offsetof(mount_config_t, field), value}
+
+static const struct fuse_opt mount_opts[] = {
+    MOUNT_OPT("image=%s", image, 0),
+    MOUNT_OPT("threads=%u", threads, 0),
+    MOUNT_OPT("mmap", storage.use_mmap, 1),
+    MOUNT_OPT("uring", storage.use_uring, 1),
+    MOUNT_OPT("direct", storage.direct, 1),
+    MOUNT_OPT("durability=sync", storage.durability, DURABILITY_SYNC),
+    MOUNT_OPT("durability=fsync", storage.durability, DURABILITY_FSYNC),
+    MOUNT_OPT("durability=periodic", storage.durability, DURABILITY_PERIODIC),
+    MOUNT_OPT("writeback_ms=%d", storage.writeback_ms, 0),
+    MOUNT_OPT("cache_kb=%d", storage.cache_kb, 0),
+    MOUNT_OPT("cache_writeback", storage.cache_write_back, 1),
+    MOUNT_OPT("buffer_kb=%d", storage.buffer_kb, 0),
+    MOUNT_OPT("readahead_kb=%d", storage.readahead_kb, 0),
+    MOUNT_OPT("dedup", storage.dedup, 1),
+    MOUNT_OPT("compress", storage.compress, 1),
+    MOUNT_OPT("compress_min=%d", storage.compress_min, 0),
+    MOUNT_OPT("scrub_kbps=%d", storage.scrub_kbps, 0),
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_END,
+};
+
+static void print_help(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] mountpoint image\n"
+            "\n"
+            "nufs options:\n"
+            "    -o image=PATH          the disk image, instead of the last argument\n"
+            "    -o threads=N           serve requests from N threads (1 is the same as -s)\n"
+            "    -o mmap                serve the image through a shared mapping\n"
+            "    -o uring               submit image I/O through io_uring, pread/pwrite without it\n"
+            "    -o direct              open the image O_DIRECT, around the page cache\n"
+            "    -o durability=MODE     when changes become durable: sync, before every operation returns\n"
+            "                           (default), fsync, on fsync and close, or periodic, every writeback_ms\n"
+            "    -o writeback_ms=N      period of durability=periodic (default %d), alone it implies periodic\n"
+            "    -o cache_kb=N          block cache budget in KiB (default %d, 0 turns it off)\n"
+            "    -o cache_writeback     keep written blocks in the cache until the next commit\n"
+            "    -o buffer_kb=N         budget in KiB of the write buffers that hold writes until close or fsync\n"
+            "                           (default %d, 0 turns them off, durability=sync never buffers)\n"
+            "    -o readahead_kb=N      most KiB read ahead at once of a file read in order (default %d, 0 turns it off)\n"
+            "    -o dedup               store full blocks already on disk once, and zero blocks as holes\n"
+            "    -o compress            store the 128 KiB clusters writes fill compressed\n"
+            "    -o compress_min=N      percent of a cluster compression has to save (default %d)\n"
+            "    -o scrub_kbps=N        check every block against its checksum in the background, at N KiB/s\n"
+            "\n",
+            prog, DEFAULT_WRITEBACK_MS, DEFAULT_CACHE_KB, DEFAULT_BUFFER_KB, DEFAULT_READAHEAD_KB,
+            DEFAULT_COMPRESS_MIN);
+}
+
+static int mount_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    mount_config_t *cfg = data;
+    if (key == KEY_HELP)
+    {
+        // Kept, so libfuse adds its own options to the help
+        cfg->show_help = 1;
+        return 1;
+    }
+    if (key == FUSE_OPT_KEY_NONOPT)
+    {
+        if (!cfg->seen_mountpoint)
+        {
+            cfg->seen_mountpoint = 1;
+            return 1;
+        }
+        if (cfg->image == NULL)
+        {
+            cfg->image = strdup(arg);
+            return 0;
+        }
+        fprintf(stderr, "%s: unexpected argument %s\n", outargs->argv[0], arg);
+        return -1;
+    }
+    return 1;
+}
+
+// Take the nufs options out of args into cfg, and put the defaults for libfuse in front
+// of what is left; the storage options start out at their defaults
+// Return 0, or -1 with the reason printed
+int mount_parse(struct fuse_args *args, mount_config_t *cfg)
+{
+    memset(cfg, 0, sizeof(mount_config_t));
+    cfg->storage.cache_kb = DEFAULT_CACHE_KB;
+    cfg->storage.buffer_kb = DEFAULT_BUFFER_KB;
+    cfg->storage.readahead_kb = DEFAULT_READAHEAD_KB;
+    cfg->storage.compress_min = DEFAULT_COMPRESS_MIN;
+    if (fuse_opt_parse(args, cfg, mount_opts, mount_opt_proc) == -1)
+    {
+        return -1;
+    }
+    if (cfg->show_help)
+    {
+        print_help(args->argv[0]);
+        return 0;
+    }
+    if (cfg->image == NULL)
+    {
+        fprintf(stderr, "usage: %s [options] mountpoint image (-h lists the options)\n", args->argv[0]);
+        return -1;
+    }
+    if (fuse_opt_insert_arg(args, 1, DEFAULT_FUSE_OPTS) == -1 ||
+        (cfg->threads == 1 && fuse_opt_add_arg(args, "-s") == -1))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Connection settings both frontends ask for in their init callback
+void mount_init_conn(struct fuse_conn_info *conn)
+{
+    // Several reads of one file may be in flight at once, they only share an inode lock;
+    // max_readahead stays at what the kernel offers, unless -o max_readahead lowered it
+    conn->async_read = 1;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+    {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+    {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    }
+}
+
+typedef struct
+{
+    struct fuse_session *se;
+    sem_t done; // Posted by every worker that stops
+} pool_t;
+
+// One worker: take a request off the channel, serve it, repeat until the session ends
+static void *worker_main(void *arg)
+{
+    pool_t *pool = arg;
+    struct fuse_chan *ch = fuse_session_next_chan(pool->se, NULL);
+    size_t size = fuse_chan_bufsize(ch);
+    char *mem = malloc(size);
+    pthread_cleanup_push(free, mem);
+
+    while (mem != NULL && !fuse_session_exited(pool->se))
+    {
+        struct fuse_chan *from = ch;
+        struct fuse_buf buf = {.size = size, .mem = mem};
+        int rv = fuse_session_receive_buf(pool->se, &buf, &from);
+        if (rv == -EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            break;
+        }
+
+        // A request is served to the end once started, it holds storage locks on the way
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        fuse_session_process_buf(pool->se, &buf, from);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    pthread_cleanup_pop(1);
+    fuse_session_exit(pool->se);
+    sem_post(&pool->done);
+    return NULL;
+}
+
+// Serve se from exactly threads workers until it is unmounted or a signal ends it
+// (libfuse's own multi-threaded loop starts and stops workers as it sees fit)
+// Return 0, or -1 if no worker could be started
+int mount_session_loop(struct fuse_session *se, unsigned threads)
+{
+    pool_t pool;
+    pool.se = se;
+    sem_init(&pool.done, 0, 0);
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+
+    // Signals are left to this thread, the workers start with all of them blocked
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    unsigned started = 0;
+    while (workers != NULL && started < threads &&
+           pthread_create(&workers[started], NULL, worker_main, &pool) == 0)
+    {
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // A worker stops on unmount; the signal handlers end the session and interrupt the wait
+    while (started > 0 && !fuse_session_exited(se))
+    {
+        sem_wait(&pool.done);
+    }
+    for (unsigned k = 0; k < started; k++)
+    {
+        pthread_cancel(workers[k]);
+    }
+    for (unsigned k = 0; k < started; k++)
+    {
+        pthread_join(workers[k], NULL);
+    }
+    free(workers);
+    sem_destroy(&pool.done);
+    fuse_session_reset(se);
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include <fuse_opt.h>
+#include "storage.h"
+
+// What the command line of a frontend says beyond what libfuse takes itself
+// nufs options are given with -o like any other, see mount_parse
+typedef struct
+{
+    char *image;               // The disk image: -o image=, or the argument after the mount point
+    unsigned threads;          // Worker threads serving requests, 0 leaves the choice to libfuse
+    int show_help;             // -h: print the options and do not mount
+    int seen_mountpoint;       // Parsing state, the first argument is the mount point
+    storage_options_t storage; // Copied to storage_opts before storage_init
+} mount_config_t;
+
+struct fuse_conn_info;
+struct fuse_session;
+
+int mount_parse(struct fuse_args *args, mount_config_t *cfg);
+void mount_init_conn(struct fuse_conn_info *conn);
+int mount_session_loop(struct fuse_session *se, unsigned threads);
+
+#endif // MOUNT_H
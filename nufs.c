@@ -1,6 +1,7 @@
 // based on cs3650 starter code
 
 #include <assert.h>
+#include <stdlib.h>
 #include <bsd/string.h>
 #include <dirent.h>
 #include <errno.h>
@@ -9,53 +10,164 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 #include "storage.h"
+#include "opstats.h"
+#include "mount.h"
+#include "nufs_ioctl.h"
 
-int nufs_access(const char *path, int mask)
+// The read-only virtual directory /.nufs, holding the live stats file
+// It is answered here and never reaches the storage layer, so a real entry
+// of that name in the root can not be made
+#define STATS_DIR "/.nufs"
+#define STATS_FILE "/.nufs/stats"
+
+static int storage_closed = 0;
+
+// Whether path is /.nufs or anything below it
+static int is_virtual(const char *path)
 {
-  if (storage_lookup(path) >= 0)
+  size_t len = strlen(STATS_DIR);
+  return strncmp(path, STATS_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// getattr for the virtual paths, the stats file reports the size of a fresh rendering
+static int virtual_stat(const char *path, struct stat *st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  if (strcmp(path, STATS_DIR) == 0)
   {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  if (strcmp(path, STATS_FILE) == 0)
+  {
+    size_t len;
+    free(opstats_render(&len));
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = len;
     return 0;
   }
   return -ENOENT;
 }
 
+// read of the stats file, rendered anew on every call
+static int virtual_read(const char *path, char *buf, size_t size, off_t offset)
+{
+  if (strcmp(path, STATS_FILE) != 0)
+  {
+    return -EISDIR;
+  }
+  size_t len;
+  char *text = opstats_render(&len);
+  if (text == NULL)
+  {
+    return -ENOMEM;
+  }
+  if (offset >= (off_t)len)
+  {
+    free(text);
+    return 0;
+  }
+  size_t n = len - offset < size ? len - offset : size;
+  memcpy(buf, text + offset, n);
+  free(text);
+  return n;
+}
+
+int nufs_access(const char *path, int mask)
+{
+  uint64_t start = opstats_now();
+  int rv = -ENOENT;
+  if (is_virtual(path))
+  {
+    struct stat st;
+    rv = virtual_stat(path, &st) < 0 ? -ENOENT : (mask & W_OK) ? -EACCES : 0;
+  }
+  else if (storage_lookup(path) >= 0)
+  {
+    rv = 0;
+  }
+  return opstats_done(OP_ACCESS, start, rv, 0);
+}
+
 int nufs_getattr(const char *path, struct stat *st)
 {
-  // printf("BreakPoint#0 \n");
-  // memset(st, 0, sizeof(struct stat));
-  int rv = storage_stat(path, st);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? virtual_stat(path, st) : storage_stat(path, st);
   if (rv < 0)
   {
-    return -ENOENT;
+    rv = -ENOENT;
+  }
+  return opstats_done(OP_GETATTR, start, rv, 0);
+}
+
+// An open directory keeps its inode number in fi->fh, held against reuse until releasedir,
+// so reading it never resolves the path again; /.nufs has no storage inode and keeps 0
+int nufs_opendir(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = 0;
+  fi->fh = 0;
+  if (!is_virtual(path))
+  {
+    rv = storage_ino_open(path);
+    fi->fh = rv > 0 ? rv : 0;
+  }
+  return opstats_done(OP_OPENDIR, start, rv < 0 ? rv : 0, 0);
+}
+
+int nufs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  if (fi->fh != 0)
+  {
+    storage_ino_forget(fi->fh, 1);
   }
   return 0;
 }
 
+// What nufs_readdir hands storage_ino_readdir for each entry
+typedef struct
+{
+  void *buf;
+  fuse_fill_dir_t filler;
+} readdir_ctx_t;
+
+static int fill_entry(void *ctx, const char *name, const struct stat *st, off_t next)
+{
+  readdir_ctx_t *r = ctx;
+  return r->filler(r->buf, name, st, next);
+}
+
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, from offset on: every entry goes to the filler
+// with the offset after it, so once the reply buffer is full the next call resumes
+// where this one stopped instead of listing the directory again from the start
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi)
 {
-  /*
-  //printf("BreakPoint#1, buffer_d: %d, buffer_s: %p \n", buf, buf);
-  if (filler(buf, ".", NULL, 0) != 0)
+  uint64_t start = opstats_now();
+  int rv = 0;
+  if (strcmp(path, STATS_DIR) == 0)
   {
-    //printf("BreakPoint#3778, buffer: %d off: %i \n", buf, off);
-    return 0;
+    if (offset == 0)
+    {
+      filler(buf, "stats", NULL, 1);
+    }
   }
-  if (filler(buf, "..", NULL, 0) != 0)
+  else
   {
-    //printf("BreakPoint#3779, buffer: %d off: %i \n", buf, off);
-    return 0;
+    readdir_ctx_t ctx = {buf, filler};
+    rv = storage_ino_readdir(fi->fh, offset, fill_entry, &ctx);
   }
-   */
-
-  storage_list(path, buf, filler);
-  return 0;
+  return opstats_done(OP_READDIR, start, rv, 0);
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -64,20 +176,26 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-  return storage_create(path, mode);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_create(path, mode);
+  return opstats_done(OP_MKNOD, start, rv, 0);
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode)
 {
+  uint64_t start = opstats_now();
   mode |= S_IFDIR;
-  return storage_create(path, mode);
+  int rv = is_virtual(path) ? -EACCES : storage_create(path, mode);
+  return opstats_done(OP_MKDIR, start, rv, 0);
 }
 
 int nufs_unlink(const char *path)
 {
-  return storage_unlink(path);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_unlink(path);
+  return opstats_done(OP_UNLINK, start, rv, 0);
 }
 
 int nufs_link(const char *from, const char *to)
@@ -87,55 +205,126 @@ int nufs_link(const char *from, const char *to)
 
 int nufs_rmdir(const char *path)
 {
-  if (!storage_is_dir_empty(path))
-  {
-    return -ENOTEMPTY;
-  }
-  return storage_delete(path);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_rmdir(path);
+  return opstats_done(OP_RMDIR, start, rv, 0);
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to)
 {
-  return storage_rename(from, to);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(from) || is_virtual(to) ? -EACCES : storage_rename(from, to);
+  return opstats_done(OP_RENAME, start, rv, 0);
 }
 
 int nufs_chmod(const char *path, mode_t mode)
 {
-  return storage_chmod(path, mode);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_chmod(path, mode);
+  return opstats_done(OP_CHMOD, start, rv, 0);
 }
 
 int nufs_truncate(const char *path, off_t size)
 {
-  return storage_truncate(path, size);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_truncate(path, size);
+  return opstats_done(OP_TRUNCATE, start, rv, 0);
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Check that the file is accessible, and give an open that can read
+// the state readahead keeps for it in fi->fh (see storage_file_open)
 int nufs_open(const char *path, struct fuse_file_info *fi)
 {
-  if (storage_lookup(path) >= 0)
+  uint64_t start = opstats_now();
+  int rv = -ENOENT;
+  if (is_virtual(path))
   {
-    return 0;
+    // The stats change between getattr and read, so reads must not stop at the size getattr saw
+    fi->direct_io = 1;
+    rv = (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES : 0;
   }
-  return -ENOENT;
+  else if (storage_lookup(path) >= 0)
+  {
+    // Where the reads of the open left off, for readahead; released with the open
+    fi->fh = (fi->flags & O_ACCMODE) != O_WRONLY ? (uint64_t)(uintptr_t)storage_file_open() : 0;
+    rv = 0;
+  }
+  return opstats_done(OP_OPEN, start, rv, 0);
 }
 
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi)
 {
-  return storage_read(path, buf, size, offset);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? virtual_read(path, buf, size, offset)
+                            : storage_read(path, buf, size, offset, (storage_file_t *)(uintptr_t)fi->fh);
+  return opstats_done(OP_READ, start, rv, rv > 0 ? rv : 0);
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi)
 {
-  return storage_write(path, buf, size, offset);
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_write(path, buf, size, offset);
+  return opstats_done(OP_WRITE, start, rv, rv > 0 ? rv : 0);
+}
+
+// Preallocate or punch out a range of the file, see storage_fallocate
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? -EACCES : storage_fallocate(path, mode, offset, length);
+  return opstats_done(OP_FALLOCATE, start, rv, 0);
+}
+
+// Block and inode counts, for df
+int nufs_statfs(const char *path, struct statvfs *st)
+{
+  uint64_t start = opstats_now();
+  return opstats_done(OP_STATFS, start, storage_statfs(st), 0);
+}
+
+// Make the file's data and all metadata so far durable
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  return opstats_done(OP_FSYNC, start, storage_fsync(), 0);
+}
+
+// Called on every close(2) of a descriptor of the file, close returns what this does:
+// see storage_flush for what becomes durable
+int nufs_flush(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? 0 : storage_flush(path);
+  return opstats_done(OP_FLUSH, start, rv, 0);
+}
+
+// Called once the last descriptor of an open is gone; writes through a shared mapping
+// can still arrive after the flush of the close, so an open for writing flushes again
+int nufs_release(const char *path, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = 0;
+  if (!is_virtual(path) && (fi->flags & O_ACCMODE) != O_RDONLY)
+  {
+    rv = storage_flush(path);
+  }
+  storage_file_release((storage_file_t *)(uintptr_t)fi->fh);
+  return opstats_done(OP_RELEASE, start, rv, 0);
+}
+
+// Make the directory's entries and all metadata so far durable
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(path) ? 0 : storage_fsync();
+  return opstats_done(OP_FSYNCDIR, start, rv, 0);
 }
 
 // Not implemented
@@ -144,11 +333,50 @@ int nufs_utimens(const char *path, const struct timespec ts[2])
   return 0;
 }
 
-// Extended operations
+// Extended operations, see nufs_ioctl.h
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data)
 {
-  return 0;
+  uint64_t start = opstats_now();
+  off_t copied = 0;
+  int rv = 0;
+  if (flags & FUSE_IOCTL_COMPAT)
+  {
+    rv = -ENOSYS;
+  }
+  else if ((unsigned int)cmd != NUFS_IOC_COPY_RANGE)
+  {
+    rv = -ENOTTY;
+  }
+  else if (is_virtual(path))
+  {
+    rv = -EACCES;
+  }
+  else
+  {
+    nufs_copy_range_t *copy = data;
+    copy->src[NUFS_IOC_PATH_MAX - 1] = '\0';
+    copied = storage_copy_range(copy->src, copy->src_offset, path, copy->dst_offset,
+                                copy->length != 0 ? copy->length : INT64_MAX);
+    rv = copied < 0 ? copied : 0;
+    copy->length = rv == 0 ? copied : 0;
+  }
+  return opstats_done(OP_IOCTL, start, rv, copied > 0 ? copied : 0);
+}
+
+// Called once FUSE runs in its final process, after any fork into the background
+void *nufs_init(struct fuse_conn_info *conn)
+{
+  mount_init_conn(conn);
+  storage_start_flusher();
+  return NULL;
+}
+
+// Called on unmount, flush and close the disk image
+void nufs_destroy(void *private_data)
+{
+  storage_close();
+  storage_closed = 1;
 }
 
 void nufs_init_ops(struct fuse_operations *ops)
@@ -156,8 +384,10 @@ void nufs_init_ops(struct fuse_operations *ops)
   memset(ops, 0, sizeof(struct fuse_operations));
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->opendir = nufs_opendir;
   ops->readdir = nufs_readdir;
-  printf("BreakPoint#2 \n");
+  ops->releasedir = nufs_releasedir;
+  ops->fsyncdir = nufs_fsyncdir;
   ops->mknod = nufs_mknod;
   // ops->create   = nufs_create; // alternative to mknod
   ops->mkdir = nufs_mkdir;
@@ -171,27 +401,73 @@ void nufs_init_ops(struct fuse_operations *ops)
   ops->open = nufs_open;
   ops->read = nufs_read;
   ops->write = nufs_write;
+  ops->fallocate = nufs_fallocate;
+  ops->flush = nufs_flush;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->statfs = nufs_statfs;
   ops->ioctl = nufs_ioctl;
+  ops->init = nufs_init;
+  ops->destroy = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
 int main(int argc, char *argv[])
 {
+  // nufs options (see mount.c) come out here, the rest goes to libfuse, with use_ino
+  // so the inode numbers getattr and readdir report are the storage layer's own
+  // Without -s or threads=1, FUSE serves requests from several worker threads at once
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  mount_config_t cfg;
+  if (mount_parse(&args, &cfg) < 0 || fuse_opt_insert_arg(&args, 1, "-ouse_ino") == -1)
+  {
+    return 1;
+  }
 
-  char *fuse_argv[4];
-  int fuse_argc = 4;
-
-  fuse_argv[0] = argv[0]; // ./nufs
-  fuse_argv[1] = argv[1]; // -s
-  fuse_argv[2] = argv[2]; // -f
-  fuse_argv[3] = argv[3]; // mnt
+  if (!cfg.show_help)
+  {
+    storage_opts = cfg.storage;
+    printf("Mounting %s as data file\n", cfg.image);
+    int rv = storage_init(cfg.image);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Can not mount %s: %s (images are made with mkfs.nufs)\n", cfg.image, strerror(-rv));
+      return 1;
+    }
+  }
 
-  char *diskfile = argv[4]; // data.nufs
+  // fuse_setup mounts, and forks into the background unless -f
+  nufs_init_ops(&nufs_ops);
+  char *mountpoint;
+  int multithreaded;
+  struct fuse *fuse = fuse_setup(args.argc, args.argv, &nufs_ops, sizeof(nufs_ops), &mountpoint, &multithreaded, NULL);
+  if (fuse == NULL)
+  {
+    if (!cfg.show_help)
+    {
+      storage_close();
+    }
+    return cfg.show_help ? 0 : 1;
+  }
 
-  printf("Mounting %s as data file\n", diskfile);
-  storage_init(diskfile);
+  int err;
+  if (cfg.threads > 1)
+  {
+    err = mount_session_loop(fuse_get_session(fuse), cfg.threads);
+  }
+  else
+  {
+    err = multithreaded ? fuse_loop_mt(fuse) : fuse_loop(fuse);
+  }
+  fuse_teardown(fuse, mountpoint);
 
-  nufs_init_ops(&nufs_ops);
-  return fuse_main(fuse_argc, fuse_argv, &nufs_ops, NULL);
+  // Unmounted before the kernel ever got to init, destroy was not called
+  if (!storage_closed)
+  {
+    storage_close();
+  }
+  fuse_opt_free_args(&args);
+  free(cfg.image);
+  return err ? 1 : 0;
 }
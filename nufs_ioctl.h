@@ -0,0 +1,28 @@
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// ioctls a program can issue on a file open in a nufs mount
+// FUSE hands a file system no other open files of the caller, so the source of a
+// copy is named by its path from the root of the mount, not by a descriptor
+
+#define NUFS_IOC_PATH_MAX 4096
+
+// Copy length bytes of src from src_offset into the file the ioctl is issued on,
+// at dst_offset, like copy_file_range: where both offsets are the same within a
+// block, the blocks are shared instead of copied (see storage_copy_range)
+// length 0 copies up to the end of src; on return it holds the bytes copied
+// Cloning a whole file is a copy from offset 0 with length 0 into an empty file
+typedef struct
+{
+    int64_t src_offset;
+    int64_t dst_offset;
+    int64_t length;
+    char src[NUFS_IOC_PATH_MAX]; // e.g. "/templates/base.img"
+} nufs_copy_range_t;
+
+#define NUFS_IOC_COPY_RANGE _IOWR('N', 1, nufs_copy_range_t)
+
+#endif // NUFS_IOCTL_H
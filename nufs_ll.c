@@ -0,0 +1,688 @@
+// Low-level FUSE frontend: every request names its file by inode number, which is
+// the storage layer's own inode index (FUSE_ROOT_ID is ROOT_INO), so no operation
+// parses a path or compares names beyond the one entry it looks up
+// Built as nufs_ll, it mounts the same images as the path-based nufs
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+#include "storage.h"
+#include "opstats.h"
+#include "mount.h"
+#include "nufs_ioctl.h"
+
+// The caching options libfuse only knows in its path-based layer, handled here instead
+// Nothing but this process changes the image, so the kernel may cache names, misses and
+// attributes for a while (only the virtual files get a timeout of 0), and file
+// contents across opens
+typedef struct
+{
+  double entry_timeout;    // -o entry_timeout=T
+  double attr_timeout;     // -o attr_timeout=T
+  double negative_timeout; // -o negative_timeout=T, 0 answers misses with ENOENT
+  int keep_cache;          // -o kernel_cache or auto_cache
+} ll_config_t;
+
+static ll_config_t ll_cfg = {1.0, 1.0, 1.0, 0};
+
+#define LL_OPT(templ, field, value) {templ, offsetof(ll_config_t, field), value}
+
+static const struct fuse_opt ll_opts[] = {
+    LL_OPT("entry_timeout=%lf", entry_timeout, 0),
+    LL_OPT("attr_timeout=%lf", attr_timeout, 0),
+    LL_OPT("negative_timeout=%lf", negative_timeout, 0),
+    LL_OPT("kernel_cache", keep_cache, 1),
+    LL_OPT("auto_cache", keep_cache, 1),
+    FUSE_OPT_END,
+};
+
+// The read-only virtual directory /.nufs and its stats file, as nufs.c has them
+// Their numbers lie past any storage inode
+#define STATS_DIR_NAME ".nufs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_INO ((fuse_ino_t)INT_MAX + 1)
+#define STATS_FILE_INO ((fuse_ino_t)INT_MAX + 2)
+
+static int storage_closed = 0;
+
+static int is_virtual(fuse_ino_t ino)
+{
+  return ino == STATS_DIR_INO || ino == STATS_FILE_INO;
+}
+
+// Whether name in parent is, or would land in, the virtual directory
+static int is_virtual_entry(fuse_ino_t parent, const char *name)
+{
+  return parent == STATS_DIR_INO || (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0);
+}
+
+// Attributes of the virtual inodes, the stats file reports the size of a fresh rendering
+static void virtual_stat(fuse_ino_t ino, struct stat *st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  if (ino == STATS_DIR_INO)
+  {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    return;
+  }
+  size_t len;
+  free(opstats_render(&len));
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_size = len;
+}
+
+// read of the stats file, rendered anew on every call
+static int virtual_read(char *buf, size_t size, off_t offset)
+{
+  size_t len;
+  char *text = opstats_render(&len);
+  if (text == NULL)
+  {
+    return -ENOMEM;
+  }
+  if (offset >= (off_t)len)
+  {
+    free(text);
+    return 0;
+  }
+  size_t n = len - offset < size ? len - offset : size;
+  memcpy(buf, text + offset, n);
+  free(text);
+  return n;
+}
+
+// Answer a request that failed, or succeeded with nothing to say
+static void reply_status(fuse_req_t req, int rv)
+{
+  fuse_reply_err(req, rv < 0 ? -rv : 0);
+}
+
+// Answer a request that handed out inode ino (lookup, mknod, mkdir, create) with its entry,
+// opened with fi for create
+// The storage layer took a kernel reference for it; the kernel only holds that reference
+// once the reply reaches it, otherwise it goes again
+static int reply_entry(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = ino;
+  if (is_virtual(ino))
+  {
+    virtual_stat(ino, &e.attr);
+  }
+  else
+  {
+    int rv = storage_ino_stat(ino, &e.attr);
+    if (rv < 0)
+    {
+      storage_ino_forget(ino, 1);
+      reply_status(req, rv);
+      return rv;
+    }
+    e.attr_timeout = ll_cfg.attr_timeout;
+    e.entry_timeout = ll_cfg.entry_timeout;
+  }
+
+  int sent = fi != NULL ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e);
+  if (sent != 0 && !is_virtual(ino))
+  {
+    storage_ino_forget(ino, 1);
+  }
+  return 0;
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint64_t start = opstats_now();
+  fuse_ino_t ino = 0;
+  int rv = 0;
+  if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0)
+  {
+    ino = STATS_DIR_INO;
+  }
+  else if (parent == STATS_DIR_INO)
+  {
+    ino = STATS_FILE_INO;
+    rv = strcmp(name, STATS_FILE_NAME) == 0 ? 0 : -ENOENT;
+  }
+  else
+  {
+    rv = storage_ino_lookup(parent, name);
+    ino = rv;
+    rv = rv < 0 ? rv : 0;
+  }
+
+  if (rv == 0)
+  {
+    rv = reply_entry(req, ino, NULL);
+  }
+  else if (rv == -ENOENT && ll_cfg.negative_timeout > 0)
+  {
+    // An entry with inode 0 tells the kernel to cache the name as missing
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = ll_cfg.negative_timeout;
+    fuse_reply_entry(req, &e);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_LOOKUP, start, rv, 0);
+}
+
+// The kernel dropped nlookup references to ino
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  uint64_t start = opstats_now();
+  if (!is_virtual(ino))
+  {
+    storage_ino_forget(ino, nlookup);
+  }
+  fuse_reply_none(req);
+  opstats_done(OP_FORGET, start, 0, 0);
+}
+
+// The same for a whole batch of inodes, one request for all of them
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  uint64_t start = opstats_now();
+  for (size_t k = 0; k < count; k++)
+  {
+    if (!is_virtual(forgets[k].ino))
+    {
+      storage_ino_forget(forgets[k].ino, forgets[k].nlookup);
+    }
+  }
+  fuse_reply_none(req);
+  opstats_done(OP_FORGET, start, 0, 0);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  struct stat st;
+  int rv = 0;
+  if (is_virtual(ino))
+  {
+    virtual_stat(ino, &st);
+    fuse_reply_attr(req, &st, 0);
+  }
+  else if ((rv = storage_ino_stat(ino, &st)) == 0)
+  {
+    fuse_reply_attr(req, &st, ll_cfg.attr_timeout);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_GETATTR, start, rv, 0);
+}
+
+// chmod and truncate, ownership and times are not kept and always succeed
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                            struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  struct stat st;
+  int rv = is_virtual(ino) ? -EACCES : 0;
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE))
+  {
+    rv = storage_ino_chmod(ino, attr->st_mode);
+  }
+  if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+  {
+    rv = storage_ino_truncate(ino, attr->st_size);
+  }
+  if (rv == 0)
+  {
+    rv = storage_ino_stat(ino, &st);
+  }
+  if (rv == 0)
+  {
+    fuse_reply_attr(req, &st, ll_cfg.attr_timeout);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_SETATTR, start, rv, 0);
+}
+
+// A reply buffer for readdir, filled with as many entries as the kernel asked room for
+typedef struct
+{
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+} dirbuf_t;
+
+// Add one entry to b, return 1 once it is full
+static int add_dirent(dirbuf_t *b, const char *name, fuse_ino_t ino, mode_t mode, off_t next)
+{
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_ino = ino;
+  st.st_mode = mode;
+  size_t len = fuse_add_direntry(b->req, b->buf + b->used, b->size - b->used, name, &st, next);
+  if (len > b->size - b->used)
+  {
+    return 1;
+  }
+  b->used += len;
+  return 0;
+}
+
+// storage_ino_readdir's callback, ctx is the dirbuf_t
+static int fill_dirbuf(void *ctx, const char *name, const struct stat *st, off_t next)
+{
+  return add_dirent(ctx, name, st->st_ino, st->st_mode, next);
+}
+
+// Lists a directory from offset off on, in one reply as large as the kernel allows
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  dirbuf_t b = {req, malloc(size), size, 0};
+  int rv = b.buf != NULL ? 0 : -ENOMEM;
+  if (rv == 0 && ino == STATS_DIR_INO)
+  {
+    if (off == 0)
+    {
+      add_dirent(&b, STATS_FILE_NAME, STATS_FILE_INO, S_IFREG, 1);
+    }
+  }
+  else if (rv == 0)
+  {
+    rv = is_virtual(ino) ? -ENOTDIR : storage_ino_readdir(ino, off, fill_dirbuf, &b);
+  }
+  if (rv == 0)
+  {
+    fuse_reply_buf(req, b.buf, b.used);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  free(b.buf);
+  opstats_done(OP_READDIR, start, rv, 0);
+}
+
+// Creates name in parent and answers with its entry, opened with fi for create
+static int make_entry(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                      struct fuse_file_info *fi)
+{
+  int rv = is_virtual_entry(parent, name) ? -EACCES : storage_ino_create(parent, name, mode);
+  if (rv < 0)
+  {
+    reply_status(req, rv);
+    return rv;
+  }
+  return reply_entry(req, rv, fi);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+  uint64_t start = opstats_now();
+  opstats_done(OP_MKNOD, start, make_entry(req, parent, name, mode, NULL), 0);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  uint64_t start = opstats_now();
+  opstats_done(OP_MKDIR, start, make_entry(req, parent, name, mode | S_IFDIR, NULL), 0);
+}
+
+// mknod and open in one request
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                           struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  opstats_done(OP_CREATE, start, make_entry(req, parent, name, mode, fi), 0);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual_entry(parent, name) ? -EACCES : storage_ino_unlink(parent, name);
+  reply_status(req, rv);
+  opstats_done(OP_UNLINK, start, rv, 0);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual_entry(parent, name) ? -EACCES : storage_ino_rmdir(parent, name);
+  reply_status(req, rv);
+  opstats_done(OP_RMDIR, start, rv, 0);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual_entry(parent, name) || is_virtual_entry(newparent, newname)
+               ? -EACCES
+               : storage_ino_rename(parent, name, newparent, newname);
+  reply_status(req, rv);
+  opstats_done(OP_RENAME, start, rv, 0);
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = 0;
+  if (ino == STATS_FILE_INO)
+  {
+    // The stats change between getattr and read, so reads must not stop at the size getattr saw
+    fi->direct_io = 1;
+    rv = (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES : 0;
+  }
+  else
+  {
+    fi->keep_cache = ll_cfg.keep_cache;
+    // Where the reads of the open left off, for readahead; released with the open
+    fi->fh = (fi->flags & O_ACCMODE) != O_WRONLY ? (uint64_t)(uintptr_t)storage_file_open() : 0;
+  }
+  if (rv == 0)
+  {
+    if (fuse_reply_open(req, fi) == -ENOENT)
+    {
+      // The open was interrupted, no release follows
+      storage_file_release((storage_file_t *)(uintptr_t)fi->fh);
+    }
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_OPEN, start, rv, 0);
+}
+
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  char *buf = malloc(size);
+  int rv = -ENOMEM;
+  if (buf != NULL)
+  {
+    rv = ino == STATS_FILE_INO ? virtual_read(buf, size, off)
+         : is_virtual(ino)     ? -EISDIR
+                               : storage_ino_read(ino, buf, size, off, (storage_file_t *)(uintptr_t)fi->fh);
+  }
+  if (rv >= 0)
+  {
+    fuse_reply_buf(req, buf, rv);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  free(buf);
+  opstats_done(OP_READ, start, rv, rv > 0 ? rv : 0);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                          struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(ino) ? -EACCES : storage_ino_write(ino, buf, size, off);
+  if (rv >= 0)
+  {
+    fuse_reply_write(req, rv);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_WRITE, start, rv, rv > 0 ? rv : 0);
+}
+
+// Preallocate or punch out a range of the file, see storage_fallocate
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                              struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(ino) ? -EACCES : storage_ino_fallocate(ino, mode, offset, length);
+  reply_status(req, rv);
+  opstats_done(OP_FALLOCATE, start, rv, 0);
+}
+
+// Extended operations, see nufs_ioctl.h
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                          unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+  uint64_t start = opstats_now();
+  nufs_copy_range_t copy;
+  off_t copied = 0;
+  int rv = 0;
+  if (flags & FUSE_IOCTL_COMPAT)
+  {
+    rv = -ENOSYS;
+  }
+  else if ((unsigned int)cmd != NUFS_IOC_COPY_RANGE)
+  {
+    rv = -ENOTTY;
+  }
+  else if (is_virtual(ino))
+  {
+    rv = -EACCES;
+  }
+  else if (in_bufsz != sizeof(copy) || out_bufsz != sizeof(copy))
+  {
+    rv = -EINVAL;
+  }
+  if (rv == 0)
+  {
+    memcpy(&copy, in_buf, sizeof(copy));
+    copy.src[NUFS_IOC_PATH_MAX - 1] = '\0';
+    // The reference keeps the source's number from going to another file during the copy
+    int src = storage_ino_open(copy.src);
+    rv = src;
+    if (src >= 0)
+    {
+      copied = storage_ino_copy_range(src, copy.src_offset, ino, copy.dst_offset,
+                                      copy.length != 0 ? copy.length : INT64_MAX);
+      storage_ino_forget(src, 1);
+      rv = copied < 0 ? copied : 0;
+    }
+  }
+  if (rv == 0)
+  {
+    copy.length = copied;
+    fuse_reply_ioctl(req, 0, &copy, sizeof(copy));
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_IOCTL, start, rv, copied > 0 ? copied : 0);
+}
+
+// Make the file's data and all metadata so far durable
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = storage_fsync();
+  reply_status(req, rv);
+  opstats_done(OP_FSYNC, start, rv, 0);
+}
+
+// Called on every close(2) of a descriptor of the file, close returns what this does:
+// see storage_flush for what becomes durable
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(ino) ? 0 : storage_ino_flush(ino);
+  reply_status(req, rv);
+  opstats_done(OP_FLUSH, start, rv, 0);
+}
+
+// Called once the last descriptor of an open is gone; writes through a shared mapping
+// can still arrive after the flush of the close, so an open for writing flushes again
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = 0;
+  if (!is_virtual(ino) && (fi->flags & O_ACCMODE) != O_RDONLY)
+  {
+    rv = storage_ino_flush(ino);
+  }
+  storage_file_release((storage_file_t *)(uintptr_t)fi->fh);
+  reply_status(req, rv);
+  opstats_done(OP_RELEASE, start, rv, 0);
+}
+
+// Make the directory's entries and all metadata so far durable
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  uint64_t start = opstats_now();
+  int rv = is_virtual(ino) ? 0 : storage_fsync();
+  reply_status(req, rv);
+  opstats_done(OP_FSYNCDIR, start, rv, 0);
+}
+
+// Block and inode counts, for df
+static void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  uint64_t start = opstats_now();
+  struct statvfs st;
+  int rv = storage_statfs(&st);
+  if (rv == 0)
+  {
+    fuse_reply_statfs(req, &st);
+  }
+  else
+  {
+    reply_status(req, rv);
+  }
+  opstats_done(OP_STATFS, start, rv, 0);
+}
+
+// Called once the session runs in its final process, after any fork into the background
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+  mount_init_conn(conn);
+  storage_start_flusher();
+}
+
+// Called on unmount, flush and close the disk image
+static void nufs_ll_destroy(void *userdata)
+{
+  storage_close();
+  storage_closed = 1;
+}
+
+static void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops)
+{
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->destroy = nufs_ll_destroy;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->forget_multi = nufs_ll_forget_multi;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->readdir = nufs_ll_readdir;
+  ops->fsyncdir = nufs_ll_fsyncdir;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->create = nufs_ll_create;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->open = nufs_ll_open;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->fallocate = nufs_ll_fallocate;
+  ops->ioctl = nufs_ll_ioctl;
+  ops->flush = nufs_ll_flush;
+  ops->release = nufs_ll_release;
+  ops->fsync = nufs_ll_fsync;
+  ops->statfs = nufs_ll_statfs;
+}
+
+static struct fuse_lowlevel_ops nufs_ll_ops;
+
+int main(int argc, char *argv[])
+{
+  // nufs options (see mount.c) and the caching options come out here, the rest goes to libfuse
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  mount_config_t cfg;
+  if (mount_parse(&args, &cfg) < 0 || fuse_opt_parse(&args, &ll_cfg, ll_opts, NULL) == -1)
+  {
+    return 1;
+  }
+  char *mountpoint = NULL;
+  int multithreaded;
+  int foreground;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL)
+  {
+    return cfg.show_help ? 0 : 1;
+  }
+
+  storage_opts = cfg.storage;
+  printf("Mounting %s as data file\n", cfg.image);
+  int rv = storage_init(cfg.image);
+  if (rv < 0)
+  {
+    fprintf(stderr, "Can not mount %s: %s (images are made with mkfs.nufs)\n", cfg.image, strerror(-rv));
+    return 1;
+  }
+
+  int err = 1;
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch != NULL)
+  {
+    nufs_ll_init_ops(&nufs_ll_ops);
+    struct fuse_session *se = fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+    if (se != NULL)
+    {
+      if (fuse_set_signal_handlers(se) != -1)
+      {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        if (cfg.threads > 1)
+        {
+          err = mount_session_loop(se, cfg.threads);
+        }
+        else
+        {
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+
+  // The session only calls destroy if the kernel ever got to init
+  if (!storage_closed)
+  {
+    storage_close();
+  }
+  free(mountpoint);
+  free(cfg.image);
+  fuse_opt_free_args(&args);
+  return err ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+#include "opstats.h"
+#include "storage.h"
+#include "bcache.h"
+#include "checksum.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t buckets[OPSTATS_BUCKETS];
+} op_counters_t;
+
+static op_counters_t counters[OP_COUNT];
+
+static const char *op_names[OP_COUNT] = {
+    "getattr", "access", "readdir", "mknod", "mkdir", "unlink", "rmdir", "rename",
+    "chmod", "truncate", "open", "read", "write", "fsync", "statfs",
+    "opendir", "fallocate", "ioctl", "flush", "release", "fsyncdir", "lookup", "forget",
+    "setattr", "create",
+};
+
+// Monotonic clock in nanoseconds, what every operation is timed against
+uint64_t opstats_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// The bucket of a latency: the number of bits it takes
+static int bucket_of(uint64_t ns)
+{
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return b < OPSTATS_BUCKETS ? b : OPSTATS_BUCKETS - 1;
+}
+
+// Count one call of op that started at start (from opstats_now), returned rv
+// and moved bytes bytes; return rv, so a callback can end with return opstats_done(...)
+int opstats_done(opstats_op_t op, uint64_t start, int rv, size_t bytes)
+{
+    uint64_t ns = opstats_now() - start;
+    op_counters_t *c = &counters[op];
+
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    if (rv < 0)
+    {
+        __atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+    }
+    if (bytes > 0)
+    {
+        __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    return rv;
+}
+
+// Upper bound in microseconds of the latency below which a fraction q of the calls fall
+static double percentile_us(const op_counters_t *c, uint64_t calls, double q)
+{
+    uint64_t want = (uint64_t)(calls * q);
+    uint64_t seen = 0;
+    for (int b = 0; b < OPSTATS_BUCKETS; b++)
+    {
+        seen += c->buckets[b];
+        if (seen > want)
+        {
+            return (double)(1ULL << b) / 1000;
+        }
+    }
+    return (double)(1ULL << (OPSTATS_BUCKETS - 1)) / 1000;
+}
+
+// Render every counter as text, one line per operation and per storage layer:
+//   op <name> calls N errors N bytes N total_ns N p50_us X p99_us X hist <bucket>:<count> ...
+// where bucket b counts the calls that took under 2^b ns
+// Return the text (malloc'd) and its length in *len
+char *opstats_render(size_t *len)
+{
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+    if (out == NULL)
+    {
+        *len = 0;
+        return NULL;
+    }
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        op_counters_t c;
+        for (int b = 0; b < OPSTATS_BUCKETS; b++)
+        {
+            c.buckets[b] = __atomic_load_n(&counters[op].buckets[b], __ATOMIC_RELAXED);
+        }
+        c.calls = __atomic_load_n(&counters[op].calls, __ATOMIC_RELAXED);
+        c.errors = __atomic_load_n(&counters[op].errors, __ATOMIC_RELAXED);
+        c.bytes = __atomic_load_n(&counters[op].bytes, __ATOMIC_RELAXED);
+        c.total_ns = __atomic_load_n(&counters[op].total_ns, __ATOMIC_RELAXED);
+
+        // The histogram is read first, so its counts never run ahead of calls
+        uint64_t calls = 0;
+        for (int b = 0; b < OPSTATS_BUCKETS; b++)
+        {
+            calls += c.buckets[b];
+        }
+        fprintf(out, "op %s calls %" PRIu64 " errors %" PRIu64 " bytes %" PRIu64 " total_ns %" PRIu64 " p50_us %.3f p99_us %.3f hist",
+                op_names[op], c.calls, c.errors, c.bytes, c.total_ns,
+                calls ? percentile_us(&c, calls, 0.5) : 0.0, calls ? percentile_us(&c, calls, 0.99) : 0.0);
+        for (int b = 0; b < OPSTATS_BUCKETS; b++)
+        {
+            if (c.buckets[b] != 0)
+            {
+                fprintf(out, " %d:%" PRIu64, b, c.buckets[b]);
+            }
+        }
+        fputc('\n', out);
+    }
+
+    storage_meta_stats_t meta;
+    storage_get_meta_stats(&meta);
+    fprintf(out, "metadata operations %ld flushes %ld bytes_written %ld\n",
+            meta.operations, meta.flushes, meta.bytes_written);
+    fprintf(out, "journal commits %ld bytes %ld checkpoints %ld\n",
+            meta.journal_commits, meta.journal_bytes, meta.checkpoints);
+
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    fprintf(out, "cache hits %ld misses %ld evictions %ld writebacks %ld\n",
+            cache.hits, cache.misses, cache.evictions, cache.writebacks);
+
+    // ratio: full blocks written over blocks they took, ns_per_mib: hashing and comparing per MiB written
+    if (storage_opts.dedup)
+    {
+        storage_dedup_stats_t dedup;
+        storage_get_dedup_stats(&dedup);
+        long stored = dedup.blocks - dedup.shared - dedup.zero;
+        double mib = (double)dedup.blocks * BLOCK_SIZE / (1 << 20);
+        fprintf(out, "dedup blocks %ld shared %ld zero %ld collisions %ld hash_ns %ld verify_ns %ld ratio %.3f ns_per_mib %.0f\n",
+                dedup.blocks, dedup.shared, dedup.zero, dedup.collisions, dedup.hash_ns, dedup.verify_ns,
+                stored > 0 ? (double)dedup.blocks / stored : 0.0, mib > 0 ? (dedup.hash_ns + dedup.verify_ns) / mib : 0.0);
+    }
+
+    // ratio: bytes of the clusters stored compressed over the blocks they took, ns_per_mib: compressing per MiB tried
+    if (storage_opts.compress)
+    {
+        storage_compress_stats_t comp;
+        storage_get_compress_stats(&comp);
+        double mib = (double)comp.clusters * COMPRESS_CLUSTER_SIZE / (1 << 20);
+        fprintf(out, "compress clusters %ld stored %ld bytes_in %ld bytes_out %ld compress_ns %ld reads %ld decompress_ns %ld "
+                     "ratio %.3f ns_per_mib %.0f\n",
+                comp.clusters, comp.stored, comp.bytes_in, comp.bytes_out, comp.compress_ns, comp.reads, comp.decompress_ns,
+                comp.bytes_out > 0 ? (double)comp.bytes_in / comp.bytes_out : 0.0, mib > 0 ? comp.compress_ns / mib : 0.0);
+    }
+
+    // per_writeout: writes coalesced into each write-out of a buffer
+    storage_wbuf_stats_t wb;
+    storage_get_wbuf_stats(&wb);
+    fprintf(out, "wbuf writes %ld bypassed %ld writeouts %ld merged %ld bytes %ld reclaims %ld per_writeout %.3f\n",
+            wb.writes, wb.bypassed, wb.writeouts, wb.merged, wb.bytes, wb.reclaims,
+            wb.writeouts > 0 ? (double)wb.merged / wb.writeouts : 0.0);
+
+    storage_readahead_stats_t ra;
+    storage_get_readahead_stats(&ra);
+    fprintf(out, "readahead reads %ld sequential %ld hits %ld hit_bytes %ld windows %ld window_bytes %ld\n",
+            ra.reads, ra.sequential, ra.hits, ra.hit_bytes, ra.windows, ra.window_bytes);
+
+    // ns_per_mib: checking per MiB read back
+    storage_checksum_stats_t sums;
+    storage_get_checksum_stats(&sums);
+    double mib = (double)sums.verified * BLOCK_SIZE / (1 << 20);
+    fprintf(out, "checksum verified %ld mismatches %ld verify_ns %ld scrubbed %ld scrub_mismatches %ld scrub_passes %ld "
+                 "hardware %d ns_per_mib %.0f\n",
+            sums.verified, sums.mismatches, sums.verify_ns, sums.scrubbed, sums.scrub_mismatches, sums.scrub_passes,
+            checksum_hardware(), mib > 0 ? sums.verify_ns / mib : 0.0);
+
+    fclose(out);
+    return text;
+}
@@ -0,0 +1,47 @@
+#ifndef OPSTATS_H
+#define OPSTATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Always-on counters of the FUSE operations: calls, errors, bytes moved, and a
+// latency histogram with one bucket per power of two of nanoseconds
+// Every update is a relaxed atomic add, nothing on the hot path takes a lock
+
+typedef enum
+{
+    OP_GETATTR,
+    OP_ACCESS,
+    OP_READDIR,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_CHMOD,
+    OP_TRUNCATE,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_FSYNC,
+    OP_STATFS,
+    OP_OPENDIR,
+    OP_FALLOCATE,
+    OP_IOCTL,
+    OP_FLUSH,
+    OP_RELEASE,
+    OP_FSYNCDIR,
+    OP_LOOKUP,  // The rest only come from the low-level frontend
+    OP_FORGET,
+    OP_SETATTR,
+    OP_CREATE,
+    OP_COUNT
+} opstats_op_t;
+
+#define OPSTATS_BUCKETS 40 // Bucket b holds latencies below 2^b ns, the last one everything longer
+
+uint64_t opstats_now();
+int opstats_done(opstats_op_t op, uint64_t start, int rv, size_t bytes);
+char *opstats_render(size_t *len);
+
+#endif // OPSTATS_H
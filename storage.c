@@ -1,619 +1,5844 @@
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
 #include "storage.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fuse.h>
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include "disk.h"
+#include "balloc.h"
+#include "journal.h"
+#include "bcache.h"
+#include "dedup.h"
+#include "compress.h"
+#include "checksum.h"
+#include "trace.h"
 
-static superblock_t sb; // The super block
-static inode_t inodes[MAX_FILES];
+storage_options_t storage_opts; // Mount-time tunables, set up by the frontend before storage_init
+
+static superblock_t sb;               // The super block
+static uint64_t *block_bitmap = NULL; // The block bitmap, sb.bitmap_blocks blocks of it
+static uint16_t *block_shares = NULL; // The share table, sb.share_blocks blocks of it, under alloc_lock
+static uint64_t *block_hashes = NULL; // The hash table, sb.hash_blocks blocks of it, under alloc_lock
+static uint32_t *block_lengths = NULL; // The length table, sb.length_blocks blocks of it, under alloc_lock
+static uint32_t *block_sums = NULL;    // The checksum table, sb.sum_blocks blocks of it, under alloc_lock
+static char *inode_table = NULL;      // The inode table, sb.inode_blocks blocks of it
 static char disk_filename[MAX_NAME]; // The name of the file that stores disk img information
+static int inode_cursor = 0;         // Where the search for a free inode starts, under ns_lock
+static int free_inodes = 0;          // Inodes not in use, under ns_lock
+static uint32_t *kernel_refs = NULL; // Per inode, lookups the low-level frontend still holds, atomic
 
-// Helper method, takes a path, a string named parent, a string name fname
-// Analyze the given path, and extract current path's parent dir name, and the path itself's name
-// If the path is at the root (/), set parent as "~"
-static void get_parent_and_name(const char *path, char *parent, char *fname)
+// Inode i of the table, records are sb.inode_size bytes apart
+static inode_t *inode_at(int i)
 {
-    // Find the last slash in the path
-    const char *slash = strrchr(path, '/');
+    return (inode_t *)(inode_table + (size_t)i * sb.inode_size);
+}
 
-    // Handle root path "/"
-    if (slash == path)
-    {
-        if (parent != NULL)
-        {
-            strcpy(parent, "~");
-        }
-        if (fname != NULL)
-        {
-            if (strlen(path) > 1)
-            {
-                strcpy(fname, path + 1);
-            }
-            else
-            {
-                strcpy(fname, ".");
-            }
-        }
-        return;
-    }
+// The inline contents of inode i, inline_capacity() bytes of them
+static char *inline_data(int i)
+{
+    return (char *)inode_at(i) + INODE_INLINE_OFFSET;
+}
 
-    // For non-root paths
-    if (parent != NULL)
-    {
-        if (slash)
-        {
-            int plen = slash - path;
-            strncpy(parent, path, plen);
-            parent[plen] = '\0';
-        }
-        else
-        {
-            strcpy(parent, "~");
-        }
-    }
+// How many bytes of contents fit in an inode, the rest of the record past its header
+static int inline_capacity()
+{
+    return sb.inode_size - (int)INODE_INLINE_OFFSET;
+}
 
-    if (fname != NULL)
-    {
-        if (slash)
-        {
-            strcpy(fname, slash + 1);
-        }
-        else
-        {
-            strcpy(fname, path);
-        }
-    }
+// Locking, always taken in this order:
+//   txn_lock     shared by every operation that changes metadata, exclusive while the
+//                journal or a checkpoint takes its snapshot, so snapshots never see half an operation
+//   ns_lock      the namespace: the directories, the dentry hash and which inodes are used
+//   inode_locks  striped over the inodes: size, mode and extents, and I/O on the data
+//                (changing a directory takes both ns_lock and the directory's inode lock)
+//   alloc_lock   the block bitmap, free block count, share, hash, length and checksum tables, the dedup index
+//                and deferred frees
+//   meta_lock    the dirty state below
+// The block cache has locks of its own, it never calls back into this file
+#define INODE_LOCKS 1024
+
+static pthread_rwlock_t txn_lock;
+static pthread_rwlock_t ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inode i is guarded by stripe i % INODE_LOCKS, so inodes that share a stripe serialize
+static pthread_rwlock_t *inode_lock(int i)
+{
+    return &inode_locks[i % INODE_LOCKS];
 }
 
-// Takes a block, which is the index of the block, logically
-// And a value, which could rather be 1 or 0, means to set this block used or free
-static void set_bitmap(int block, int value)
+// Metadata that changed since the last checkpoint, only these parts get written home
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the dirty state and the flusher
+static int sb_dirty = 0;                   // Superblock (free block count) changed
+static int bitmap_dirty_lo = INT_MAX;      // Dirty byte range of the bitmap, empty when lo >= hi
+static int bitmap_dirty_hi = 0;
+static int shares_dirty_lo = INT_MAX;      // Dirty byte range of the share table
+static int shares_dirty_hi = 0;
+static char *inode_block_dirty = NULL;     // One flag per block of the inode table
+static int *dirty_inode_blocks = NULL;     // The blocks flagged, so a checkpoint needs no scan
+static int ndirty_inode_blocks = 0;
+
+// Metadata that changed since the last journal commit, logged by the next one
+static int jsb_dirty = 0;
+static int jbitmap_lo = INT_MAX;
+static int jbitmap_hi = 0;
+static int jshares_lo = INT_MAX;
+static int jshares_hi = 0;
+static char *jinode_dirty = NULL; // One flag per inode
+static int *jinode_list = NULL;   // The inodes flagged
+static int njinode = 0;
+
+// The changes to a table with an entry per block (the hash, length and checksum tables), tracked
+// entry by entry, for both the next commit and the next checkpoint: they land all over the image
+typedef struct
+{
+    int entry_size;
+    char *block_dirty; // One flag per block of the table
+    int *dirty_blocks; // The blocks flagged
+    int ndirty_blocks;
+    char *jdirty;      // One flag per entry
+    int *jlist;        // The entries flagged
+    int njlist;
+} entry_log_t;
+
+static entry_log_t hash_log = {sizeof(uint64_t)};
+static entry_log_t length_log = {sizeof(uint32_t)};
+static entry_log_t sum_log = {sizeof(uint32_t)};
+
+// A directory slot whose entry changed
+typedef struct
 {
+    int dir;
+    int slot;
+} slot_ref_t;
+
+typedef struct
+{
+    slot_ref_t *refs;
+    int n;
+    int cap;
+} slot_list_t;
+
+static slot_list_t dirty_slots;  // Since the last checkpoint, their blocks get written home
+static slot_list_t jdirty_slots; // Since the last commit, logged one slot at a time
+
+// A run of blocks waiting to be freed
+typedef struct
+{
+    int start;
+    int len;
+} run_t;
+
+// Freed blocks only go back to the allocator once the transaction freeing them is durable,
+// otherwise a crash could leave a file pointing at blocks already handed to another one
+static run_t *pending_frees = NULL;  // Freed by operations since the last commit
+static int npending_frees = 0;
+static run_t *inflight_frees = NULL; // Collected into the commit in progress
+static int ninflight_frees = 0;
+
+// Blocks of removed directories wait longer, for the next checkpoint: until then
+// the journal may still hold slot records aimed at them, which a replay would
+// write over whatever the blocks were handed to next
+static run_t *pending_dir_frees = NULL;
+static int npending_dir_frees = 0;
+
+static storage_meta_stats_t meta_stats;
+static storage_dedup_stats_t dedup_stats;       // Under meta_lock
+static storage_compress_stats_t compress_stats; // Under meta_lock
+static storage_checksum_stats_t checksum_stats; // Under meta_lock
 
-    // Find the index of the byte in the block map
-    int byte_index = block / 8;
+static long synced_operations = 0; // meta_stats.operations the last storage_fsync covered, under meta_lock
+static int data_unsynced = 0;      // File data was written since the last journal commit, atomic
 
-    // Find the index of the bit in the block map
-    int bit_index = block % 8;
+static pthread_t flusher_thread;
+static int flusher_running = 0;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
 
-    // Set as 0 or 1, as value defined
-    // By bit operations
-    if (value)
+static pthread_t scrub_thread;
+static int scrub_running = 0;
+static pthread_cond_t scrub_cond = PTHREAD_COND_INITIALIZER;
+
+// A file's buffered writes, not given any blocks yet: the bytes offset .. offset + len - 1,
+// made of writes that overlapped or followed each other (see buffer_write)
+typedef struct wbuf
+{
+    int ino;
+    int writes;        // Writes merged into it
+    off_t offset;
+    size_t len;
+    size_t cap;
+    char *data;
+    struct wbuf *prev; // In the list of buffers, oldest first, under wbuf_lock
+    struct wbuf *next;
+} wbuf_t;
+
+static wbuf_t **wbufs = NULL;  // Per inode, its buffered writes, or NULL; under the inode lock
+static size_t wbuf_budget = 0; // Bytes all buffers together may hold, 0 when writes are not buffered
+static pthread_mutex_t wbuf_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the list, wbuf_bytes and wbuf_stats
+static wbuf_t *wbuf_oldest = NULL;
+static wbuf_t *wbuf_newest = NULL;
+static size_t wbuf_bytes = 0;
+static storage_wbuf_stats_t wbuf_stats;
+
+// Forget the buffered writes of inode i, with its lock held exclusive
+static void drop_buffer(int i)
+{
+    wbuf_t *w = wbufs[i];
+    if (w == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&wbuf_lock);
+    if (w->prev != NULL)
     {
-        sb.block_bitmap[byte_index] |= (1 << bit_index);
+        w->prev->next = w->next;
     }
     else
     {
-        sb.block_bitmap[byte_index] &= ~(1 << bit_index);
+        wbuf_oldest = w->next;
     }
+    if (w->next != NULL)
+    {
+        w->next->prev = w->prev;
+    }
+    else
+    {
+        wbuf_newest = w->prev;
+    }
+    wbuf_bytes -= w->cap;
+    pthread_mutex_unlock(&wbuf_lock);
+    free(w->data);
+    free(w);
+    wbufs[i] = NULL;
 }
 
-// Take an index of a block, and check in bit map, if the block is used
-// If so, return 1, else, return 0
-static int is_block_used(int block)
+#define RA_EMPTY 0   // ra_window_t.state: holds nothing
+#define RA_PENDING 1 // Queued for the readahead threads, or being filled by one
+#define RA_READY 2   // Holds the bytes start .. start + len - 1 of the file
+
+// What was read ahead for an open file, see note_read
+typedef struct ra_window
+{
+    int state;
+    int ino;
+    uint32_t gen;  // data_gens[ino] as the bytes were read, they are stale once it moves on
+    int eof;       // The file ended at start + len
+    off_t start;
+    size_t len;    // Bytes to read, those read once ready
+    size_t filled; // Bytes read so far, a window is read RA_CHUNK at a time
+    size_t cap;
+    char *data;    // Past filled, only touched by the readahead thread filling it while pending
+    struct storage_file *file;
+    struct ra_window *queue_next; // In the readahead queue, under ra_lock
+} ra_window_t;
+
+#define RA_WINDOWS 2 // One being read from, one read ahead of it
+
+// What an open file keeps in fi->fh: where its reads left off, and what was read ahead for them
+struct storage_file
+{
+    pthread_mutex_t lock; // Guards all of it, but the data of a pending window
+    pthread_cond_t done;  // A window stopped being pending
+    int ino;              // The inode of the last read
+    off_t next;           // Where the last read ended, -1 before the first one
+    int seq;              // Reads in a row that carried on from the one before
+    size_t window;        // Bytes the next window reads ahead
+    int closing;
+    ra_window_t windows[RA_WINDOWS];
+};
+
+#define RA_THREADS 4 // Readahead threads, filling the windows of different files in parallel
+
+static uint32_t *data_gens = NULL; // Per inode, moves on with every change of its contents, atomic
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the queue and ra_stats
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static ra_window_t *ra_head = NULL; // Windows queued for the readahead threads, oldest first
+static ra_window_t *ra_tail = NULL;
+static pthread_t ra_threads[RA_THREADS];
+static int ra_nthreads = 0;
+static int ra_running = 0;
+static storage_readahead_stats_t ra_stats;
+
+// Make whatever was read ahead of inode i stale, with its lock held exclusive
+static void data_changed(int i)
 {
-    int byte_index = block / 8;
-    int bit_index = block % 8;
-    return sb.block_bitmap[byte_index] & (1 << bit_index);
+    __atomic_add_fetch(&data_gens[i], 1, __ATOMIC_RELAXED);
 }
 
-// Try to find an unused block from the bit map
-// If found any, return the index of that block
-// If not, return -1 (block index start with 0)
-static int allocate_block()
+// Mark the inode table block(s) holding inode i as dirty
+static void mark_inode_dirty(int i)
 {
-    for (int i = 0; i < sb.total_blocks; i++)
+    size_t begin = (size_t)i * sb.inode_size;
+    size_t end = begin + sb.inode_size - 1;
+
+    pthread_mutex_lock(&meta_lock);
+    for (size_t b = begin / BLOCK_SIZE; b <= end / BLOCK_SIZE; b++)
     {
-        if (!is_block_used(i))
+        if (!inode_block_dirty[b])
         {
-            set_bitmap(i, 1);
-            sb.free_blocks--;
-            return i;
+            inode_block_dirty[b] = 1;
+            dirty_inode_blocks[ndirty_inode_blocks++] = b;
         }
     }
-    return -1;
+    if (!jinode_dirty[i])
+    {
+        jinode_dirty[i] = 1;
+        jinode_list[njinode++] = i;
+    }
+    pthread_mutex_unlock(&meta_lock);
 }
 
-// Takes a block index, and set the block as unused in bitmap.
-static void free_block(int block)
+// Widen the byte range [*lo, *hi) to cover [lo, hi)
+static void widen_range(int *range_lo, int *range_hi, int lo, int hi)
 {
-    if (is_block_used(block))
+    if (lo < *range_lo)
     {
-        set_bitmap(block, 0);
-        sb.free_blocks++;
+        *range_lo = lo;
+    }
+    if (hi > *range_hi)
+    {
+        *range_hi = hi;
     }
 }
 
-// Write the super block structure and inodes array into disk img file
-// Should be called each time after inode array are updated
-void write_inodes_to_disk()
+// Mark the bitmap bytes covering blocks [start, start + len), and the free block count, as dirty
+// journal says whether the change still has to be logged, or is already durable
+static void mark_bitmap_dirty(int start, int len, int journal)
 {
+    int lo = start / 8;
+    int hi = (start + len - 1) / 8 + 1;
 
-    FILE *fp = fopen(disk_filename, "r+");
-    if (!fp)
+    pthread_mutex_lock(&meta_lock);
+    sb_dirty = 1;
+    widen_range(&bitmap_dirty_lo, &bitmap_dirty_hi, lo, hi);
+    if (journal)
     {
-        printf("Can not open disk image");
-        return;
+        jsb_dirty = 1;
+        widen_range(&jbitmap_lo, &jbitmap_hi, lo, hi);
     }
+    pthread_mutex_unlock(&meta_lock);
+}
 
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, sizeof(superblock_t), 1, fp);
-
-    fseek(fp, BLOCK_SIZE, SEEK_SET);
-    fwrite(inodes, sizeof(inodes), 1, fp);
+// Mark the share table entries of blocks [start, start + len) as changed, for the next commit and checkpoint
+static void mark_shares_dirty(int start, int len)
+{
+    int lo = start * (int)sizeof(uint16_t);
+    int hi = (start + len) * (int)sizeof(uint16_t);
 
-    fclose(fp);
+    pthread_mutex_lock(&meta_lock);
+    widen_range(&shares_dirty_lo, &shares_dirty_hi, lo, hi);
+    widen_range(&jshares_lo, &jshares_hi, lo, hi);
+    pthread_mutex_unlock(&meta_lock);
 }
 
-// Initialize the storage
-// Initialize the super block, inodes array, and mounting
-void storage_init(const char *path)
+// Mark the entry of block b in the table log tracks as changed, for the next commit and checkpoint
+static void mark_entry_dirty(entry_log_t *log, int b)
 {
-    printf("BreakPoint#629\n");
-    snprintf(disk_filename, MAX_NAME, "%s", path);
+    int table_block = b / (BLOCK_SIZE / log->entry_size);
 
-    // Try to open the existing mount path
-    FILE *fp = fopen(disk_filename, "r+");
-    if (!fp)
+    pthread_mutex_lock(&meta_lock);
+    if (!log->block_dirty[table_block])
     {
-        // If the given path do not exist, make one
-        fp = fopen(disk_filename, "w+");
-        if (!fp)
-        {
-            perror("Failed creating disk image");
-            return;
-        }
+        log->block_dirty[table_block] = 1;
+        log->dirty_blocks[log->ndirty_blocks++] = table_block;
+    }
+    if (!log->jdirty[b])
+    {
+        log->jdirty[b] = 1;
+        log->jlist[log->njlist++] = b;
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
 
-        // First, set total_blocks and free_blocks to be total block's number
-        sb.total_blocks = TOTAL_BLOCKS;
-        sb.free_blocks = TOTAL_BLOCKS - 18;
-        memset(sb.block_bitmap, 0, sizeof(sb.block_bitmap));
+static void push_slot_ref(slot_list_t *list, int dir, int slot)
+{
+    if (list->n == list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->refs = realloc(list->refs, list->cap * sizeof(slot_ref_t));
+    }
+    list->refs[list->n++] = (slot_ref_t){dir, slot};
+}
 
-        // Set the first 18 blocks as used
-        // (Root takes a block, and will be initialized in this method)
-        for (int i = 0; i < 18; i++)
-        {
-            set_bitmap(i, 1);
-        }
+// Mark slot of directory dir as changed, for the next commit and the next checkpoint
+static void mark_slot_dirty(int dir, int slot)
+{
+    pthread_mutex_lock(&meta_lock);
+    push_slot_ref(&dirty_slots, dir, slot);
+    push_slot_ref(&jdirty_slots, dir, slot);
+    pthread_mutex_unlock(&meta_lock);
+}
 
-        char *root = malloc(sizeof(char) * MAX_NAME);
-        root[0] = '/';
-        root[1] = '\0';
-        storage_create(root, S_IFDIR | 0777);
+// Operations that change metadata run between txn_begin and txn_end
+static void txn_begin()
+{
+    pthread_rwlock_rdlock(&txn_lock);
+}
 
-        printf("BreakPoint#630\n");
+static void txn_end()
+{
+    pthread_rwlock_unlock(&txn_lock);
+}
 
-        fseek(fp, 0, SEEK_SET);
-        fwrite(&sb, sizeof(superblock_t), 1, fp);
-        fseek(fp, BLOCK_SIZE, SEEK_SET);
-        fwrite(inodes, sizeof(inodes), 1, fp);
+// Byte offset of a data block inside the disk image
+// Block numbers are absolute, the first sb.data_start blocks hold the superblock, the tables and the journal
+static off_t block_offset(int block)
+{
+    return (off_t)block * BLOCK_SIZE;
+}
 
-        fclose(fp);
+// Allocate a contiguous run of up to want blocks, preferring to start at goal (-1 for no preference)
+// Return the first block and the run length in *got, or -1 if the disk is full
+static int allocate_run(int want, int goal, int *got)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int start = balloc_alloc(want, goal, got);
+    if (start >= 0)
+    {
+        sb.free_blocks -= *got;
+        mark_bitmap_dirty(start, *got, 1);
     }
-    else
+    pthread_mutex_unlock(&alloc_lock);
+    return start;
+}
+
+// Set the checksum table entry of block b, with alloc_lock held
+static void set_sum(int b, uint32_t sum)
+{
+    if (block_sums[b] != sum)
     {
-        fseek(fp, 0, SEEK_SET);
-        fread(&sb, sizeof(superblock_t), 1, fp);
-        fseek(fp, BLOCK_SIZE, SEEK_SET);
-        fread(inodes, sizeof(inodes), 1, fp);
+        block_sums[b] = sum;
+        mark_entry_dirty(&sum_log, b);
+    }
+}
 
-        fclose(fp);
+// Give back a run that allocate_run just handed out, before anything referenced it
+// Nothing on disk or in the journal can point at it, so it is free again right away
+static void unallocate_run(int start, int len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    balloc_free(start, len);
+    sb.free_blocks += len;
+    mark_bitmap_dirty(start, len, 1);
+    bcache_invalidate(start, len);
+    for (int b = start; b < start + len; b++)
+    {
+        set_sum(b, 0);
     }
-    printf("BreakPoint#631\n");
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-// Takes a path, and check if the path already exist in mounted file system
-// If so, return as -EEXIST, if not, create one
-int storage_create(const char *path, mode_t mode)
+// Queue [start, start + len) to be freed, with alloc_lock held
+static void push_pending_free(int start, int len)
 {
+    if (npending_frees % 64 == 0)
+    {
+        pending_frees = realloc(pending_frees, (npending_frees + 64) * sizeof(run_t));
+    }
+    pending_frees[npending_frees++] = (run_t){start, len};
+}
 
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
-    printf("BreakPoint#MAKING path is: %s fname is: %s, pname is: %s\n", path, fname, parent_name);
+// Take block b out of the dedup index, with alloc_lock held: its contents are about
+// to change in place, or it is being freed
+static void unindex_block(int b)
+{
+    if (block_hashes[b] != 0)
+    {
+        dedup_remove(block_hashes[b], b);
+        block_hashes[b] = 0;
+        mark_entry_dirty(&hash_log, b);
+    }
+}
 
-    // If given path is empty, throw error -EINVAL
-    if (strlen(path) == 0)
+// Index block b, whose contents hash to hash, for later writes of the same bytes to share
+// Called with alloc_lock held; nothing changes if another block already has the hash
+static void index_block(int b, uint64_t hash)
+{
+    if (dedup_insert(hash, b) == 1)
     {
-        printf("file path is empty\n");
-        return -EINVAL;
+        block_hashes[b] = hash;
+        mark_entry_dirty(&hash_log, b);
+    }
+}
+
+// Set the length table entry of block b, with alloc_lock held
+static void set_length(int b, uint32_t length)
+{
+    if (block_lengths[b] != length)
+    {
+        block_lengths[b] = length;
+        mark_entry_dirty(&length_log, b);
     }
+}
 
-    // Check if already exist same name file
-    for (int i = 0; i < MAX_FILES; i++)
+// Takes the run [start, start + len) of used blocks and set them as unused in bitmap
+// The bits are only cleared once the transaction doing this is durable
+// A block other files still share only loses one owner, and stays in use
+static void free_run(int start, int len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int from = start;
+    for (int b = start; b < start + len; b++)
     {
-        if (inodes[i].is_used &&
-            strcmp(inodes[i].name, fname) == 0
-            // && strcmp(inodes[i].parent, parent_name) == 0
-        )
+        if (block_shares[b] == 0)
+        {
+            unindex_block(b);
+            set_length(b, 0);
+            set_sum(b, 0);
+            continue;
+        }
+        block_shares[b]--;
+        mark_shares_dirty(b, 1);
+        if (from < b)
         {
-            printf("file of given path already exists\n");
-            return -EEXIST;
+            push_pending_free(from, b - from);
         }
+        from = b + 1;
     }
+    if (from < start + len)
+    {
+        push_pending_free(from, start + len - from);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-    // Find avaliable inode and create file
-    for (int i = 0; i < MAX_FILES; i++)
+// Add an owner to every block of [start, start + len), for a clone
+// Return 0, or -EMLINK if a block already has as many as the share table counts
+static int take_shares(int start, int len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (int b = start; b < start + len; b++)
     {
-        if (!inodes[i].is_used)
+        if (block_shares[b] == UINT16_MAX)
         {
-            inodes[i].is_used = 1;
-            strncpy(inodes[i].name, fname, MAX_NAME - 1);
-            inodes[i].name[MAX_NAME - 1] = '\0';
+            pthread_mutex_unlock(&alloc_lock);
+            return -EMLINK;
+        }
+    }
+    for (int b = start; b < start + len; b++)
+    {
+        block_shares[b]++;
+    }
+    mark_shares_dirty(start, len);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
 
-            strncpy(inodes[i].parent, parent_name, MAX_NAME - 1);
-            inodes[i].parent[MAX_NAME - 1] = '\0';
+// Undo take_shares, for a clone that failed before anything referenced the blocks
+static void drop_shares(int start, int len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (int b = start; b < start + len; b++)
+    {
+        block_shares[b]--;
+    }
+    mark_shares_dirty(start, len);
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-            inodes[i].size = 0;
-            inodes[i].ref_count = 1;
-            inodes[i].mode = mode;
-            inodes[i].block = allocate_block();
+// Like free_run, for the blocks of a removed directory, see pending_dir_frees
+static void free_dir_run(int start, int len)
+{
+    pthread_mutex_lock(&alloc_lock);
+    if (npending_dir_frees % 64 == 0)
+    {
+        pending_dir_frees = realloc(pending_dir_frees, (npending_dir_frees + 64) * sizeof(run_t));
+    }
+    pending_dir_frees[npending_dir_frees++] = (run_t){start, len};
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-            // Async meta data between RAM and disk img file
-            write_inodes_to_disk();
-            printf("successfully created path: %s with inode index: %d \n", path, i);
-            return 0;
+// Takes a block index, and set the block as unused in bitmap.
+static void free_block(int block)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int used = balloc_is_used(block);
+    pthread_mutex_unlock(&alloc_lock);
+    if (used)
+    {
+        free_run(block, 1);
+    }
+}
+
+// Read the extent list of inode i into ext, which must hold EXTENT_SCRATCH entries
+// Return the number of extents, or -EIO
+static int load_extents(int i, extent_t *ext)
+{
+    int n = inode_at(i)->extent_count;
+    int direct = n < INODE_EXTENTS ? n : INODE_EXTENTS;
+
+    memcpy(ext, inode_at(i)->extents, direct * sizeof(extent_t));
+    if (n > INODE_EXTENTS &&
+        bcache_read(ext + INODE_EXTENTS, (n - INODE_EXTENTS) * sizeof(extent_t), block_offset(inode_at(i)->indirect)) < 0)
+    {
+        return -EIO;
+    }
+    return n;
+}
+
+// Drop empty extents and merge neighbours that are contiguous both in the file and on disk
+// Takes a list sorted by logical block, return the new count
+static int compact_extents(extent_t *ext, int n)
+{
+    int m = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (ext[k].length == 0)
+        {
+            continue;
         }
-        else
+        if (m > 0 &&
+            ext[m - 1].logical + ext[m - 1].length == ext[k].logical &&
+            ext[m - 1].start + ext[m - 1].length == ext[k].start)
         {
-            printf("inode with index: %d already used\n", i);
+            ext[m - 1].length += ext[k].length;
+            continue;
         }
+        ext[m++] = ext[k];
     }
-
-    // If no avaliable inode to utilize, return -ENOSPC
-    printf("No space left on disk.\n");
-    return -ENOSPC;
+    return m;
 }
 
-int storage_delete(const char *path)
+static int compare_logical(const void *a, const void *b)
 {
+    return ((const extent_t *)a)->logical - ((const extent_t *)b)->logical;
+}
 
-    printf("BreakPoint#456\n");
-
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+// Write a compacted extent list back into inode i, spilling past INODE_EXTENTS
+// into the indirect extent block, which is allocated or freed as needed
+// Return 0, or -EFBIG / -ENOSPC / -EIO
+static int store_extents(int i, const extent_t *ext, int n)
+{
+    if (n > MAX_EXTENTS)
+    {
+        return -EFBIG;
+    }
 
-    for (int i = 0; i < MAX_FILES; i++)
+    if (n > INODE_EXTENTS)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        // Never overwrite the indirect block in place: until the inode change is
+        // committed, the old list on disk must stay intact, so write a new copy
+        int got;
+        int block = allocate_run(1, inode_at(i)->indirect + 1, &got);
+        if (block == -1)
         {
-            inodes[i].is_used = 0;
-            free_block(inodes[i].block);
-            write_inodes_to_disk();
-            return 0;
+            return -ENOSPC;
+        }
+        if (bcache_write(ext + INODE_EXTENTS, (n - INODE_EXTENTS) * sizeof(extent_t), block_offset(block)) < 0)
+        {
+            unallocate_run(block, 1);
+            return -EIO;
+        }
+        if (inode_at(i)->indirect != 0)
+        {
+            free_block(inode_at(i)->indirect);
         }
+        inode_at(i)->indirect = block;
     }
-    return -ENOENT;
+    else if (inode_at(i)->indirect != 0)
+    {
+        free_block(inode_at(i)->indirect);
+        inode_at(i)->indirect = 0;
+    }
+
+    memcpy(inode_at(i)->extents, ext, (n < INODE_EXTENTS ? n : INODE_EXTENTS) * sizeof(extent_t));
+    inode_at(i)->extent_count = n;
+    mark_inode_dirty(i);
+    return 0;
 }
 
-// Change the inode of given path "from"'s content to "to"'s information
-int storage_rename(const char *from, const char *to)
+// Return the disk block holding logical block lblk, or -1 if it is a hole
+static int map_block(const extent_t *ext, int n, int lblk)
 {
-    char from_parent[MAX_NAME];
-    char from_name[MAX_NAME];
-    get_parent_and_name(from, from_parent, from_name);
-
-    char to_parent[MAX_NAME];
-    char to_name[MAX_NAME];
-    get_parent_and_name(to, to_parent, to_name);
-
-    for (int i = 0; i < MAX_FILES; i++)
+    for (int k = 0; k < n && ext[k].logical <= lblk; k++)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, from_name) == 0 && strcmp(inodes[i].parent, from_parent) == 0)
+        if (lblk < ext[k].logical + ext[k].length)
         {
-            strcpy(inodes[i].name, to_name);
-            strcpy(inodes[i].parent, to_parent);
-            write_inodes_to_disk();
-            return 0;
+            return ext[k].start + (lblk - ext[k].logical);
         }
     }
-    return -ENOENT;
+    return -1;
 }
 
-// Takes a path to read, a buffer to store content read
-// And a size, which to read size bytes from path, and the offset
-int storage_read(const char *path, char *buf, size_t size, off_t offset)
+// Cut the mappings of logical blocks [from, to) out of the list, without releasing
+// anything: the runs cut out are appended to the *ncut already in cut[] (in order,
+// room for EXTENT_SCRATCH), for the caller to free_run once the new list is stored
+// With shared_only, only the blocks other files share too are cut, the caller is about
+// to change the rest in place, so they leave the dedup index
+// Return the new count, or -EFBIG if the list splits into too many pieces
+static int cut_extents(extent_t *ext, int n, int from, int to, int shared_only, extent_t *cut, int *ncut)
 {
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    extent_t out[EXTENT_SCRATCH];
+    int m = 0;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    pthread_mutex_lock(&alloc_lock);
+    for (int k = 0; k < n; k++)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        int begin = ext[k].logical;
+        int end = begin + ext[k].length;
+        int cut_begin = begin > from ? begin : from;
+        int cut_end = end < to ? end : to;
+
+        if (cut_begin >= cut_end)
+        {
+            cut_begin = cut_end = end;
+        }
+        if (m + 2 >= EXTENT_SCRATCH)
+        {
+            break;
+        }
+        if (begin < cut_begin)
+        {
+            out[m++] = (extent_t){begin, ext[k].start, cut_begin - begin};
+        }
+        // The range in pieces of blocks that are all cut or all kept
+        for (int b = cut_begin; b < cut_end;)
         {
-            if (S_ISDIR(inodes[i].mode))
+            int shared = block_shares[ext[k].start + (b - begin)] != 0;
+            int e = b + 1;
+            while (shared_only && e < cut_end && (block_shares[ext[k].start + (e - begin)] != 0) == shared)
             {
-                return -EISDIR;
+                e++;
             }
-            if (offset >= inodes[i].size)
+            if (!shared_only)
             {
-                return 0;
+                e = cut_end;
             }
 
-            size_t to_read;
-
-            if (offset + size > inodes[i].size)
+            extent_t piece = {b, ext[k].start + (b - begin), e - b};
+            if (!shared_only || shared)
             {
-                to_read = inodes[i].size - offset;
+                cut[(*ncut)++] = piece;
             }
             else
             {
-                to_read = size;
+                out[m++] = piece;
+                for (int j = 0; j < piece.length; j++)
+                {
+                    unindex_block(piece.start + j);
+                }
             }
-
-            FILE *fp = fopen(disk_filename, "r");
-            if (!fp)
+            b = e;
+            if (m + 2 >= EXTENT_SCRATCH || *ncut == EXTENT_SCRATCH)
             {
-                printf("Can't open disk image READ\n");
-                return -EIO;
+                break;
             }
-            fseek(fp, DATA_START * BLOCK_SIZE + inodes[i].block * BLOCK_SIZE + offset, SEEK_SET);
-            size_t n = fread(buf, 1, to_read, fp);
-            fclose(fp);
-            return n;
         }
+        if (cut_end < end)
+        {
+            out[m++] = (extent_t){cut_end, ext[k].start + (cut_end - begin), end - cut_end};
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (m + 2 >= EXTENT_SCRATCH || *ncut == EXTENT_SCRATCH)
+    {
+        return -EFBIG;
     }
-    return -ENOENT;
+    memcpy(ext, out, m * sizeof(extent_t));
+    return compact_extents(ext, m);
 }
 
-// Takes a path, a buffer, a size, a offsset
-//  Write size byte of content from buffer to the file of the path
-//  Start from the offset byte
-int storage_write(const char *path, const char *buf, size_t size, off_t offset)
+// Release the disk blocks behind logical blocks [from, to) and cut them out of the list
+// An extent straddling the range is split, so the list can grow by one
+// Return the new count
+static int punch_extents(extent_t *ext, int n, int from, int to)
+{
+    extent_t cut[EXTENT_SCRATCH];
+    int ncut = 0;
+    n = cut_extents(ext, n, from, to, 0, cut, &ncut);
+    for (int k = 0; k < ncut; k++)
+    {
+        free_run(cut[k].start, cut[k].length);
+    }
+    return n;
+}
+
+// Give every hole in logical blocks [from, to) freshly allocated disk blocks
+// Each hole is filled with as few contiguous runs as the allocator can find,
+// placed right after the block before the hole when that is free
+// New runs are added to ext (kept sorted), and recorded in fresh[] so a
+// failing caller can give them back
+// Return the new count, or -ENOSPC / -EFBIG
+static int fill_extents(extent_t *ext, int n, int from, int to, extent_t *fresh, int *nfresh)
 {
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    extent_t out[EXTENT_SCRATCH];
+    int m = 0;
+    int k = 0;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    *nfresh = 0;
+    for (int b = from; b < to;)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        // Copy over the extents that end before b
+        while (k < n && ext[k].logical + ext[k].length <= b)
         {
-            if (S_ISDIR(inodes[i].mode))
-            {
-                printf("Can not write to a directory \n");
-                return -EISDIR;
-            }
-            if (offset + size > BLOCK_SIZE)
+            out[m++] = ext[k++];
+        }
+        // Already mapped, skip to the end of that extent
+        if (k < n && ext[k].logical <= b)
+        {
+            b = ext[k].logical + ext[k].length;
+            continue;
+        }
+
+        // A hole up to the next extent or the end of the range
+        int hole_end = (k < n && ext[k].logical < to) ? ext[k].logical : to;
+        while (b < hole_end)
+        {
+            int goal = -1;
+            if (m > 0 && out[m - 1].logical + out[m - 1].length == b)
             {
-                return -EFBIG; // Not supporting big file (bigger than 4096) for now
+                goal = out[m - 1].start + out[m - 1].length;
             }
-            if (inodes[i].block < DATA_START)
+
+            int got;
+            int block = allocate_run(hole_end - b, goal, &got);
+            if (block == -1)
             {
-                int block = allocate_block();
-                if (block == -1)
-                {
-                    return -ENOSPC;
-                }
-                inodes[i].block = block;
+                return -ENOSPC;
             }
+            fresh[(*nfresh)++] = (extent_t){b, block, got};
 
-            FILE *fp = fopen(disk_filename, "r+");
-            if (!fp)
+            if (block == goal)
             {
-                printf("Can't open disk image WRITE\n");
-                return -EIO;
+                out[m - 1].length += got;
             }
-
-            fseek(fp, DATA_START * BLOCK_SIZE + inodes[i].block * BLOCK_SIZE + offset, SEEK_SET);
-            size_t n = fwrite(buf, 1, size, fp);
-            fclose(fp);
-
-            if (offset + size > inodes[i].size)
+            else
             {
-                inodes[i].size = offset + size;
+                if (m + (n - k) >= EXTENT_SCRATCH)
+                {
+                    return -EFBIG;
+                }
+                out[m++] = (extent_t){b, block, got};
             }
-            write_inodes_to_disk();
-            return n;
+            b += got;
         }
     }
-    return -ENOENT;
+    while (k < n)
+    {
+        out[m++] = ext[k++];
+    }
+    memcpy(ext, out, m * sizeof(extent_t));
+    return compact_extents(ext, m);
 }
 
-int storage_stat(const char *path, struct stat *st)
+static uint64_t monotonic_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// The checksum table entry of a block holding data: its CRC32C, never 0
+static uint32_t block_sum(const char *data)
 {
+    uint32_t sum = checksum_crc32c(0, data, BLOCK_SIZE);
+    return sum != 0 ? sum : 1;
+}
 
-    for (int i = 0; i < MAX_FILES; i++)
+// Check the disk blocks behind the bytes [from, to) of extent e of a file against their
+// checksums, just read into buf, which holds [offset, ...) of the file: a block buf has
+// in full is summed from it, any other one is read whole; blocks without one pass
+// Return 0, or -EIO if one does not match
+static int verify_blocks(const extent_t *e, const char *buf, off_t offset, off_t from, off_t to,
+                         storage_checksum_stats_t *stats)
+{
+    char copy[BLOCK_SIZE];
+    for (off_t pos = from / BLOCK_SIZE * BLOCK_SIZE; pos < to; pos += BLOCK_SIZE)
     {
-        if (inodes[i].is_used)
+        int b = e->start + (pos / BLOCK_SIZE - e->logical);
+        uint32_t sum = block_sums[b]; // Only changes with the file's lock held exclusive
+        if (sum == 0)
         {
-            // printf("FROM LS: inode with index %d, has pname: %s, and fname: %s\n", inodes[i].block, inodes[i].parent, inodes[i].name);
+            continue;
         }
-    }
-
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
-    // printf("storage_stat: path=%s, parent=%s, name=%s\n", path, parent_name, fname);
-
-    for (int i = 0; i < MAX_FILES; i++)
-    {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        const char *data = buf + (pos - offset);
+        if (pos < from || pos + BLOCK_SIZE > to)
         {
-            memset(st, 0, sizeof(struct stat));
-            st->st_uid = getuid();
-            st->st_gid = getgid();
-            st->st_mode = inodes[i].mode;
-            st->st_size = inodes[i].size;
-            // printf("storage_stat: found inode, mode=%o, size=%d\n", inodes[i].mode, inodes[i].size);
-            return 0;
+            if (bcache_read(copy, BLOCK_SIZE, block_offset(b)) < 0)
+            {
+                return -EIO;
+            }
+            data = copy;
+        }
+        uint64_t t0 = monotonic_ns();
+        int match = block_sum(data) == sum;
+        stats->verify_ns += monotonic_ns() - t0;
+        stats->verified++;
+        if (!match)
+        {
+            TRACE("block %d does not match its checksum\n", b);
+            stats->mismatches++;
+            return -EIO;
         }
     }
-    return -ENOENT;
+    return 0;
 }
 
-int storage_chmod(const char *path, mode_t mode)
+// Record the checksums of the blocks behind the bytes [offset, offset + size) of a file,
+// just written: those buf (holding these bytes) has in full are summed from it, the
+// others read back, all of them with buf NULL; holes have none
+static void update_sums(const extent_t *ext, int n, const char *buf, size_t size, off_t offset)
+{
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    int *blocks = malloc((last - first + 1) * sizeof(int));
+    uint32_t *sums = malloc((last - first + 1) * sizeof(uint32_t));
+    int m = 0;
+    char copy[BLOCK_SIZE];
+    for (int k = 0; k < n; k++)
+    {
+        int from = ext[k].logical > first ? ext[k].logical : first;
+        int to = ext[k].logical + ext[k].length - 1 < last ? ext[k].logical + ext[k].length - 1 : last;
+        for (int l = from; l <= to; l++)
+        {
+            off_t begin = (off_t)l * BLOCK_SIZE;
+            blocks[m] = ext[k].start + (l - ext[k].logical);
+            if (buf != NULL && begin >= offset && begin + BLOCK_SIZE <= offset + (off_t)size)
+            {
+                sums[m] = block_sum(buf + (begin - offset));
+            }
+            else
+            {
+                // A block that can not be read back is left without a checksum
+                sums[m] = bcache_read(copy, BLOCK_SIZE, block_offset(blocks[m])) < 0 ? 0 : block_sum(copy);
+            }
+            m++;
+        }
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    for (int k = 0; k < m; k++)
+    {
+        set_sum(blocks[k], sums[k]);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    free(blocks);
+    free(sums);
+}
+
+// Transfer the bytes [offset, offset + size) of a file between buf and the image,
+// one positioned I/O per extent covering the range, submitted together
+// Reading a hole fills zeros, writing expects the range to be fully mapped; what is
+// read is verified against the checksums, the caller of a write calls update_sums
+// Return 0, or -EIO
+static int transfer_extents(const extent_t *ext, int n, char *buf, size_t size, off_t offset, int write)
 {
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    off_t end = offset + size;
+    off_t pos = offset;
+    disk_req_t reqs[DISK_IOV_MAX];
+    int at[DISK_IOV_MAX]; // The extent of each request
+    int nreqs = 0;
+    storage_checksum_stats_t stats = {0};
+    int rv = 0;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    for (int k = 0; k <= n && rv == 0; k++)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        off_t ext_begin = k < n ? (off_t)ext[k].logical * BLOCK_SIZE : end;
+        off_t ext_end = k < n ? ext_begin + (off_t)ext[k].length * BLOCK_SIZE : end;
+        if (ext_end <= pos && k < n)
         {
-            inodes[i].mode = mode;
-            write_inodes_to_disk();
-            return 0;
+            continue;
+        }
+        int last = k == n || ext_begin >= end;
+        if (!last)
+        {
+            off_t from = ext_begin > pos ? ext_begin : pos;
+            off_t to = ext_end < end ? ext_end : end;
+            if (from > pos && !write)
+            {
+                memset(buf + (pos - offset), 0, from - pos);
+            }
+            off_t disk_pos = block_offset(ext[k].start) + (from - ext_begin);
+            reqs[nreqs] = (disk_req_t){buf + (from - offset), to - from, disk_pos, write};
+            at[nreqs++] = k;
+            pos = to;
+        }
+
+        if (nreqs == DISK_IOV_MAX || (last && nreqs > 0))
+        {
+            rv = bcache_submit(reqs, nreqs);
+            for (int r = 0; r < nreqs && rv == 0 && !write; r++)
+            {
+                off_t from = (char *)reqs[r].buf - buf + offset;
+                rv = verify_blocks(&ext[at[r]], buf, offset, from, from + reqs[r].size, &stats);
+            }
+            nreqs = 0;
         }
+        if (last)
+        {
+            break;
+        }
+    }
+    if (rv == 0 && pos < end && !write)
+    {
+        memset(buf + (pos - offset), 0, end - pos);
     }
-    return -ENOENT;
+
+    if (stats.verified > 0)
+    {
+        pthread_mutex_lock(&meta_lock);
+        checksum_stats.verified += stats.verified;
+        checksum_stats.mismatches += stats.mismatches;
+        checksum_stats.verify_ns += stats.verify_ns;
+        pthread_mutex_unlock(&meta_lock);
+    }
+    return rv < 0 ? -EIO : 0;
 }
 
-int storage_unlink(const char *path)
+// Overwrite the bytes [from, to) of logical block lblk with zeros, if it is mapped
+static int zero_block_range(const extent_t *ext, int n, int lblk, int from, int to)
+{
+    int block = map_block(ext, n, lblk);
+    if (block < 0 || from >= to)
+    {
+        return 0;
+    }
+
+    char zeros[BLOCK_SIZE];
+    memset(zeros, 0, to - from);
+    if (bcache_write(zeros, to - from, block_offset(block) + from) < 0)
+    {
+        return -EIO;
+    }
+    update_sums(ext, n, NULL, to - from, (off_t)lblk * BLOCK_SIZE + from);
+    return 0;
+}
+
+// Fill the bytes [from, to) of logical block lblk, just mapped to a fresh block, with
+// what the block it replaced held (found in the list cut), or zeros if it was a hole
+static int init_block_range(const extent_t *ext, int n, int lblk, int from, int to, const extent_t *cut, int ncut)
+{
+    int old = map_block(cut, ncut, lblk);
+    if (old < 0)
+    {
+        return zero_block_range(ext, n, lblk, from, to);
+    }
+
+    char data[BLOCK_SIZE];
+    if (bcache_read(data, to - from, block_offset(old) + from) < 0 ||
+        bcache_write(data, to - from, block_offset(map_block(ext, n, lblk)) + from) < 0)
+    {
+        return -EIO;
+    }
+    update_sums(ext, n, NULL, to - from, (off_t)lblk * BLOCK_SIZE + from);
+    return 0;
+}
+
+// Give logical block lblk a private copy if its disk block is shared with other files,
+// so it can be changed in place
+// The block replaced goes to *old and the copy to *copy, both -1 if nothing changed:
+// the caller frees *old once the new list is stored, or gives *copy back if it is not
+// Return the new count, or -ENOSPC / -EFBIG / -EIO
+static int unshare_block(extent_t *ext, int n, int lblk, int *old, int *copy)
 {
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    extent_t cut[EXTENT_SCRATCH];
+    int ncut = 0;
+    *old = -1;
+    *copy = -1;
+    int m = cut_extents(ext, n, lblk, lblk + 1, 1, cut, &ncut);
+    if (m < 0 || ncut == 0)
+    {
+        return m;
+    }
 
-    for (int i = 0; i < MAX_FILES; i++)
+    extent_t fresh;
+    int nfresh;
+    m = fill_extents(ext, m, lblk, lblk + 1, &fresh, &nfresh);
+    if (m >= 0 && init_block_range(ext, m, lblk, 0, BLOCK_SIZE, cut, ncut) < 0)
+    {
+        m = -EIO;
+    }
+    if (m < 0)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        if (nfresh > 0)
         {
-            inodes[i].is_used = 0;
-            return 0;
+            unallocate_run(fresh.start, 1);
         }
+        return m;
     }
-    return -ENOENT;
+    *old = cut[0].start;
+    *copy = fresh.start;
+    return m;
 }
 
-int storage_truncate(const char *path, off_t size)
+#define ZERO_CHUNK_BLOCKS 64 // Blocks zero_run writes with one call
+
+// Fill the blocks [start, start + len) with zeros on the image, and give them the
+// checksum of a zero block
+// Only for a run allocate_run just handed out: freed blocks leave the cache before
+// they can be allocated again, so no frame holds a stale copy to bypass
+static int zero_run(int start, int len)
+{
+    static const char zeros[ZERO_CHUNK_BLOCKS * BLOCK_SIZE];
+    uint32_t sum = block_sum(zeros);
+    while (len > 0)
+    {
+        int chunk = len < ZERO_CHUNK_BLOCKS ? len : ZERO_CHUNK_BLOCKS;
+        if (disk_write(zeros, (size_t)chunk * BLOCK_SIZE, block_offset(start)) < 0)
+        {
+            return -EIO;
+        }
+        pthread_mutex_lock(&alloc_lock);
+        for (int k = 0; k < chunk; k++)
+        {
+            set_sum(start + k, sum);
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        start += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Directories, all of them held in memory from mount on
+// An entry sits in its directory's slot array, at the slot it has on disk, and in
+// one hash over every directory keyed on (directory, name), so resolving a path
+// costs one probe per component
+typedef struct
+{
+    int dir;       // Directory holding the entry
+    int ino;       // Inode it names
+    int slot;      // Slot in the directory's data
+    unsigned hash;
+    char name[];
+} dentry_t;
+
+typedef struct
+{
+    int nslots;       // Slots in the directory's data, used or free
+    int cap;          // Room in slots and holes
+    dentry_t **slots; // The entry in each slot, NULL for a free one
+    int *holes;       // The free slots, refilled before the directory grows
+    int nholes;
+} dir_t;
+
+static dir_t **dirs = NULL; // Per inode, the directory it holds, or NULL for anything else
+
+// Number of entries in directory d
+static int dir_entries(const dir_t *d)
+{
+    return d->nslots - d->nholes;
+}
+
+// Open addressing with linear probing over entry pointers,
+// NULL means empty, and DCACHE_TOMBSTONE marks a removed entry
+static dentry_t dcache_tombstone;
+#define DCACHE_TOMBSTONE (&dcache_tombstone)
+
+static dentry_t **dcache_slots = NULL;
+static unsigned dcache_capacity = 0;  // Always a power of two
+static unsigned dcache_count = 0;     // Live entries
+static unsigned dcache_tombstones = 0;
+
+// FNV-1a over the directory's inode number, then the len bytes of name
+static unsigned dcache_hash(int dir, const char *name, size_t len)
 {
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    unsigned h = 2166136261u;
+    for (int k = 0; k < 4; k++)
+    {
+        h = (h ^ ((unsigned)dir >> (k * 8) & 0xff)) * 16777619u;
+    }
+    for (size_t k = 0; k < len; k++)
+    {
+        h = (h ^ (unsigned char)name[k]) * 16777619u;
+    }
+    return h;
+}
 
-    for (int i = 0; i < MAX_FILES; i++)
+// Place entry e into the slot table, without any resizing
+static void dcache_place(dentry_t *e)
+{
+    unsigned mask = dcache_capacity - 1;
+    for (unsigned pos = e->hash & mask;; pos = (pos + 1) & mask)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        if (dcache_slots[pos] == NULL || dcache_slots[pos] == DCACHE_TOMBSTONE)
         {
-            if (S_ISDIR(inodes[i].mode))
-            {
-                return -EISDIR;
-            }
-            if (size > BLOCK_SIZE)
-            {
-                return -EFBIG;
-            }
-            inodes[i].size = size;
-            if (size == 0)
+            if (dcache_slots[pos] == DCACHE_TOMBSTONE)
             {
-                free_block(inodes[i].block);
-                inodes[i].block = 0;
+                dcache_tombstones--;
             }
-            write_inodes_to_disk();
-            return 0;
+            dcache_slots[pos] = e;
+            dcache_count++;
+            return;
         }
     }
-    return -ENOENT;
 }
 
-// Check if the given path exists, if so, return the inode index of that path
-// If not, return -1
-int storage_lookup(const char *path)
+// Reallocate the slot table with the given capacity, and re-insert every live entry
+static void dcache_resize(unsigned capacity)
 {
+    dentry_t **old_slots = dcache_slots;
+    unsigned old_capacity = dcache_capacity;
 
-    printf("BreakPoint#457\n");
+    dcache_slots = calloc(capacity, sizeof(dentry_t *));
+    dcache_capacity = capacity;
+    dcache_count = 0;
+    dcache_tombstones = 0;
 
-    char parent_name[MAX_NAME];
-    char fname[MAX_NAME];
-    get_parent_and_name(path, parent_name, fname);
+    for (unsigned pos = 0; pos < old_capacity; pos++)
+    {
+        if (old_slots[pos] != NULL && old_slots[pos] != DCACHE_TOMBSTONE)
+        {
+            dcache_place(old_slots[pos]);
+        }
+    }
+    free(old_slots);
+}
 
-    for (int i = 0; i < MAX_FILES; i++)
+static void dcache_insert(dentry_t *e)
+{
+    // Keep the load (including tombstones) under 3/4, grow only if live entries need it
+    if ((dcache_count + dcache_tombstones + 1) * 4 > dcache_capacity * 3)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].name, fname) == 0 && strcmp(inodes[i].parent, parent_name) == 0)
+        unsigned capacity = dcache_capacity ? dcache_capacity : 256;
+        while ((dcache_count + 1) * 2 > capacity)
         {
-            return i;
+            capacity *= 2;
         }
+        dcache_resize(capacity);
     }
+    dcache_place(e);
+}
 
-    return -1;
+// Find the entry named by the len bytes of name in directory dir, or NULL
+static dentry_t *dcache_find(int dir, const char *name, size_t len)
+{
+    if (dcache_capacity == 0)
+    {
+        return NULL;
+    }
+    unsigned h = dcache_hash(dir, name, len);
+    unsigned mask = dcache_capacity - 1;
+    for (unsigned pos = h & mask; dcache_slots[pos] != NULL; pos = (pos + 1) & mask)
+    {
+        dentry_t *e = dcache_slots[pos];
+        if (e != DCACHE_TOMBSTONE && e->hash == h && e->dir == dir &&
+            strncmp(e->name, name, len) == 0 && e->name[len] == '\0')
+        {
+            return e;
+        }
+    }
+    return NULL;
 }
 
-// Takes a path, and add name of every file within it to the buffer
-void storage_list(const char *path, void *buf, fuse_fill_dir_t filler)
+static void dcache_remove(dentry_t *e)
 {
+    unsigned mask = dcache_capacity - 1;
+    for (unsigned pos = e->hash & mask; dcache_slots[pos] != NULL; pos = (pos + 1) & mask)
+    {
+        if (dcache_slots[pos] == e)
+        {
+            dcache_slots[pos] = DCACHE_TOMBSTONE;
+            dcache_count--;
+            dcache_tombstones++;
+            return;
+        }
+    }
+}
 
-    // printf("BreakPoint#458\n");
+static dentry_t *dentry_new(int dir, int ino, int slot, const char *name)
+{
+    size_t len = strlen(name);
+    dentry_t *e = malloc(sizeof(dentry_t) + len + 1);
+    e->dir = dir;
+    e->ino = ino;
+    e->slot = slot;
+    e->hash = dcache_hash(dir, name, len);
+    memcpy(e->name, name, len + 1);
+    return e;
+}
 
-    char to_find_parent_name[MAX_NAME];
+// Make room for nslots slots in d
+static void dir_reserve(dir_t *d, int nslots)
+{
+    if (nslots <= d->cap)
+    {
+        return;
+    }
+    int cap = d->cap ? d->cap : DIRENTS_PER_BLOCK;
+    while (cap < nslots)
+    {
+        cap *= 2;
+    }
+    d->slots = realloc(d->slots, cap * sizeof(dentry_t *));
+    d->holes = realloc(d->holes, cap * sizeof(int));
+    d->cap = cap;
+}
 
-    if (strcmp(path, "/") == 0)
+// Free directory d and every entry still in it, the entries must already be out of the hash
+static void dir_free(dir_t *d)
+{
+    if (d == NULL)
     {
-        // printf("BreakPoint#6700 \n");
-        to_find_parent_name[0] = '~';
-        to_find_parent_name[1] = '\0';
+        return;
     }
-    else
+    for (int k = 0; k < d->nslots; k++)
     {
-        strcpy(to_find_parent_name, path);
+        free(d->slots[k]);
+    }
+    free(d->slots);
+    free(d->holes);
+    free(d);
+}
+
+#define DIR_GROW_MAX 64 // Most blocks a directory grows by at once
+
+// Map logical block lblk of directory dir, unless an earlier growth already did
+// A directory grows by as many blocks as it has (up to DIR_GROW_MAX), so a big
+// one stays in few extents even while files are written in between; when the
+// disk is too full for that, by one block
+// Return 0, or -ENOSPC / -EFBIG / -EIO
+static int grow_dir(int dir, int lblk)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    extent_t fresh[DIR_GROW_MAX];
+    int n = load_extents(dir, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+    if (map_block(ext, n, lblk) >= 0)
+    {
+        return 0;
     }
-    // printf("Listing: path: %s\n", path);
-    printf("Target Pname: %s\n", to_find_parent_name);
 
-    char self_parent_name[MAX_NAME];
-    char self_name[MAX_NAME];
-    get_parent_and_name(path, self_parent_name, self_name);
+    int grow = lblk < 1 ? 1 : lblk > DIR_GROW_MAX ? DIR_GROW_MAX : lblk;
+    int rv;
+    for (;; grow = 1)
+    {
+        extent_t grown[EXTENT_SCRATCH];
+        int nfresh = 0;
+        memcpy(grown, ext, n * sizeof(extent_t));
+        rv = fill_extents(grown, n, lblk, lblk + grow, fresh, &nfresh);
+        if (rv >= 0)
+        {
+            rv = store_extents(dir, grown, rv);
+        }
+        if (rv == 0)
+        {
+            return 0;
+        }
+        for (int k = 0; k < nfresh; k++)
+        {
+            unallocate_run(fresh[k].start, fresh[k].length);
+        }
+        if (rv != -ENOSPC || grow == 1)
+        {
+            return rv;
+        }
+    }
+}
 
-    for (int i = 0; i < MAX_FILES; i++)
+// Add the entry (name, ino) to directory dir, in a free slot, or in a new one at the end
+// Called with ns_lock and the directory's inode lock held exclusive
+// Return 0, or the errors of grow_dir
+static int dir_add_entry(int dir, const char *name, int ino)
+{
+    dir_t *d = dirs[dir];
+    int slot;
+    if (d->nholes > 0)
+    {
+        slot = d->holes[--d->nholes];
+    }
+    else
     {
-        if (inodes[i].is_used)
+        slot = d->nslots;
+        if (slot % DIRENTS_PER_BLOCK == 0)
         {
-            printf("Found pname: %s\n", inodes[i].parent);
-            if (strcmp(inodes[i].name, self_name) == 0 && strcmp(inodes[i].parent, self_parent_name) == 0)
+            int rv = grow_dir(dir, slot / DIRENTS_PER_BLOCK);
+            if (rv < 0)
             {
-                if (S_ISREG(inodes[i].mode))
-                {
-                    printf("Can not list a regular file \n");
-                    return;
-                }
+                return rv;
             }
         }
+        dir_reserve(d, slot + 1);
+        d->nslots++;
+        inode_at(dir)->size = (int64_t)d->nslots * DIRENT_SIZE;
+        mark_inode_dirty(dir);
+    }
+
+    dentry_t *e = dentry_new(dir, ino, slot, name);
+    d->slots[slot] = e;
+    dcache_insert(e);
+    mark_slot_dirty(dir, slot);
+    return 0;
+}
+
+// Remove entry e from its directory and free it, its slot becomes free
+// Called with ns_lock and the directory's inode lock held exclusive
+static void dir_remove_entry(dentry_t *e)
+{
+    dir_t *d = dirs[e->dir];
+    d->slots[e->slot] = NULL;
+    d->holes[d->nholes++] = e->slot;
+    dcache_remove(e);
+    mark_slot_dirty(e->dir, e->slot);
+    free(e);
+}
+
+// The slot of directory d as it is stored on disk
+static void render_dirent(const dir_t *d, int slot, dirent_t *out)
+{
+    memset(out, 0, sizeof(dirent_t));
+    dentry_t *e = slot < d->nslots ? d->slots[slot] : NULL;
+    if (e != NULL)
+    {
+        out->ino = e->ino;
+        snprintf(out->name, sizeof(out->name), "%s", e->name);
+    }
+}
+
+// Walk the first len bytes of path one component at a time from the root
+// Return the inode they name, or -ENOENT / -ENOTDIR / -ENAMETOOLONG
+// Called with ns_lock held
+static int resolve(const char *path, size_t len)
+{
+    const char *end = path + len;
+    int ino = ROOT_INO;
+    for (const char *p = path;;)
+    {
+        while (p < end && *p == '/')
+        {
+            p++;
+        }
+        if (p == end)
+        {
+            return ino;
+        }
+
+        const char *next = p;
+        while (next < end && *next != '/')
+        {
+            next++;
+        }
+        if (dirs[ino] == NULL)
+        {
+            return -ENOTDIR;
+        }
+        if (next - p > MAX_NAME_LEN)
+        {
+            return -ENAMETOOLONG;
+        }
+        dentry_t *e = dcache_find(ino, p, next - p);
+        if (e == NULL)
+        {
+            return -ENOENT;
+        }
+        ino = e->ino;
+        p = next;
+    }
+}
+
+// Takes a path, and return the inode index of it, or -errno if it can not be resolved
+static int find_inode(const char *path)
+{
+    return resolve(path, strlen(path));
+}
+
+// Resolve all of path but its last component: store the directory in *dir,
+// and the last component in name, which holds MAX_NAME bytes
+// Return 0, -EBUSY for the root itself, or the errors of resolve
+// Called with ns_lock held
+static int resolve_parent(const char *path, int *dir, char *name)
+{
+    const char *end = path + strlen(path);
+    while (end > path && end[-1] == '/')
+    {
+        end--;
+    }
+    const char *last = end;
+    while (last > path && last[-1] != '/')
+    {
+        last--;
+    }
+    if (last == end)
+    {
+        return -EBUSY;
+    }
+    if (end - last > MAX_NAME_LEN)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int ino = resolve(path, last - path);
+    if (ino < 0)
+    {
+        return ino;
+    }
+    if (dirs[ino] == NULL)
+    {
+        return -ENOTDIR;
     }
+    memcpy(name, last, end - last);
+    name[end - last] = '\0';
+    *dir = ino;
+    return 0;
+}
+
+// Read every directory into memory, once the journal is replayed
+// Return 0, or -EIO
+static int load_dirs()
+{
+    char *block = malloc(BLOCK_SIZE);
+    extent_t ext[EXTENT_SCRATCH];
+    int rv = 0;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    for (int i = ROOT_INO; i < sb.inode_count && rv == 0; i++)
     {
-        // printf("BreakPoint#330 \n");
-        if (inodes[i].is_used)
+        if (!S_ISDIR(inode_at(i)->mode))
+        {
+            continue;
+        }
+        dir_t *d = dirs[i] = calloc(1, sizeof(dir_t));
+        int nslots = inode_at(i)->size / DIRENT_SIZE;
+        int n = load_extents(i, ext);
+        if (n < 0)
+        {
+            rv = n;
+            break;
+        }
+        dir_reserve(d, nslots);
+
+        for (int slot = 0; slot < nslots; slot++)
         {
-            // printf("BreakPoint#9980 Current Iterating inode parent: %s, to_find_parent_name: %s\n", inodes[i].parent, to_find_parent_name);
-            if (strcmp(inodes[i].parent, to_find_parent_name) == 0)
+            if (slot % DIRENTS_PER_BLOCK == 0)
             {
-                if (filler(buf, inodes[i].name, NULL, 0) != 0)
+                int b = map_block(ext, n, slot / DIRENTS_PER_BLOCK);
+                memset(block, 0, BLOCK_SIZE);
+                if (b >= 0 && disk_read(block, BLOCK_SIZE, block_offset(b)) < 0)
                 {
-                    printf("BreakPoint#3780 \n");
-                    return;
+                    rv = -EIO;
+                    break;
                 }
-                printf("%s ", inodes[i].name);
             }
+            dirent_t *de = (dirent_t *)(block + (slot % DIRENTS_PER_BLOCK) * DIRENT_SIZE);
+            de->name[sizeof(de->name) - 1] = '\0';
+            d->nslots++;
+            if (de->ino == 0 || de->ino >= (uint32_t)sb.inode_count)
+            {
+                d->slots[slot] = NULL;
+                d->holes[d->nholes++] = slot;
+                continue;
+            }
+            d->slots[slot] = dentry_new(i, de->ino, slot, de->name);
+            dcache_insert(d->slots[slot]);
         }
     }
+    free(block);
+    return rv;
 }
 
-// Takes a path of a firectory, and check if that dir is empty
-// If not, return 0, if so, return 1
-int storage_is_dir_empty(const char *path)
+// Append the n runs of from to the in-flight frees, with alloc_lock held
+static void add_inflight_frees(const run_t *from, int n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    inflight_frees = realloc(inflight_frees, (ninflight_frees + n) * sizeof(run_t));
+    memcpy(inflight_frees + ninflight_frees, from, n * sizeof(run_t));
+    ninflight_frees += n;
+}
+
+// Move the frees of the operations so far to the commit in progress,
+// and the blocks of removed directories too if it is a checkpoint
+// Called with txn_lock held exclusive
+static void take_pending_frees(int checkpoint)
+{
+    pthread_mutex_lock(&alloc_lock);
+    add_inflight_frees(pending_frees, npending_frees);
+    npending_frees = 0;
+    if (checkpoint)
+    {
+        add_inflight_frees(pending_dir_frees, npending_dir_frees);
+        npending_dir_frees = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Copy the superblock as it will be once the in-flight frees are applied
+// Called with alloc_lock held
+static void copy_committed_sb(superblock_t *copy)
 {
+    *copy = sb;
+    for (int k = 0; k < ninflight_frees; k++)
+    {
+        copy->free_blocks += inflight_frees[k].len;
+    }
+}
+
+// Copy the bitmap bytes [lo, hi) into out as they will be once the in-flight frees are applied
+// Called with alloc_lock held
+static void copy_committed_bitmap(char *out, int lo, int hi)
+{
+    memcpy(out, (char *)block_bitmap + lo, hi - lo);
+    for (int k = 0; k < ninflight_frees; k++)
+    {
+        int from = inflight_frees[k].start > lo * 8 ? inflight_frees[k].start : lo * 8;
+        int to = inflight_frees[k].start + inflight_frees[k].len;
+        to = to < hi * 8 ? to : hi * 8;
+        for (int b = from; b < to; b++)
+        {
+            out[b / 8 - lo] &= ~(1 << (b % 8));
+        }
+    }
+}
+
+// Forget which entries of a table the next commit has to log, with meta_lock held
+static void clear_jentries(entry_log_t *log)
+{
+    for (int k = 0; k < log->njlist; k++)
+    {
+        log->jdirty[log->jlist[k]] = 0;
+    }
+    log->njlist = 0;
+}
+
+// Log the bitmap bytes [lo, hi), with alloc_lock held
+static void log_bitmap_range(char **buf, size_t *len, size_t *cap, int lo, int hi)
+{
+    char *bytes = malloc(hi - lo);
+    copy_committed_bitmap(bytes, lo, hi);
+    journal_record(buf, len, cap, JREC_BITMAP, lo, bytes, hi - lo);
+    free(bytes);
+}
+
+// Payload of a JREC_DIRENT record
+typedef struct
+{
+    uint32_t offset; // Byte offset of the slot in its block
+    dirent_t dirent;
+} dirent_rec_t;
 
-    printf("BreakPoint#CKDIREMTCD\n");
+static int compare_slot_ref(const void *a, const void *b)
+{
+    const slot_ref_t *x = a;
+    const slot_ref_t *y = b;
+    return x->dir != y->dir ? (x->dir > y->dir) - (x->dir < y->dir) : (x->slot > y->slot) - (x->slot < y->slot);
+}
 
-    char pname[MAX_NAME];
+// Sort a list of slots and drop the repeats, return the new count
+static int unique_slot_refs(slot_ref_t *refs, int n)
+{
+    if (n == 0)
+    {
+        return 0;
+    }
+    qsort(refs, n, sizeof(slot_ref_t), compare_slot_ref);
+    int m = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (m == 0 || compare_slot_ref(&refs[m - 1], &refs[k]) != 0)
+        {
+            refs[m++] = refs[k];
+        }
+    }
+    return m;
+}
 
-    strcpy(pname, path);
+// Log the current contents of the slots in jdirty_slots, one record each
+// Slots of directories removed since, or past their end, are skipped
+// Called with txn_lock held exclusive and meta_lock held
+static void log_dirents(char **buf, size_t *len, size_t *cap)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int n = 0;
+    int loaded = -1;
 
-    for (int i = 0; i < MAX_FILES; i++)
+    int count = unique_slot_refs(jdirty_slots.refs, jdirty_slots.n);
+    for (int k = 0; k < count; k++)
     {
-        if (inodes[i].is_used && strcmp(inodes[i].parent, pname) == 0)
+        slot_ref_t ref = jdirty_slots.refs[k];
+        dir_t *d = dirs[ref.dir];
+        if (d == NULL || ref.slot >= d->nslots)
         {
-            printf("BreakPoint#NORM\n");
-            return 0;
+            continue;
+        }
+        if (loaded != ref.dir)
+        {
+            n = load_extents(ref.dir, ext);
+            loaded = ref.dir;
+        }
+        int block = map_block(ext, n, ref.slot / DIRENTS_PER_BLOCK);
+        if (block < 0)
+        {
+            continue;
+        }
+
+        dirent_rec_t rec;
+        rec.offset = (ref.slot % DIRENTS_PER_BLOCK) * DIRENT_SIZE;
+        render_dirent(d, ref.slot, &rec.dirent);
+        journal_record(buf, len, cap, JREC_DIRENT, block, &rec, sizeof(rec));
+    }
+    jdirty_slots.n = 0;
+}
+
+// Render every directory block holding one of the n slots in refs, into out (BLOCK_SIZE
+// each, n of them at most), and store their block numbers in blocks
+// Return the number of blocks rendered
+// Called with txn_lock held exclusive
+static int render_dir_blocks(slot_ref_t *refs, int n, int *blocks, char *out)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int next = 0;
+    int loaded = -1;
+    int last_dir = -1;
+    int last_lblk = -1;
+    int m = 0;
+
+    int count = unique_slot_refs(refs, n);
+    for (int k = 0; k < count; k++)
+    {
+        dir_t *d = dirs[refs[k].dir];
+        int lblk = refs[k].slot / DIRENTS_PER_BLOCK;
+        if (d == NULL || refs[k].slot >= d->nslots || (refs[k].dir == last_dir && lblk == last_lblk))
+        {
+            continue;
+        }
+        last_dir = refs[k].dir;
+        last_lblk = lblk;
+        if (loaded != refs[k].dir)
+        {
+            next = load_extents(refs[k].dir, ext);
+            loaded = refs[k].dir;
+        }
+        int block = map_block(ext, next, lblk);
+        if (block < 0)
+        {
+            continue;
+        }
+
+        for (int slot = 0; slot < DIRENTS_PER_BLOCK; slot++)
+        {
+            render_dirent(d, lblk * DIRENTS_PER_BLOCK + slot, (dirent_t *)(out + (size_t)m * BLOCK_SIZE + slot * DIRENT_SIZE));
+        }
+        blocks[m++] = block;
+    }
+    return m;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Log the entries of table changed since the last commit as records of type, one per
+// run of neighbours, with alloc_lock and meta_lock held
+static void log_entries(entry_log_t *log, const void *table, int type, char **buf, size_t *len, size_t *cap)
+{
+    qsort(log->jlist, log->njlist, sizeof(int), compare_int);
+    for (int k = 0; k < log->njlist;)
+    {
+        int run = 1;
+        while (k + run < log->njlist && log->jlist[k + run] == log->jlist[k] + run)
+        {
+            run++;
+        }
+        journal_record(buf, len, cap, type, log->jlist[k], (const char *)table + (size_t)log->jlist[k] * log->entry_size,
+                       run * log->entry_size);
+        k += run;
+    }
+    clear_jentries(log);
+}
+
+// Journal callback: log every change since the last commit as one transaction
+static int journal_collect(char **buf, size_t *len)
+{
+    size_t cap = 0;
+    *buf = NULL;
+    *len = 0;
+
+    pthread_rwlock_wrlock(&txn_lock);
+    take_pending_frees(0);
+
+    pthread_mutex_lock(&alloc_lock);
+    pthread_mutex_lock(&meta_lock);
+    if (jsb_dirty || ninflight_frees > 0)
+    {
+        superblock_t copy;
+        copy_committed_sb(&copy);
+        journal_record(buf, len, &cap, JREC_SUPER, 0, &copy, sizeof(copy));
+    }
+    if (jbitmap_lo < jbitmap_hi)
+    {
+        log_bitmap_range(buf, len, &cap, jbitmap_lo, jbitmap_hi);
+    }
+    for (int k = 0; k < ninflight_frees; k++)
+    {
+        int lo = inflight_frees[k].start / 8;
+        int hi = (inflight_frees[k].start + inflight_frees[k].len - 1) / 8 + 1;
+        log_bitmap_range(buf, len, &cap, lo, hi);
+    }
+    if (jshares_lo < jshares_hi)
+    {
+        journal_record(buf, len, &cap, JREC_SHARES, jshares_lo, (char *)block_shares + jshares_lo, jshares_hi - jshares_lo);
+    }
+    log_entries(&hash_log, block_hashes, JREC_HASHES, buf, len, &cap);
+    log_entries(&length_log, block_lengths, JREC_LENGTHS, buf, len, &cap);
+    log_entries(&sum_log, block_sums, JREC_SUMS, buf, len, &cap);
+    for (int k = 0; k < njinode; k++)
+    {
+        int i = jinode_list[k];
+        journal_record(buf, len, &cap, JREC_INODE, i, inode_at(i), sb.inode_size);
+        jinode_dirty[i] = 0;
+    }
+    log_dirents(buf, len, &cap);
+    njinode = 0;
+    jsb_dirty = 0;
+    jbitmap_lo = INT_MAX;
+    jbitmap_hi = 0;
+    jshares_lo = INT_MAX;
+    jshares_hi = 0;
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_unlock(&alloc_lock);
+
+    int data = __atomic_exchange_n(&data_unsynced, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&txn_lock);
+
+    // Data first: the blocks these records point at reach the image before the records do,
+    // and the sync of the log covers them; data overwritten in place with nothing to log
+    // is synced on its own
+    int rv = bcache_flush();
+    if (rv == 0 && *len == 0 && data)
+    {
+        rv = disk_sync();
+    }
+    return rv;
+}
+
+
+// Copy the n dirty blocks listed in dirty of a table kept in memory (the inode, hash,
+// length or checksum table) for a checkpoint, clearing their flags: their numbers go to blocks in order,
+// so neighbours go out in one write, and their contents to the buffer returned
+static char *take_dirty_blocks(const char *table, char *flags, const int *dirty, int n, int *blocks)
+{
+    memcpy(blocks, dirty, n * sizeof(int));
+    qsort(blocks, n, sizeof(int), compare_int);
+    char *copy = malloc((size_t)n * BLOCK_SIZE + 1);
+    for (int k = 0; k < n; k++)
+    {
+        memcpy(copy + (size_t)k * BLOCK_SIZE, table + (size_t)blocks[k] * BLOCK_SIZE, BLOCK_SIZE);
+        flags[blocks[k]] = 0;
+    }
+    return copy;
+}
+
+// Writes a checkpoint puts together, to go to the image as one batch
+typedef struct
+{
+    disk_req_t *reqs;
+    int n;
+    int cap;
+    long bytes;
+} home_writes_t;
+
+static void add_home_write(home_writes_t *w, const void *buf, size_t size, off_t offset)
+{
+    if (w->n == w->cap)
+    {
+        w->cap = w->cap > 0 ? w->cap * 2 : 64;
+        w->reqs = realloc(w->reqs, w->cap * sizeof(disk_req_t));
+    }
+    w->reqs[w->n++] = (disk_req_t){(void *)buf, size, offset, 1};
+    w->bytes += size;
+}
+
+// Add the writes of the blocks take_dirty_blocks copied home, to the table starting at block start
+static void add_dirty_blocks(home_writes_t *w, const char *copy, const int *blocks, int n, int start)
+{
+    for (int k = 0; k < n;)
+    {
+        int run = 1;
+        while (k + run < n && blocks[k + run] == blocks[k] + run)
+        {
+            run++;
+        }
+        add_home_write(w, copy + (size_t)k * BLOCK_SIZE, (size_t)run * BLOCK_SIZE, block_offset(start + blocks[k]));
+        k += run;
+    }
+}
+
+// Journal callback: write whatever part of the superblock, bitmap, share, hash, length and checksum tables,
+// inode table and directories changed since the last checkpoint to its home location, and sync it
+// The snapshot is taken with txn_lock exclusive, the writes happen after releasing it
+static int journal_checkpoint_home()
+{
+    pthread_rwlock_wrlock(&txn_lock);
+    take_pending_frees(1);
+
+    pthread_mutex_lock(&alloc_lock);
+    pthread_mutex_lock(&meta_lock);
+    superblock_t copy;
+    copy_committed_sb(&copy);
+    int write_sb = sb_dirty || ninflight_frees > 0;
+    int lo = bitmap_dirty_lo;
+    int hi = bitmap_dirty_hi;
+    for (int k = 0; k < ninflight_frees; k++)
+    {
+        widen_range(&lo, &hi, inflight_frees[k].start / 8, (inflight_frees[k].start + inflight_frees[k].len - 1) / 8 + 1);
+    }
+    char *bitmap = NULL;
+    if (lo < hi)
+    {
+        bitmap = malloc(hi - lo);
+        copy_committed_bitmap(bitmap, lo, hi);
+    }
+    int shares_lo = shares_dirty_lo;
+    int shares_hi = shares_dirty_hi;
+    char *shares = NULL;
+    if (shares_lo < shares_hi)
+    {
+        shares = malloc(shares_hi - shares_lo);
+        memcpy(shares, (char *)block_shares + shares_lo, shares_hi - shares_lo);
+    }
+    int nhash_blocks = hash_log.ndirty_blocks;
+    int *hash_blocks = malloc((nhash_blocks + 1) * sizeof(int));
+    char *hashes = take_dirty_blocks((char *)block_hashes, hash_log.block_dirty, hash_log.dirty_blocks, nhash_blocks, hash_blocks);
+    hash_log.ndirty_blocks = 0;
+    int nlength_blocks = length_log.ndirty_blocks;
+    int *length_blocks = malloc((nlength_blocks + 1) * sizeof(int));
+    char *lengths = take_dirty_blocks((char *)block_lengths, length_log.block_dirty, length_log.dirty_blocks, nlength_blocks,
+                                      length_blocks);
+    length_log.ndirty_blocks = 0;
+    int nsum_blocks = sum_log.ndirty_blocks;
+    int *sum_blocks = malloc((nsum_blocks + 1) * sizeof(int));
+    char *sums = take_dirty_blocks((char *)block_sums, sum_log.block_dirty, sum_log.dirty_blocks, nsum_blocks, sum_blocks);
+    sum_log.ndirty_blocks = 0;
+    pthread_mutex_unlock(&alloc_lock);
+
+    int nblocks = ndirty_inode_blocks;
+    int *blocks = malloc((nblocks + 1) * sizeof(int));
+    char *table = take_dirty_blocks(inode_table, inode_block_dirty, dirty_inode_blocks, nblocks, blocks);
+    ndirty_inode_blocks = 0;
+
+    int *dir_blocks = malloc((dirty_slots.n + 1) * sizeof(int));
+    char *dir_data = malloc((size_t)dirty_slots.n * BLOCK_SIZE + 1);
+    int ndir_blocks = render_dir_blocks(dirty_slots.refs, dirty_slots.n, dir_blocks, dir_data);
+    dirty_slots.n = 0;
+
+    // Everything pending for the journal is in this snapshot too
+    sb_dirty = 0;
+    bitmap_dirty_lo = INT_MAX;
+    bitmap_dirty_hi = 0;
+    shares_dirty_lo = INT_MAX;
+    shares_dirty_hi = 0;
+    jsb_dirty = 0;
+    jbitmap_lo = INT_MAX;
+    jbitmap_hi = 0;
+    jshares_lo = INT_MAX;
+    jshares_hi = 0;
+    clear_jentries(&hash_log);
+    clear_jentries(&length_log);
+    clear_jentries(&sum_log);
+    for (int k = 0; k < njinode; k++)
+    {
+        jinode_dirty[jinode_list[k]] = 0;
+    }
+    njinode = 0;
+    jdirty_slots.n = 0;
+    pthread_mutex_unlock(&meta_lock);
+    pthread_rwlock_unlock(&txn_lock);
+
+    // Everything goes out as one batch, deep enough to keep the device busy
+    home_writes_t w = {NULL, 0, 0, 0};
+    if (write_sb)
+    {
+        add_home_write(&w, &copy, sizeof(copy), SUPER_BLOCK_START * BLOCK_SIZE);
+    }
+    if (bitmap)
+    {
+        add_home_write(&w, bitmap, hi - lo, block_offset(sb.bitmap_start) + lo);
+    }
+    if (shares)
+    {
+        add_home_write(&w, shares, shares_hi - shares_lo, block_offset(sb.shares_start) + shares_lo);
+    }
+    add_dirty_blocks(&w, hashes, hash_blocks, nhash_blocks, sb.hashes_start);
+    add_dirty_blocks(&w, lengths, length_blocks, nlength_blocks, sb.lengths_start);
+    add_dirty_blocks(&w, sums, sum_blocks, nsum_blocks, sb.sums_start);
+    add_dirty_blocks(&w, table, blocks, nblocks, sb.inodes_start);
+    for (int k = 0; k < ndir_blocks; k++)
+    {
+        add_home_write(&w, dir_data + (size_t)k * BLOCK_SIZE, BLOCK_SIZE, block_offset(dir_blocks[k]));
+    }
+    int failed = disk_submit(w.reqs, w.n) < 0;
+    long bytes = w.bytes;
+    free(w.reqs);
+    free(bitmap);
+    free(shares);
+    free(hashes);
+    free(hash_blocks);
+    free(lengths);
+    free(length_blocks);
+    free(sums);
+    free(sum_blocks);
+    free(table);
+    free(blocks);
+    free(dir_data);
+    free(dir_blocks);
+    failed |= bcache_flush() < 0;
+
+    pthread_mutex_lock(&meta_lock);
+    meta_stats.flushes++;
+    meta_stats.bytes_written += bytes;
+    pthread_mutex_unlock(&meta_lock);
+
+    if (failed)
+    {
+        printf("Can not write disk image\n");
+        return -EIO;
+    }
+    return disk_sync();
+}
+
+// Journal callback: the frees collected so far are durable, hand the blocks back to the allocator
+static void journal_committed()
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (int k = 0; k < ninflight_frees; k++)
+    {
+        balloc_free(inflight_frees[k].start, inflight_frees[k].len);
+        sb.free_blocks += inflight_frees[k].len;
+        mark_bitmap_dirty(inflight_frees[k].start, inflight_frees[k].len, 0);
+        bcache_invalidate(inflight_frees[k].start, inflight_frees[k].len);
+    }
+    ninflight_frees = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Journal callback: replay one logged record into memory, on mount
+static void journal_apply(const jrecord_t *rec, const void *payload)
+{
+    switch (rec->type)
+    {
+    case JREC_SUPER:
+        if (rec->len == sizeof(superblock_t))
+        {
+            memcpy(&sb, payload, sizeof(superblock_t));
+        }
+        break;
+    case JREC_BITMAP:
+        if ((size_t)rec->target + rec->len <= (size_t)sb.bitmap_blocks * BLOCK_SIZE)
+        {
+            memcpy((char *)block_bitmap + rec->target, payload, rec->len);
+        }
+        break;
+    case JREC_SHARES:
+        if ((size_t)rec->target + rec->len <= (size_t)sb.share_blocks * BLOCK_SIZE)
+        {
+            memcpy((char *)block_shares + rec->target, payload, rec->len);
+        }
+        break;
+    case JREC_HASHES:
+        if (rec->len % sizeof(uint64_t) == 0 && (size_t)rec->target + rec->len / sizeof(uint64_t) <= (size_t)sb.total_blocks)
+        {
+            memcpy(&block_hashes[rec->target], payload, rec->len);
+        }
+        break;
+    case JREC_LENGTHS:
+        if (rec->len % sizeof(uint32_t) == 0 && (size_t)rec->target + rec->len / sizeof(uint32_t) <= (size_t)sb.total_blocks)
+        {
+            memcpy(&block_lengths[rec->target], payload, rec->len);
+        }
+        break;
+    case JREC_SUMS:
+        if (rec->len % sizeof(uint32_t) == 0 && (size_t)rec->target + rec->len / sizeof(uint32_t) <= (size_t)sb.total_blocks)
+        {
+            memcpy(&block_sums[rec->target], payload, rec->len);
+        }
+        break;
+    case JREC_INODE:
+        if (rec->target < (uint32_t)sb.inode_count && rec->len == (uint32_t)sb.inode_size)
+        {
+            memcpy(inode_at(rec->target), payload, sb.inode_size);
+        }
+        break;
+    case JREC_DIRENT:
+        // Directory blocks are not kept in memory yet, the slot goes straight home
+        if (rec->target >= (uint32_t)sb.data_start && rec->target < (uint32_t)sb.total_blocks &&
+            rec->len == sizeof(dirent_rec_t) &&
+            ((const dirent_rec_t *)payload)->offset <= BLOCK_SIZE - DIRENT_SIZE)
+        {
+            const dirent_rec_t *r = payload;
+            disk_write(&r->dirent, sizeof(dirent_t), block_offset(rec->target) + r->offset);
+        }
+        break;
+    }
+}
+
+static const journal_ops_t storage_journal_ops = {
+    journal_collect,
+    journal_checkpoint_home,
+    journal_committed,
+    journal_apply,
+};
+
+// Flag all n blocks of a table kept in memory as dirty, see take_dirty_blocks
+static void mark_table_dirty(char *flags, int *dirty, int *ndirty, int n)
+{
+    for (int b = 0; b < n; b++)
+    {
+        if (!flags[b])
+        {
+            flags[b] = 1;
+            dirty[(*ndirty)++] = b;
+        }
+    }
+}
+
+// Mark the whole superblock, bitmap, share, hash, length, checksum and inode tables as dirty, so the next checkpoint writes all of it
+static void mark_all_dirty()
+{
+    pthread_mutex_lock(&meta_lock);
+    sb_dirty = 1;
+    bitmap_dirty_lo = 0;
+    bitmap_dirty_hi = (sb.total_blocks + 7) / 8;
+    shares_dirty_lo = 0;
+    shares_dirty_hi = sb.total_blocks * (int)sizeof(uint16_t);
+    mark_table_dirty(hash_log.block_dirty, hash_log.dirty_blocks, &hash_log.ndirty_blocks, sb.hash_blocks);
+    mark_table_dirty(length_log.block_dirty, length_log.dirty_blocks, &length_log.ndirty_blocks, sb.length_blocks);
+    mark_table_dirty(sum_log.block_dirty, sum_log.dirty_blocks, &sum_log.ndirty_blocks, sb.sum_blocks);
+    mark_table_dirty(inode_block_dirty, dirty_inode_blocks, &ndirty_inode_blocks, sb.inode_blocks);
+    pthread_mutex_unlock(&meta_lock);
+}
+
+static int write_out_all(); // With the write path, further down
+
+// Make every change so far durable: write out the buffered writes, commit pending
+// metadata, and sync data that was overwritten in place without any metadata change
+int storage_fsync()
+{
+    pthread_mutex_lock(&meta_lock);
+    long operations = meta_stats.operations;
+    pthread_mutex_unlock(&meta_lock);
+
+    // Buffered writes count as operations as they are taken, so any taken after the
+    // count above are left for the next call to find
+    int rv = write_out_all();
+    if (rv == 0)
+    {
+        rv = journal_commit();
+    }
+    if (rv == 0)
+    {
+        rv = bcache_flush();
+    }
+    if (rv == 0)
+    {
+        rv = disk_sync();
+    }
+    if (rv == 0)
+    {
+        pthread_mutex_lock(&meta_lock);
+        synced_operations = operations > synced_operations ? operations : synced_operations;
+        pthread_mutex_unlock(&meta_lock);
+    }
+    return rv;
+}
+
+// storage_fsync, unless no operation changed anything since the last one
+static int sync_changes()
+{
+    pthread_mutex_lock(&meta_lock);
+    int changed = meta_stats.operations != synced_operations;
+    pthread_mutex_unlock(&meta_lock);
+
+    return changed ? storage_fsync() : 0;
+}
+
+// Called at the end of each operation that changed anything, after txn_end
+// With DURABILITY_SYNC, returns once the operation is durable: the journal commit
+// (shared with whoever else is waiting) syncs the data written before it too
+// Otherwise leaves it for the background flusher, or for the next fsync or close
+// Return 0, or -errno if the operation could not be made durable
+static int end_operation()
+{
+    pthread_mutex_lock(&meta_lock);
+    meta_stats.operations++;
+    pthread_mutex_unlock(&meta_lock);
+
+    if (storage_opts.durability == DURABILITY_SYNC ||
+        (storage_opts.durability == DURABILITY_PERIODIC && !flusher_running))
+    {
+        return journal_commit();
+    }
+    return 0;
+}
+
+// Background flusher of DURABILITY_PERIODIC, makes every change made in the
+// last writeback_ms durable at once: one journal commit and one sync for all of them
+static void *flusher_main(void *arg)
+{
+    int period = storage_opts.writeback_ms > 0 ? storage_opts.writeback_ms : DEFAULT_WRITEBACK_MS;
+    pthread_mutex_lock(&meta_lock);
+    while (flusher_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += period / 1000;
+        deadline.tv_nsec += (long)(period % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher_cond, &meta_lock, &deadline);
+
+        pthread_mutex_unlock(&meta_lock);
+        sync_changes();
+        pthread_mutex_lock(&meta_lock);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return NULL;
+}
+
+#define SCRUB_BATCH 32 // Blocks the scrub reads between two pauses
+
+// Sleep ns under meta_lock, or until the scrub is stopped
+static void scrub_pause(uint64_t ns)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec += ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (scrub_running)
+    {
+        pthread_cond_timedwait(&scrub_cond, &meta_lock, &deadline);
+    }
+}
+
+// The scrub read block b from the image and it did not match: read it again with no
+// operation running, once the cache wrote back whatever newer copy it held
+// Return whether the block really is damaged
+static int confirm_mismatch(int b)
+{
+    char data[BLOCK_SIZE];
+    pthread_rwlock_wrlock(&txn_lock);
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t sum = balloc_is_used(b) ? block_sums[b] : 0;
+    pthread_mutex_unlock(&alloc_lock);
+    int damaged = sum != 0 && bcache_flush() == 0 &&
+                  (disk_read(data, BLOCK_SIZE, block_offset(b)) < 0 || block_sum(data) != sum);
+    pthread_rwlock_unlock(&txn_lock);
+    return damaged;
+}
+
+// Background scrub: read every data block that has a checksum over and over, at no more
+// than scrub_kbps, so damage is found before a read runs into it
+// Reads go around the cache, which they would only flush out
+static void *scrub_main(void *arg)
+{
+    char *data = malloc((size_t)SCRUB_BATCH * BLOCK_SIZE);
+    uint64_t rate = (uint64_t)storage_opts.scrub_kbps * 1024; // Bytes per second
+    int b = sb.data_start;
+    long pass_bytes = 0;
+    pthread_mutex_lock(&meta_lock);
+    while (data != NULL && scrub_running)
+    {
+        pthread_mutex_unlock(&meta_lock);
+
+        int blocks[SCRUB_BATCH];
+        uint32_t sums[SCRUB_BATCH];
+        int n = 0;
+        pthread_mutex_lock(&alloc_lock);
+        for (; b < sb.total_blocks && n < SCRUB_BATCH; b++)
+        {
+            if (block_sums[b] != 0 && balloc_is_used(b))
+            {
+                blocks[n] = b;
+                sums[n++] = block_sums[b];
+            }
+        }
+        pthread_mutex_unlock(&alloc_lock);
+
+        long scrubbed = 0;
+        long mismatches = 0;
+        for (int k = 0; k < n; k++)
+        {
+            char *block = data + (size_t)k * BLOCK_SIZE;
+            if (disk_read(block, BLOCK_SIZE, block_offset(blocks[k])) < 0)
+            {
+                continue;
+            }
+            scrubbed++;
+            if (block_sum(block) != sums[k] && confirm_mismatch(blocks[k]))
+            {
+                printf("%s: block %d does not match its checksum\n", disk_filename, blocks[k]);
+                mismatches++;
+            }
+        }
+        pass_bytes += scrubbed * BLOCK_SIZE;
+
+        pthread_mutex_lock(&meta_lock);
+        checksum_stats.scrubbed += scrubbed;
+        checksum_stats.scrub_mismatches += mismatches;
+        uint64_t ns = (uint64_t)scrubbed * BLOCK_SIZE * 1000000000 / rate;
+        if (b >= sb.total_blocks)
+        {
+            // Start over, after a pause if there was nothing to read
+            checksum_stats.scrub_passes++;
+            b = sb.data_start;
+            ns = pass_bytes == 0 ? 1000000000 : ns;
+            pass_bytes = 0;
+        }
+        if (ns > 0)
+        {
+            scrub_pause(ns);
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    free(data);
+    return NULL;
+}
+
+#define ALLOC_RETRIES 3 // Commits forced by one operation that keeps running out of space
+
+// After an allocation failed: if blocks are waiting for a commit to be freed,
+// commit now and tell the caller to try once more
+// Called outside any transaction
+static int should_retry_alloc()
+{
+    pthread_mutex_lock(&alloc_lock);
+    int waiting = npending_frees + ninflight_frees;
+    pthread_mutex_unlock(&alloc_lock);
+
+    return waiting > 0 && journal_commit() == 0;
+}
+
+// Copy out the metadata write-back counters
+void storage_get_meta_stats(storage_meta_stats_t *stats)
+{
+    pthread_mutex_lock(&meta_lock);
+    *stats = meta_stats;
+    pthread_mutex_unlock(&meta_lock);
+    journal_get_stats(&stats->journal_commits, &stats->journal_bytes, &stats->checkpoints);
+}
+
+// Copy out what deduplication found and cost so far
+void storage_get_dedup_stats(storage_dedup_stats_t *stats)
+{
+    pthread_mutex_lock(&meta_lock);
+    *stats = dedup_stats;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Copy out what compression saved and cost so far
+void storage_get_compress_stats(storage_compress_stats_t *stats)
+{
+    pthread_mutex_lock(&meta_lock);
+    *stats = compress_stats;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Copy out what reads and the scrub checked against the checksums so far
+void storage_get_checksum_stats(storage_checksum_stats_t *stats)
+{
+    pthread_mutex_lock(&meta_lock);
+    *stats = checksum_stats;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// Copy out what the write buffers absorbed so far
+void storage_get_wbuf_stats(storage_wbuf_stats_t *stats)
+{
+    pthread_mutex_lock(&wbuf_lock);
+    *stats = wbuf_stats;
+    pthread_mutex_unlock(&wbuf_lock);
+}
+
+// Copy out what readahead did so far
+void storage_get_readahead_stats(storage_readahead_stats_t *stats)
+{
+    pthread_mutex_lock(&ra_lock);
+    *stats = ra_stats;
+    pthread_mutex_unlock(&ra_lock);
+}
+
+static void init_locks()
+{
+    // Prefer writers, so a commit waiting for its snapshot is not starved by new operations
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&txn_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (int i = 0; i < INODE_LOCKS; i++)
+    {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+// Allocate the dirty state of log, for a table of table_blocks blocks
+// Return 0, or -ENOMEM with whatever was allocated left for free_entry_log
+static int alloc_entry_log(entry_log_t *log, int table_blocks)
+{
+    log->block_dirty = calloc(table_blocks, 1);
+    log->dirty_blocks = malloc(table_blocks * sizeof(int));
+    log->ndirty_blocks = 0;
+    log->jdirty = calloc(sb.total_blocks, 1);
+    log->jlist = malloc(sb.total_blocks * sizeof(int));
+    log->njlist = 0;
+    return log->block_dirty && log->dirty_blocks && log->jdirty && log->jlist ? 0 : -ENOMEM;
+}
+
+static void free_entry_log(entry_log_t *log)
+{
+    free(log->block_dirty);
+    free(log->dirty_blocks);
+    free(log->jdirty);
+    free(log->jlist);
+    log->block_dirty = NULL;
+    log->dirty_blocks = NULL;
+    log->jdirty = NULL;
+    log->jlist = NULL;
+}
+
+// Free the in-memory bitmap, share, hash, length and checksum tables, dedup index, inode table, directories, write buffers and dirty state
+static void free_tables()
+{
+    for (int i = 0; dirs != NULL && i < sb.inode_count; i++)
+    {
+        dir_free(dirs[i]);
+    }
+    for (int i = 0; wbufs != NULL && i < sb.inode_count; i++)
+    {
+        drop_buffer(i);
+    }
+    free(dirs);
+    free(dcache_slots);
+    free(kernel_refs);
+    free(wbufs);
+    free(data_gens);
+    dirs = NULL;
+    kernel_refs = NULL;
+    wbufs = NULL;
+    data_gens = NULL;
+    dcache_slots = NULL;
+    dcache_capacity = 0;
+    dcache_count = 0;
+    dcache_tombstones = 0;
+    free(block_bitmap);
+    free(block_shares);
+    free(block_hashes);
+    free(block_lengths);
+    free(block_sums);
+    free(inode_table);
+    free(inode_block_dirty);
+    free(dirty_inode_blocks);
+    free(jinode_dirty);
+    free(jinode_list);
+    block_bitmap = NULL;
+    block_shares = NULL;
+    block_hashes = NULL;
+    block_lengths = NULL;
+    block_sums = NULL;
+    inode_table = NULL;
+    inode_block_dirty = NULL;
+    dirty_inode_blocks = NULL;
+    jinode_dirty = NULL;
+    jinode_list = NULL;
+    free_entry_log(&hash_log);
+    free_entry_log(&length_log);
+    free_entry_log(&sum_log);
+    dedup_destroy();
+}
+
+// Allocate the in-memory bitmap, share, hash, length and checksum tables, inode table and dirty state for the geometry in sb
+// Return 0, or -ENOMEM
+static int alloc_tables()
+{
+    block_bitmap = calloc(sb.bitmap_blocks, BLOCK_SIZE);
+    block_shares = calloc(sb.share_blocks, BLOCK_SIZE);
+    block_hashes = calloc(sb.hash_blocks, BLOCK_SIZE);
+    block_lengths = calloc(sb.length_blocks, BLOCK_SIZE);
+    block_sums = calloc(sb.sum_blocks, BLOCK_SIZE);
+    inode_table = calloc(sb.inode_blocks, BLOCK_SIZE);
+    inode_block_dirty = calloc(sb.inode_blocks, 1);
+    dirty_inode_blocks = malloc(sb.inode_blocks * sizeof(int));
+    jinode_dirty = calloc(sb.inode_count, 1);
+    jinode_list = malloc(sb.inode_count * sizeof(int));
+    dirs = calloc(sb.inode_count, sizeof(dir_t *));
+    kernel_refs = calloc(sb.inode_count, sizeof(uint32_t));
+    wbufs = calloc(sb.inode_count, sizeof(wbuf_t *));
+    data_gens = calloc(sb.inode_count, sizeof(uint32_t));
+    int logs = alloc_entry_log(&hash_log, sb.hash_blocks) | alloc_entry_log(&length_log, sb.length_blocks) |
+               alloc_entry_log(&sum_log, sb.sum_blocks);
+    if (!block_bitmap || !block_shares || !block_hashes || !block_lengths || !block_sums || !inode_table || !inode_block_dirty ||
+        !dirty_inode_blocks || !jinode_dirty || !jinode_list || logs < 0 || !dirs || !kernel_refs || !wbufs ||
+        !data_gens)
+    {
+        free_tables();
+        return -ENOMEM;
+    }
+
+    sb_dirty = 0;
+    bitmap_dirty_lo = INT_MAX;
+    bitmap_dirty_hi = 0;
+    shares_dirty_lo = INT_MAX;
+    shares_dirty_hi = 0;
+    ndirty_inode_blocks = 0;
+    jsb_dirty = 0;
+    jbitmap_lo = INT_MAX;
+    jbitmap_hi = 0;
+    jshares_lo = INT_MAX;
+    jshares_hi = 0;
+    njinode = 0;
+    dirty_slots.n = 0;
+    jdirty_slots.n = 0;
+    inode_cursor = ROOT_INO;
+    return 0;
+}
+
+// Lay out an image of total_blocks blocks in sb: the superblock, then the bitmap, the share,
+// hash, length and checksum tables, the inode table, the journal, and the data blocks
+// Zero for any of the sizes picks its default
+// Return 0, or -EINVAL if the metadata would not leave room for any data,
+// or inode_size is not a power of two from sizeof(inode_t) to BLOCK_SIZE
+static int plan_geometry(int total_blocks, int inode_count, int inode_size, int journal_blocks)
+{
+    if (total_blocks <= 0)
+    {
+        total_blocks = DEFAULT_BLOCKS;
+    }
+    if (inode_count <= 0)
+    {
+        int64_t by_size = (int64_t)total_blocks * BLOCK_SIZE / DEFAULT_BYTES_PER_INODE;
+        inode_count = by_size < 16 ? 16 : by_size > INT_MAX / 2 ? INT_MAX / 2 : (int)by_size;
+    }
+    if (inode_size <= 0)
+    {
+        inode_size = DEFAULT_INODE_SIZE;
+    }
+    if (inode_size < (int)sizeof(inode_t) || inode_size > BLOCK_SIZE || (inode_size & (inode_size - 1)) != 0)
+    {
+        return -EINVAL;
+    }
+    if (journal_blocks <= 0)
+    {
+        journal_blocks = total_blocks / 64;
+        journal_blocks = journal_blocks < MIN_JOURNAL_BLOCKS ? MIN_JOURNAL_BLOCKS : journal_blocks;
+        journal_blocks = journal_blocks > MAX_JOURNAL_BLOCKS ? MAX_JOURNAL_BLOCKS : journal_blocks;
+    }
+
+    int64_t bitmap_blocks = ((int64_t)total_blocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    int64_t share_blocks = ((int64_t)total_blocks * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t hash_blocks = ((int64_t)total_blocks * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t length_blocks = ((int64_t)total_blocks * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t sum_blocks = length_blocks;
+    int64_t inode_blocks = ((int64_t)inode_count * inode_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t data_start = SUPER_BLOCK_START + 1 + bitmap_blocks + share_blocks + hash_blocks + length_blocks +
+                         sum_blocks + inode_blocks + journal_blocks;
+    if (data_start >= total_blocks)
+    {
+        return -EINVAL;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = NUFS_MAGIC;
+    sb.version = NUFS_VERSION;
+    sb.block_size = BLOCK_SIZE;
+    sb.total_blocks = total_blocks;
+    sb.inode_count = inode_count;
+    sb.inode_size = inode_size;
+    sb.bitmap_start = SUPER_BLOCK_START + 1;
+    sb.bitmap_blocks = bitmap_blocks;
+    sb.shares_start = sb.bitmap_start + sb.bitmap_blocks;
+    sb.share_blocks = share_blocks;
+    sb.hashes_start = sb.shares_start + sb.share_blocks;
+    sb.hash_blocks = hash_blocks;
+    sb.lengths_start = sb.hashes_start + sb.hash_blocks;
+    sb.length_blocks = length_blocks;
+    sb.sums_start = sb.lengths_start + sb.length_blocks;
+    sb.sum_blocks = sum_blocks;
+    sb.inodes_start = sb.sums_start + sb.sum_blocks;
+    sb.inode_blocks = inode_blocks;
+    sb.journal_start = sb.inodes_start + sb.inode_blocks;
+    sb.journal_blocks = journal_blocks;
+    sb.data_start = data_start;
+    sb.free_blocks = total_blocks - data_start;
+    return 0;
+}
+
+// Check that the geometry read into sb is one this build can mount, on an image of image_size bytes
+static int check_geometry(off_t image_size)
+{
+    return sb.magic == NUFS_MAGIC && sb.version == NUFS_VERSION && sb.block_size == BLOCK_SIZE &&
+           sb.total_blocks > 0 && block_offset(sb.total_blocks) <= image_size &&
+           sb.inode_count > ROOT_INO && sb.journal_blocks > 1 &&
+           sb.bitmap_start > SUPER_BLOCK_START &&
+           (int64_t)sb.bitmap_blocks * BLOCK_SIZE * 8 >= sb.total_blocks &&
+           sb.shares_start >= sb.bitmap_start + sb.bitmap_blocks &&
+           (int64_t)sb.share_blocks * BLOCK_SIZE >= (int64_t)sb.total_blocks * (int)sizeof(uint16_t) &&
+           sb.hashes_start >= sb.shares_start + sb.share_blocks &&
+           (int64_t)sb.hash_blocks * BLOCK_SIZE >= (int64_t)sb.total_blocks * (int)sizeof(uint64_t) &&
+           sb.lengths_start >= sb.hashes_start + sb.hash_blocks &&
+           (int64_t)sb.length_blocks * BLOCK_SIZE >= (int64_t)sb.total_blocks * (int)sizeof(uint32_t) &&
+           sb.sums_start >= sb.lengths_start + sb.length_blocks &&
+           (int64_t)sb.sum_blocks * BLOCK_SIZE >= (int64_t)sb.total_blocks * (int)sizeof(uint32_t) &&
+           sb.inodes_start >= sb.sums_start + sb.sum_blocks &&
+           sb.inode_size >= (int)sizeof(inode_t) && sb.inode_size <= BLOCK_SIZE &&
+           (sb.inode_size & (sb.inode_size - 1)) == 0 &&
+           (int64_t)sb.inode_blocks * BLOCK_SIZE >= (int64_t)sb.inode_count * sb.inode_size &&
+           sb.journal_start >= sb.inodes_start + sb.inode_blocks &&
+           sb.data_start >= sb.journal_start + sb.journal_blocks &&
+           sb.data_start < sb.total_blocks;
+}
+
+// Make a new, empty file system in the image at path, replacing whatever file was there
+// Zero for total_blocks, inode_count, inode_size or journal_blocks picks a default (see storage.h)
+// Return 0, or -errno
+int storage_format(const char *path, int total_blocks, int inode_count, int inode_size, int journal_blocks)
+{
+    pthread_once(&locks_once, init_locks);
+
+    int rv = plan_geometry(total_blocks, inode_count, inode_size, journal_blocks);
+    if (rv < 0)
+    {
+        return rv;
+    }
+    rv = disk_open(path, block_offset(sb.total_blocks), 0);
+    if (rv < 0)
+    {
+        return rv;
+    }
+    rv = alloc_tables();
+    if (rv < 0)
+    {
+        disk_close();
+        return rv;
+    }
+    bcache_init(0, BLOCK_SIZE, 0);
+
+    // The fresh image reads back as zeros, so only what is not zero has to be written
+    journal_init(block_offset(sb.journal_start), sb.journal_blocks, &storage_journal_ops);
+    rv = journal_format();
+    if (rv == 0)
+    {
+        balloc_init(block_bitmap, sb.total_blocks);
+
+        // The superblock, bitmap, share, hash, length and checksum tables, inode table and journal are never handed out
+        balloc_reserve(0, sb.data_start);
+        mark_bitmap_dirty(0, sb.data_start, 0);
+
+        // An empty root directory, its own parent
+        inode_at(ROOT_INO)->mode = S_IFDIR | 0777;
+        inode_at(ROOT_INO)->nlink = 2;
+        inode_at(ROOT_INO)->parent = ROOT_INO;
+        mark_inode_dirty(ROOT_INO);
+    }
+    if (rv == 0)
+    {
+        rv = journal_checkpoint();
+    }
+
+    free_tables();
+    disk_close();
+    return rv;
+}
+
+// Rebuild the dedup index from the hash table, for a mount with storage_opts.dedup
+// The table is kept up to date whether dedup is on or not, so every hash in it is
+// still the hash of its block's contents
+// Return 0, or -ENOMEM
+static int load_dedup_index()
+{
+    int hashed = 0;
+    for (int b = sb.data_start; b < sb.total_blocks; b++)
+    {
+        hashed += block_hashes[b] != 0;
+    }
+    if (dedup_init(hashed) < 0)
+    {
+        return -ENOMEM;
+    }
+    for (int b = sb.data_start; b < sb.total_blocks; b++)
+    {
+        if (block_hashes[b] != 0 && dedup_insert(block_hashes[b], b) < 0)
+        {
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// Initialize the storage
+// Read the super block, the bitmap, the share, hash, length and checksum tables and the inode table, and replay the journal
+// The disk image, made by storage_format (mkfs.nufs), is opened here once, and stays open until storage_close
+// Return 0 on success, or -errno if the image can not be opened or is not a nufs image
+int storage_init(const char *path)
+{
+    snprintf(disk_filename, MAX_NAME, "%s", path);
+    pthread_once(&locks_once, init_locks);
+    checksum_init();
+    // writeback_ms alone asks for the flusher, as it did before the durability modes
+    if (storage_opts.durability == DURABILITY_SYNC && storage_opts.writeback_ms > 0)
+    {
+        storage_opts.durability = DURABILITY_PERIODIC;
+    }
+    // Buffered writes only become durable as they are written out, which an operation
+    // that has to be durable as it returns does not wait for
+    wbuf_budget = storage_opts.durability != DURABILITY_SYNC && storage_opts.buffer_kb > 0
+                      ? (size_t)storage_opts.buffer_kb * 1024
+                      : 0;
+
+    int flags = (storage_opts.use_mmap ? DISK_MMAP : 0) | (storage_opts.use_uring ? DISK_URING : 0) |
+                (storage_opts.direct ? DISK_DIRECT : 0);
+    int rv = disk_open(disk_filename, 0, flags);
+    if (rv < 0)
+    {
+        return rv;
+    }
+
+    disk_read(&sb, sizeof(superblock_t), SUPER_BLOCK_START * BLOCK_SIZE);
+    if (!check_geometry(disk_get_size()))
+    {
+        printf("%s is not a nufs image of this layout\n", disk_filename);
+        disk_close();
+        return -EINVAL;
+    }
+    if (alloc_tables() < 0)
+    {
+        disk_close();
+        return -ENOMEM;
+    }
+    if (disk_read(block_bitmap, (size_t)sb.bitmap_blocks * BLOCK_SIZE, block_offset(sb.bitmap_start)) < 0 ||
+        disk_read(block_shares, (size_t)sb.share_blocks * BLOCK_SIZE, block_offset(sb.shares_start)) < 0 ||
+        disk_read(block_hashes, (size_t)sb.hash_blocks * BLOCK_SIZE, block_offset(sb.hashes_start)) < 0 ||
+        disk_read(block_lengths, (size_t)sb.length_blocks * BLOCK_SIZE, block_offset(sb.lengths_start)) < 0 ||
+        disk_read(block_sums, (size_t)sb.sum_blocks * BLOCK_SIZE, block_offset(sb.sums_start)) < 0 ||
+        disk_read(inode_table, (size_t)sb.inode_blocks * BLOCK_SIZE, block_offset(sb.inodes_start)) < 0)
+    {
+        free_tables();
+        disk_close();
+        return -EIO;
+    }
+
+    // A mapped image is already served from the page cache, caching it again only costs copies
+    size_t cache_size = storage_opts.use_mmap ? 0 : (size_t)storage_opts.cache_kb * 1024;
+    if (bcache_init(cache_size, BLOCK_SIZE, storage_opts.cache_write_back) < 0)
+    {
+        free_tables();
+        disk_close();
+        return -ENOMEM;
+    }
+
+    // Bring the tables up to the last committed transaction, and write that home
+    journal_init(block_offset(sb.journal_start), sb.journal_blocks, &storage_journal_ops);
+    int replayed = journal_replay();
+    if (replayed < 0)
+    {
+        printf("%s: can not replay the journal\n", disk_filename);
+        free_tables();
+        bcache_destroy();
+        disk_close();
+        return replayed;
+    }
+    balloc_init(block_bitmap, sb.total_blocks);
+    if (!S_ISDIR(inode_at(ROOT_INO)->mode) || load_dirs() < 0)
+    {
+        printf("%s: can not read the directories\n", disk_filename);
+        free_tables();
+        bcache_destroy();
+        disk_close();
+        return -EIO;
+    }
+    free_inodes = 0;
+    for (int i = ROOT_INO; i < sb.inode_count; i++)
+    {
+        free_inodes += inode_at(i)->mode == 0;
+    }
+    if (storage_opts.dedup && load_dedup_index() < 0)
+    {
+        free_tables();
+        bcache_destroy();
+        disk_close();
+        return -ENOMEM;
+    }
+    if (replayed > 0)
+    {
+        // The log starts over from here, so what it held has to be home before any commit
+        printf("%s: replayed %d journal transactions\n", disk_filename, replayed);
+        mark_all_dirty();
+        int rv = journal_checkpoint();
+        if (rv < 0)
+        {
+            printf("%s: can not write the replayed changes home\n", disk_filename);
+            free_tables();
+            bcache_destroy();
+            disk_close();
+            return rv;
+        }
+    }
+    return 0;
+}
+
+// Start the background threads: with DURABILITY_PERIODIC the flusher, until then every
+// operation commits, and with scrub_kbps the scrub
+// Called once the process serving the mount is running: a thread started before
+// FUSE forks into the background would not survive the fork
+void storage_start_flusher()
+{
+    if (storage_opts.durability == DURABILITY_PERIODIC && !flusher_running)
+    {
+        flusher_running = 1;
+        if (pthread_create(&flusher_thread, NULL, flusher_main, NULL) != 0)
+        {
+            perror("Failed starting metadata flusher, writing metadata synchronously");
+            flusher_running = 0;
+        }
+    }
+    if (storage_opts.scrub_kbps > 0 && !scrub_running)
+    {
+        scrub_running = 1;
+        if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0)
+        {
+            perror("Failed starting the scrub");
+            scrub_running = 0;
+        }
+    }
+}
+
+// Write back everything and close the disk image
+void storage_close()
+{
+    if (scrub_running)
+    {
+        pthread_mutex_lock(&meta_lock);
+        scrub_running = 0;
+        pthread_cond_signal(&scrub_cond);
+        pthread_mutex_unlock(&meta_lock);
+        pthread_join(scrub_thread, NULL);
+    }
+    if (flusher_running)
+    {
+        pthread_mutex_lock(&meta_lock);
+        flusher_running = 0;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&meta_lock);
+        pthread_join(flusher_thread, NULL);
+    }
+    if (ra_running)
+    {
+        pthread_mutex_lock(&ra_lock);
+        ra_running = 0;
+        pthread_cond_broadcast(&ra_cond);
+        pthread_mutex_unlock(&ra_lock);
+        for (int k = 0; k < ra_nthreads; k++)
+        {
+            pthread_join(ra_threads[k], NULL);
+        }
+        ra_nthreads = 0;
+    }
+    // Leave a clean journal, so the next mount has nothing to replay
+    write_out_all();
+    journal_checkpoint();
+    disk_close();
+    free_tables();
+
+    bcache_stats_t cache;
+    bcache_get_stats(&cache);
+    bcache_destroy();
+
+    storage_meta_stats_t stats;
+    storage_get_meta_stats(&stats);
+    printf("image I/O: %s\n", disk_backend());
+    printf("metadata: %ld bytes written in %ld flushes over %ld operations\n",
+           stats.bytes_written, stats.flushes, stats.operations);
+    printf("journal: %ld bytes in %ld commits, %ld checkpoints\n",
+           stats.journal_bytes, stats.journal_commits, stats.checkpoints);
+    printf("block cache: %ld hits, %ld misses, %ld evictions, %ld write-backs\n",
+           cache.hits, cache.misses, cache.evictions, cache.writebacks);
+    if (storage_opts.dedup)
+    {
+        storage_dedup_stats_t dedup;
+        storage_get_dedup_stats(&dedup);
+        printf("dedup: %ld full blocks written, %ld shared, %ld zero, %ld collisions, %ld ns hashing, %ld ns comparing\n",
+               dedup.blocks, dedup.shared, dedup.zero, dedup.collisions, dedup.hash_ns, dedup.verify_ns);
+    }
+    if (storage_opts.compress)
+    {
+        storage_compress_stats_t comp;
+        storage_get_compress_stats(&comp);
+        printf("compression: %ld of %ld clusters stored compressed, %ld bytes in %ld, %ld ns compressing, "
+               "%ld reads in %ld ns decompressing\n",
+               comp.stored, comp.clusters, comp.bytes_in, comp.bytes_out, comp.compress_ns, comp.reads, comp.decompress_ns);
+    }
+    if (wbuf_budget > 0)
+    {
+        storage_wbuf_stats_t wb;
+        storage_get_wbuf_stats(&wb);
+        printf("write buffers: %ld writes buffered, %ld written through, %ld in %ld write-outs (%ld forced by the budget), %ld bytes\n",
+               wb.writes, wb.bypassed, wb.merged, wb.writeouts, wb.reclaims, wb.bytes);
+    }
+    if (storage_opts.readahead_kb > 0)
+    {
+        storage_readahead_stats_t ra;
+        storage_get_readahead_stats(&ra);
+        printf("readahead: %ld of %ld reads sequential, %ld served from %ld windows read ahead (%ld of %ld bytes)\n",
+               ra.sequential, ra.reads, ra.hits, ra.windows, ra.hit_bytes, ra.window_bytes);
+    }
+    storage_checksum_stats_t sums;
+    storage_get_checksum_stats(&sums);
+    printf("checksums: %ld blocks verified (crc32c %s), %ld mismatches, %ld ns; scrub: %ld blocks in %ld passes, %ld mismatches\n",
+           sums.verified, checksum_hardware() ? "in hardware" : "from tables", sums.mismatches, sums.verify_ns,
+           sums.scrubbed, sums.scrub_passes, sums.scrub_mismatches);
+}
+
+// Resolve path and lock its inode, exclusive or shared
+// The namespace lock is only held for the lookup, the inode lock is enough
+// to keep the inode from being released or reused while the caller works on it
+// Return the inode index, or the errors of resolve
+static int lock_inode(const char *path, int exclusive)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int i = find_inode(path);
+    if (i >= 0)
+    {
+        if (exclusive)
+        {
+            pthread_rwlock_wrlock(inode_lock(i));
+        }
+        else
+        {
+            pthread_rwlock_rdlock(inode_lock(i));
+        }
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return i;
+}
+
+// Lock inode ino exclusive or shared, as long as it is in use
+// Return ino, or -ENOENT for a number naming no inode (any more)
+static int lock_ino(int ino, int exclusive)
+{
+    if (ino < ROOT_INO || ino >= sb.inode_count)
+    {
+        return -ENOENT;
+    }
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(inode_lock(ino));
+    }
+    else
+    {
+        pthread_rwlock_rdlock(inode_lock(ino));
+    }
+    // Inodes are only taken and released with their lock held, so this can not change under us
+    if (inode_at(ino)->mode == 0)
+    {
+        pthread_rwlock_unlock(inode_lock(ino));
+        return -ENOENT;
+    }
+    return ino;
+}
+
+// Lock the inode a request names: by path when there is one, by number otherwise
+static int lock_target(const char *path, int ino, int exclusive)
+{
+    return path != NULL ? lock_inode(path, exclusive) : lock_ino(ino, exclusive);
+}
+
+static void unlock_inode(int i)
+{
+    pthread_rwlock_unlock(inode_lock(i));
+}
+
+// The inode locks held by a namespace operation
+#define MAX_LOCKED 4
+
+typedef struct
+{
+    pthread_rwlock_t *locks[MAX_LOCKED];
+    int n;
+} lockset_t;
+
+// Lock the inodes in inos (0 entries are skipped) exclusive,
+// always in stripe order, and each stripe only once
+static void lock_inodes(lockset_t *set, const int *inos, int n)
+{
+    set->n = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (inos[k] == 0)
+        {
+            continue;
+        }
+        pthread_rwlock_t *lock = inode_lock(inos[k]);
+        int pos = set->n;
+        while (pos > 0 && set->locks[pos - 1] > lock)
+        {
+            pos--;
+        }
+        if (pos > 0 && set->locks[pos - 1] == lock)
+        {
+            continue;
+        }
+        memmove(&set->locks[pos + 1], &set->locks[pos], (set->n - pos) * sizeof(pthread_rwlock_t *));
+        set->locks[pos] = lock;
+        set->n++;
+    }
+    for (int k = 0; k < set->n; k++)
+    {
+        pthread_rwlock_wrlock(set->locks[k]);
+    }
+}
+
+static void unlock_inodes(lockset_t *set)
+{
+    for (int k = set->n - 1; k >= 0; k--)
+    {
+        pthread_rwlock_unlock(set->locks[k]);
+    }
+}
+
+// Find a free inode, carrying on from where the last one was found
+// Inode 0 is never handed out, see ROOT_INO, and neither is a removed inode
+// the kernel still knows by number (see storage_ino_forget)
+// Return its index, or -ENOSPC. Called with ns_lock held exclusive
+static int find_free_inode()
+{
+    for (int k = 0; k < sb.inode_count; k++)
+    {
+        int i = (inode_cursor + k) % sb.inode_count;
+        if (i != 0 && inode_at(i)->mode == 0 && __atomic_load_n(&kernel_refs[i], __ATOMIC_RELAXED) == 0)
+        {
+            return i;
+        }
+    }
+    return -ENOSPC;
+}
+
+// Check that dir names a directory in use, for the operations given inode numbers
+// Called with ns_lock held
+static int check_dir(int dir)
+{
+    return dir >= ROOT_INO && dir < sb.inode_count && dirs[dir] != NULL ? 0 : -ENOENT;
+}
+
+// Check that name can be the name of an entry
+static int check_name(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || strchr(name, '/') != NULL)
+    {
+        return -EINVAL;
+    }
+    return len > MAX_NAME_LEN ? -ENAMETOOLONG : 0;
+}
+
+// Create an inode named name in directory dir, which must hold no such entry yet
+// Return the new inode's index, or -errno. Called with ns_lock held exclusive
+static int create_entry(int dir, const char *name, mode_t mode)
+{
+    if (dcache_find(dir, name, strlen(name)) != NULL)
+    {
+        return -EEXIST;
+    }
+    int i = find_free_inode();
+    if (i < 0)
+    {
+        return i;
+    }
+
+    lockset_t set;
+    int inos[2] = {dir, i};
+    lock_inodes(&set, inos, 2);
+
+    // Blocks are only allocated once data is written
+    memset(inode_at(i), 0, sb.inode_size);
+    inode_at(i)->mode = mode;
+    inode_at(i)->nlink = 1;
+    if (S_ISREG(mode))
+    {
+        // Files start out inline, and only move to data blocks once they outgrow the inode
+        inode_at(i)->flags = INODE_INLINE;
+    }
+    if (S_ISDIR(mode))
+    {
+        inode_at(i)->nlink = 2;
+        inode_at(i)->parent = dir;
+        dirs[i] = calloc(1, sizeof(dir_t));
+    }
+
+    int rv = dir_add_entry(dir, name, i);
+    if (rv == 0)
+    {
+        if (S_ISDIR(mode))
+        {
+            inode_at(dir)->nlink++;
+            mark_inode_dirty(dir);
+        }
+        mark_inode_dirty(i);
+        inode_cursor = i + 1;
+        free_inodes--;
+        TRACE("create %s: inode %d in directory %d\n", name, i, dir);
+    }
+    else
+    {
+        dir_free(dirs[i]);
+        dirs[i] = NULL;
+        inode_at(i)->mode = 0;
+    }
+    unlock_inodes(&set);
+    return rv == 0 ? i : rv;
+}
+
+// Create the inode for path, inside a transaction
+static int create_inode(const char *path, mode_t mode)
+{
+    char name[MAX_NAME];
+    int dir;
+
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = resolve_parent(path, &dir, name);
+    if (rv == -EBUSY)
+    {
+        rv = -EEXIST; // The root always exists
+    }
+    if (rv == 0)
+    {
+        rv = create_entry(dir, name, mode);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return rv < 0 ? rv : 0;
+}
+
+// Takes a path, and check if the path already exist in mounted file system
+// If so, return as -EEXIST, if not, create one
+int storage_create(const char *path, mode_t mode)
+{
+    txn_begin();
+    int rv = create_inode(path, mode);
+    txn_end();
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+// Release the blocks of inode i and mark it unused, its entry must already be gone
+// Called with the namespace lock and the inode lock held exclusive
+static void release_inode(int i)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (dirs[i] != NULL)
+    {
+        for (int k = 0; k < n; k++)
+        {
+            free_dir_run(ext[k].start, ext[k].length);
+        }
+        dir_free(dirs[i]);
+        dirs[i] = NULL;
+    }
+    else if (n > 0)
+    {
+        punch_extents(ext, n, 0, ext[n - 1].logical + ext[n - 1].length);
+    }
+    if (inode_at(i)->indirect != 0)
+    {
+        free_block(inode_at(i)->indirect);
+    }
+
+    drop_buffer(i);
+    data_changed(i);
+    memset(inode_at(i), 0, sb.inode_size);
+    mark_inode_dirty(i);
+    free_inodes++;
+}
+
+// Check that inode i can go away as a directory (want_dir) or as anything else
+static int check_removable(int i, int want_dir)
+{
+    if (dirs[i] == NULL)
+    {
+        return want_dir ? -ENOTDIR : 0;
+    }
+    if (!want_dir)
+    {
+        return -EISDIR;
+    }
+    return dir_entries(dirs[i]) > 0 ? -ENOTEMPTY : 0;
+}
+
+// Remove the entry name from directory dir
+// rmdir only removes empty directories, otherwise only non-directories are removed
+// Called with ns_lock held exclusive
+static int remove_entry(int dir, const char *name, int rmdir)
+{
+    dentry_t *e = dcache_find(dir, name, strlen(name));
+    int rv = e != NULL ? check_removable(e->ino, rmdir) : -ENOENT;
+    if (rv < 0)
+    {
+        return rv;
+    }
+
+    // Wait for anyone still reading or writing the file
+    int i = e->ino;
+    lockset_t set;
+    int inos[2] = {dir, i};
+    lock_inodes(&set, inos, 2);
+    if (rmdir)
+    {
+        inode_at(dir)->nlink--;
+        mark_inode_dirty(dir);
+    }
+    TRACE("remove %s: inode %d from directory %d\n", name, i, dir);
+    dir_remove_entry(e);
+    release_inode(i);
+    unlock_inodes(&set);
+    return 0;
+}
+
+// Remove the file or directory at path, inside a transaction
+static int remove_inode(const char *path, int rmdir)
+{
+    char name[MAX_NAME];
+    int dir;
+
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = resolve_parent(path, &dir, name);
+    if (rv == 0)
+    {
+        rv = remove_entry(dir, name, rmdir);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return rv;
+}
+
+static int remove_path(const char *path, int rmdir)
+{
+    txn_begin();
+    int rv = remove_inode(path, rmdir);
+    txn_end();
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+int storage_delete(const char *path)
+{
+    return remove_path(path, 0);
+}
+
+// Remove a directory, only if it has no children
+// The check and the removal happen under one namespace lock
+int storage_rmdir(const char *path)
+{
+    return remove_path(path, 1);
+}
+
+// Check that the entry src may be moved over dst (NULL if the new name is free) in directory to_dir
+// Called with ns_lock held
+static int check_rename(const dentry_t *src, const dentry_t *dst, int to_dir)
+{
+    int i = src->ino;
+
+    // A directory can not move below itself
+    for (int p = to_dir; dirs[i] != NULL; p = inode_at(p)->parent)
+    {
+        if (p == i)
+        {
+            return -EINVAL;
+        }
+        if (p == ROOT_INO)
+        {
+            break;
+        }
+    }
+    if (dst == NULL)
+    {
+        return 0;
+    }
+    if (dirs[dst->ino] != NULL)
+    {
+        return dirs[i] == NULL ? -EISDIR : dir_entries(dirs[dst->ino]) > 0 ? -ENOTEMPTY : 0;
+    }
+    return dirs[i] != NULL ? -ENOTDIR : 0;
+}
+
+// Move the entry from_name of from_dir to to_name in to_dir
+// Only the two directory slots change, a moved directory keeps everything below it
+// Called with ns_lock held exclusive
+static int rename_entry(int from_dir, const char *from_name, int to_dir, const char *to_name)
+{
+    dentry_t *src = dcache_find(from_dir, from_name, strlen(from_name));
+    dentry_t *dst = dcache_find(to_dir, to_name, strlen(to_name));
+    int rv = src == NULL ? -ENOENT : src == dst ? 1 : check_rename(src, dst, to_dir);
+    if (rv != 0)
+    {
+        return rv < 0 ? rv : 0;
+    }
+
+    int i = src->ino;
+    int target = dst != NULL ? dst->ino : 0;
+    TRACE("rename %s -> %s: inode %d, replacing %d\n", from_name, to_name, i, target);
+    lockset_t set;
+    int inos[4] = {from_dir, to_dir, i, target};
+    lock_inodes(&set, inos, 4);
+
+    if (dst != NULL)
+    {
+        // Take over the old target's slot, so replacing it needs no new space
+        dst->ino = i;
+        mark_slot_dirty(to_dir, dst->slot);
+        if (dirs[target] != NULL)
+        {
+            inode_at(to_dir)->nlink--;
+        }
+        release_inode(target);
+    }
+    else
+    {
+        rv = dir_add_entry(to_dir, to_name, i);
+    }
+
+    if (rv == 0)
+    {
+        dir_remove_entry(src);
+        if (dirs[i] != NULL)
+        {
+            inode_at(from_dir)->nlink--;
+            inode_at(to_dir)->nlink++;
+            inode_at(i)->parent = to_dir;
+            mark_inode_dirty(from_dir);
+            mark_inode_dirty(to_dir);
+            mark_inode_dirty(i);
+        }
+    }
+    unlock_inodes(&set);
+    return rv;
+}
+
+// Move the entry at from to to, inside a transaction
+static int rename_inode(const char *from, const char *to)
+{
+    char from_name[MAX_NAME];
+    char to_name[MAX_NAME];
+    int from_dir;
+    int to_dir;
+
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = resolve_parent(from, &from_dir, from_name);
+    if (rv == 0)
+    {
+        rv = resolve_parent(to, &to_dir, to_name);
+    }
+    if (rv == 0)
+    {
+        rv = rename_entry(from_dir, from_name, to_dir, to_name);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return rv;
+}
+
+// Change the inode of given path "from"'s content to "to"'s information
+// An existing file at "to" is replaced, as rename(2) does
+// The removal of the old target and the move commit as one transaction
+int storage_rename(const char *from, const char *to)
+{
+    txn_begin();
+    int rv = rename_inode(from, to);
+    txn_end();
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+// Move the inline contents of inode i out to a data block, so the file can grow
+// past what the inode holds; from then on its contents are mapped by extents
+// Called with the inode lock held exclusive
+// Return 0, or -ENOSPC / -EIO
+static int promote_inline(int i)
+{
+    inode_t *node = inode_at(i);
+    int block = 0;
+    if (node->size > 0)
+    {
+        char data[BLOCK_SIZE];
+        memset(data, 0, BLOCK_SIZE);
+        memcpy(data, inline_data(i), node->size);
+
+        int got;
+        block = allocate_run(1, -1, &got);
+        if (block == -1)
+        {
+            return -ENOSPC;
+        }
+        if (bcache_write(data, BLOCK_SIZE, block_offset(block)) < 0)
+        {
+            unallocate_run(block, 1);
+            return -EIO;
+        }
+        uint32_t sum = block_sum(data);
+        pthread_mutex_lock(&alloc_lock);
+        set_sum(block, sum);
+        pthread_mutex_unlock(&alloc_lock);
+    }
+
+    memset(inline_data(i), 0, inline_capacity());
+    node->flags &= ~INODE_INLINE;
+    if (block != 0)
+    {
+        node->extents[0] = (extent_t){0, block, 1};
+        node->extent_count = 1;
+    }
+    mark_inode_dirty(i);
+    return 0;
+}
+
+// Length table entry of the first block of cluster c, in a file's list ext: the bytes
+// the cluster takes compressed, or 0 if it is stored as it is
+// The entries of the blocks a file maps only change with its lock held exclusive,
+// holding it at all is enough to read them without alloc_lock
+static uint32_t cluster_length(const extent_t *ext, int n, int c)
+{
+    int block = map_block(ext, n, c * COMPRESS_CLUSTER_BLOCKS);
+    return block < 0 ? 0 : block_lengths[block];
+}
+
+// Decompress cluster c, which takes clen bytes, into out, with zeros past what it holds
+// out and scratch both have room for a cluster
+// Return 0, or -EIO if the bytes stored are not a compressed cluster
+static int load_cluster(const extent_t *ext, int n, int c, uint32_t clen, char *out, char *scratch)
+{
+    if (clen > COMPRESS_CLUSTER_SIZE - BLOCK_SIZE ||
+        transfer_extents(ext, n, scratch, clen, (off_t)c * COMPRESS_CLUSTER_SIZE, 0) < 0)
+    {
+        return -EIO;
+    }
+    uint64_t t0 = monotonic_ns();
+    int got = compress_decode(scratch, clen, out, COMPRESS_CLUSTER_SIZE);
+    uint64_t t1 = monotonic_ns();
+    if (got < 0)
+    {
+        TRACE("cluster %d does not decompress\n", c);
+        return -EIO;
+    }
+    memset(out + got, 0, COMPRESS_CLUSTER_SIZE - got);
+
+    pthread_mutex_lock(&meta_lock);
+    compress_stats.reads++;
+    compress_stats.decompress_ns += t1 - t0;
+    pthread_mutex_unlock(&meta_lock);
+    return 0;
+}
+
+// Read the bytes [offset, offset + size) of a file that may have compressed clusters:
+// each run of clusters stored as they are goes straight into buf, as transfer_extents
+// does, a compressed one through a buffer of its own
+// Return 0, or -EIO
+static int read_clusters(const extent_t *ext, int n, char *buf, size_t size, off_t offset)
+{
+    char *cluster = NULL;
+    off_t end = offset + size;
+    int rv = 0;
+    for (off_t pos = offset; pos < end && rv == 0;)
+    {
+        int c = pos / COMPRESS_CLUSTER_SIZE;
+        off_t to = (off_t)(c + 1) * COMPRESS_CLUSTER_SIZE < end ? (off_t)(c + 1) * COMPRESS_CLUSTER_SIZE : end;
+        uint32_t clen = cluster_length(ext, n, c);
+        if (clen == 0)
+        {
+            while (to < end && cluster_length(ext, n, to / COMPRESS_CLUSTER_SIZE) == 0)
+            {
+                to = to + COMPRESS_CLUSTER_SIZE < end ? to + COMPRESS_CLUSTER_SIZE : end;
+            }
+            rv = transfer_extents(ext, n, buf + (pos - offset), to - pos, pos, 0);
+        }
+        else
+        {
+            if (cluster == NULL)
+            {
+                cluster = malloc(2 * COMPRESS_CLUSTER_SIZE);
+            }
+            rv = load_cluster(ext, n, c, clen, cluster, cluster + COMPRESS_CLUSTER_SIZE);
+            if (rv == 0)
+            {
+                memcpy(buf + (pos - offset), cluster + (pos - (off_t)c * COMPRESS_CLUSTER_SIZE), to - pos);
+            }
+        }
+        pos = to;
+    }
+    free(cluster);
+    return rv;
+}
+
+// Read from inode i, with its lock held
+static int read_inode(int i, char *buf, size_t size, off_t offset)
+{
+    if (S_ISDIR(inode_at(i)->mode))
+    {
+        return -EISDIR;
+    }
+    if (offset >= inode_at(i)->size)
+    {
+        return 0;
+    }
+
+    size_t to_read;
+
+    if (offset + size > inode_at(i)->size)
+    {
+        to_read = inode_at(i)->size - offset;
+    }
+    else
+    {
+        to_read = size;
+    }
+
+    // A tiny file is served from the inode table, without any data I/O
+    if (inode_at(i)->flags & INODE_INLINE)
+    {
+        memcpy(buf, inline_data(i) + offset, to_read);
+        return to_read;
+    }
+
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    // One positioned read per extent, straight into the caller's buffer, but for the
+    // compressed clusters of a file that has some
+    int rv = (inode_at(i)->flags & INODE_COMPRESSED) ? read_clusters(ext, n, buf, to_read, offset)
+                                                    : transfer_extents(ext, n, buf, to_read, offset, 0);
+    if (rv < 0)
+    {
+        TRACE("read of inode %d failed\n", i);
+        return -EIO;
+    }
+    return to_read;
+}
+
+// Size of inode i with its buffered writes, with its lock held
+static off_t file_size(int i)
+{
+    wbuf_t *w = wbufs[i];
+    off_t size = inode_at(i)->size;
+    return w != NULL && w->offset + (off_t)w->len > size ? w->offset + (off_t)w->len : size;
+}
+
+// Read from inode i as read_inode does, with the bytes of its buffered writes on top
+// of what its blocks hold; past the end of those, up to the buffer, the file reads as zeros
+static int read_buffered(int i, char *buf, size_t size, off_t offset)
+{
+    wbuf_t *w = wbufs[i];
+    if (w == NULL)
+    {
+        return read_inode(i, buf, size, offset);
+    }
+
+    off_t end = file_size(i);
+    if (offset >= end)
+    {
+        return 0;
+    }
+    size_t to_read = offset + size > end ? end - offset : size;
+    int rv = read_inode(i, buf, to_read, offset);
+    if (rv < 0)
+    {
+        return rv;
+    }
+    memset(buf + rv, 0, to_read - rv);
+
+    off_t from = w->offset > offset ? w->offset : offset;
+    off_t to = w->offset + (off_t)w->len < offset + (off_t)to_read ? w->offset + (off_t)w->len : offset + (off_t)to_read;
+    if (from < to)
+    {
+        memcpy(buf + (from - offset), w->data + (from - w->offset), to - from);
+    }
+    return to_read;
+}
+
+#define RA_MIN (128 * 1024) // The first window, as much as one FUSE read asks for
+#define RA_TRIGGER 2          // Reads in a row that carry on from the one before, before reading ahead
+
+// The state of a new open of a file, for the frontend to keep in fi->fh and hand to every
+// read of the open; NULL, also when readahead is off, reads without any
+storage_file_t *storage_file_open()
+{
+    if (storage_opts.readahead_kb <= 0)
+    {
+        return NULL;
+    }
+    storage_file_t *f = calloc(1, sizeof(storage_file_t));
+    if (f == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+    f->next = -1;
+    for (int k = 0; k < RA_WINDOWS; k++)
+    {
+        f->windows[k].file = f;
+    }
+    return f;
+}
+
+// Free the state of an open as it is released, once no window of it is pending
+void storage_file_release(storage_file_t *f)
+{
+    if (f == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&f->lock);
+    f->closing = 1;
+    for (int k = 0; k < RA_WINDOWS; k++)
+    {
+        while (f->windows[k].state == RA_PENDING)
+        {
+            pthread_cond_wait(&f->done, &f->lock);
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    for (int k = 0; k < RA_WINDOWS; k++)
+    {
+        free(f->windows[k].data);
+    }
+    pthread_cond_destroy(&f->done);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
+
+// Bytes from w->start on that window w holds of inode i as it is now, with f->lock held
+static size_t window_bytes(const ra_window_t *w, int i)
+{
+    if (w->state == RA_EMPTY || w->ino != i || w->gen != __atomic_load_n(&data_gens[i], __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return w->filled;
+}
+
+// Serve a read of inode i from the windows of f, with the inode lock held
+// Return the bytes read, short at the end of the file, or -1 unless the windows hold all of them
+static int read_windows(storage_file_t *f, int i, char *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    int eof = 0;
+    pthread_mutex_lock(&f->lock);
+    while (done < size && !eof)
+    {
+        off_t pos = offset + done;
+        ra_window_t *w = NULL;
+        off_t w_end = 0;
+        for (int k = 0; k < RA_WINDOWS; k++)
+        {
+            ra_window_t *c = &f->windows[k];
+            off_t end = c->start + (off_t)window_bytes(c, i);
+            if (c->start <= pos && pos < end)
+            {
+                w = c;
+                w_end = end;
+            }
+            else if (pos == end && end > c->start && c->state == RA_READY && c->eof)
+            {
+                eof = 1;
+            }
+        }
+        if (w == NULL)
+        {
+            break;
+        }
+        size_t n = w_end - pos < (off_t)(size - done) ? w_end - pos : size - done;
+        memcpy(buf + done, w->data + (pos - w->start), n);
+        done += n;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return done == size || eof ? (int)done : -1;
+}
+
+#define RA_CHUNK (256 * 1024) // Most bytes the readahead threads read with the inode lock held
+
+// Read one window note_read queued, on a readahead thread, a chunk at a time so that a
+// read waiting for the start of the window (see wait_window) gets it without waiting for all
+// A change of the file while it is read ends the window where it is, holding nothing valid
+static void fill_window(ra_window_t *w)
+{
+    storage_file_t *f = w->file;
+    size_t filled = 0;
+    int eof = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&f->lock);
+        int closing = f->closing;
+        pthread_mutex_unlock(&f->lock);
+        if (closing || eof || filled == w->len)
+        {
+            break;
+        }
+
+        size_t n = w->len - filled < RA_CHUNK ? w->len - filled : RA_CHUNK;
+        int i = lock_ino(w->ino, 0);
+        if (i < 0)
+        {
+            break;
+        }
+        uint32_t gen = __atomic_load_n(&data_gens[i], __ATOMIC_RELAXED);
+        int rv = filled == 0 || gen == w->gen ? read_buffered(i, w->data + filled, n, w->start + filled) : -ESTALE;
+        unlock_inode(i);
+        if (rv < 0)
+        {
+            break;
+        }
+
+        eof = (size_t)rv < n;
+        pthread_mutex_lock(&f->lock);
+        w->gen = gen;
+        w->filled = filled + rv;
+        pthread_cond_broadcast(&f->done);
+        pthread_mutex_unlock(&f->lock);
+        filled += rv;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    w->state = filled > 0 ? RA_READY : RA_EMPTY;
+    w->len = filled;
+    w->eof = eof;
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+
+    if (filled > 0)
+    {
+        pthread_mutex_lock(&ra_lock);
+        ra_stats.windows++;
+        ra_stats.window_bytes += filled;
+        pthread_mutex_unlock(&ra_lock);
+    }
+}
+
+// A readahead thread: fill the windows queued, oldest first, until storage_close
+// stops it; the reads it makes are the same as any other, under a shared inode lock
+static void *readahead_main(void *arg)
+{
+    pthread_mutex_lock(&ra_lock);
+    for (;;)
+    {
+        ra_window_t *w = ra_head;
+        if (w == NULL)
+        {
+            if (!ra_running)
+            {
+                break;
+            }
+            pthread_cond_wait(&ra_cond, &ra_lock);
+            continue;
+        }
+        ra_head = w->queue_next;
+        ra_tail = ra_head != NULL ? ra_tail : NULL;
+        pthread_mutex_unlock(&ra_lock);
+        fill_window(w);
+        pthread_mutex_lock(&ra_lock);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return NULL;
+}
+
+// Queue window w for the readahead threads, starting them for the first window: by then
+// any fork of FUSE into the background is done (see storage_start_flusher)
+// Called with the lock of w's file held; return 0, or -1 if there is no thread to fill it
+static int queue_window(ra_window_t *w)
+{
+    pthread_mutex_lock(&ra_lock);
+    if (!ra_running)
+    {
+        ra_running = 1;
+        while (ra_nthreads < RA_THREADS && pthread_create(&ra_threads[ra_nthreads], NULL, readahead_main, NULL) == 0)
+        {
+            ra_nthreads++;
+        }
+        if (ra_nthreads == 0)
+        {
+            perror("Failed starting readahead");
+            ra_running = 0;
+        }
+    }
+    if (ra_running)
+    {
+        w->queue_next = NULL;
+        if (ra_tail != NULL)
+        {
+            ra_tail->queue_next = w;
+        }
+        else
+        {
+            ra_head = w;
+        }
+        ra_tail = w;
+        pthread_cond_signal(&ra_cond);
+    }
+    pthread_mutex_unlock(&ra_lock);
+    return ra_running ? 0 : -1;
+}
+
+// Note a read through f of inode i, size end: rv bytes from offset, served from the
+// windows if hit; once RA_TRIGGER reads in a row carried on from the one before, keep
+// a window of the bytes that follow read ahead, queued when less than half a window of
+// them is left; every window queued doubles the next, up to readahead_kb, and a read
+// that does not carry on cuts it to a quarter
+static void note_read(storage_file_t *f, int i, off_t offset, int rv, off_t end, int hit)
+{
+    pthread_mutex_lock(&f->lock);
+    if (f->ino != i)
+    {
+        f->ino = i;
+        f->next = -1;
+        f->seq = 0;
+        f->window = 0;
+    }
+    // Only a read that continues the one before it is sequential
+    int sequential = offset == f->next;
+    f->seq = sequential ? f->seq + 1 : 0;
+    f->window = sequential ? f->window : f->window / 4;
+    f->next = offset + rv;
+
+    // How far the windows, read or pending, already reach past the read
+    off_t reach = f->next;
+    for (int pass = 0; pass < RA_WINDOWS; pass++)
+    {
+        for (int k = 0; k < RA_WINDOWS; k++)
+        {
+            ra_window_t *w = &f->windows[k];
+            int live = w->state == RA_PENDING ? w->ino == i : window_bytes(w, i) > 0;
+            if (live && w->start <= reach && reach < w->start + (off_t)w->len)
+            {
+                reach = w->start + w->len;
+            }
+        }
+    }
+
+    size_t max = (size_t)storage_opts.readahead_kb * 1024;
+    size_t window = f->window > 0 ? f->window : (RA_MIN < max ? RA_MIN : max);
+    if (f->seq >= RA_TRIGGER && reach < end && reach - f->next < (off_t)window / 2)
+    {
+        // A window that is not pending and holds nothing past the read is free
+        ra_window_t *w = NULL;
+        for (int k = 0; k < RA_WINDOWS && w == NULL; k++)
+        {
+            ra_window_t *c = &f->windows[k];
+            size_t held = window_bytes(c, i);
+            if (c->state != RA_PENDING && (held == 0 || c->start + (off_t)held <= f->next))
+            {
+                w = c;
+            }
+        }
+        size_t want = end - reach < (off_t)window ? end - reach : window;
+        if (w != NULL && w->cap < want)
+        {
+            char *data = realloc(w->data, want);
+            if (data != NULL)
+            {
+                w->data = data;
+                w->cap = want;
+            }
+        }
+        if (w != NULL && w->cap >= want)
+        {
+            w->state = RA_PENDING;
+            w->ino = i;
+            w->start = reach;
+            w->len = want;
+            w->filled = 0;
+            if (queue_window(w) == 0)
+            {
+                f->window = window * 2 < max ? window * 2 : max;
+            }
+            else
+            {
+                w->state = RA_EMPTY;
+            }
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    pthread_mutex_lock(&ra_lock);
+    ra_stats.reads++;
+    ra_stats.sequential += sequential;
+    ra_stats.hits += hit;
+    ra_stats.hit_bytes += hit ? rv : 0;
+    pthread_mutex_unlock(&ra_lock);
+}
+
+// Wait until no pending window of f is still to read the byte at offset, so that a read
+// catching up with the readahead is served from it instead of reading the same bytes again
+// Called without any inode lock
+static void wait_window(storage_file_t *f, off_t offset)
+{
+    pthread_mutex_lock(&f->lock);
+    for (int k = 0; k < RA_WINDOWS; k++)
+    {
+        ra_window_t *w = &f->windows[k];
+        while (w->state == RA_PENDING && w->start + (off_t)w->filled <= offset && offset < w->start + (off_t)w->len)
+        {
+            pthread_cond_wait(&f->done, &f->lock);
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Read from the file at path, or inode ino when path is NULL, through the state f of
+// the open when there is one (see note_read)
+// Reads of the same file, and of different files, run in parallel
+static int read_target(const char *path, int ino, char *buf, size_t size, off_t offset, storage_file_t *f)
+{
+    if (f != NULL)
+    {
+        wait_window(f, offset);
+    }
+    int i = lock_target(path, ino, 0);
+    if (i < 0)
+    {
+        return i;
+    }
+
+    int rv = f != NULL ? read_windows(f, i, buf, size, offset) : -1;
+    int hit = rv >= 0;
+    if (!hit)
+    {
+        rv = read_buffered(i, buf, size, offset);
+    }
+    off_t end = file_size(i);
+    unlock_inode(i);
+
+    if (f != NULL && rv >= 0)
+    {
+        note_read(f, i, offset, rv, end, hit);
+    }
+    return rv;
+}
+
+// Takes a path to read, a buffer to store content read
+// And a size, which to read size bytes from path, and the offset,
+// and the state of the open it reads through, or NULL
+int storage_read(const char *path, char *buf, size_t size, off_t offset, storage_file_t *f)
+{
+    return read_target(path, 0, buf, size, offset, f);
+}
+
+// How write_extents stores each block of a write, decided by plan_dedup and write_blocks;
+// a plan >= 0 is instead the disk block that already holds the same bytes, to be shared
+#define PLAN_WRITE -1 // Write the bytes, in place if the block is the file's own
+#define PLAN_HOLE -2  // All zeros, unmap the block
+#define PLAN_FRESH -3 // Write the bytes to a new block, whatever the block mapped is
+
+#define DEDUP_EXTENTS_MAX (MAX_EXTENTS / 2)    // Extents past which a file's writes stop deduplicating
+#define COMPRESS_EXTENTS_MAX (MAX_EXTENTS / 2) // and stop compressing
+
+// The plan of a write, an entry per block it touches
+typedef struct
+{
+    int *how;          // PLAN_*, or the block to share
+    uint64_t *hashes;  // For a block written, the hash to index it under once it is, or 0
+    uint32_t *lengths; // For a block written, its length table entry
+} plan_t;
+
+// Start a plan of nblocks blocks, all written in place
+static void plan_init(plan_t *plan, int nblocks)
+{
+    plan->how = malloc(nblocks * sizeof(int));
+    plan->hashes = calloc(nblocks, sizeof(uint64_t));
+    plan->lengths = calloc(nblocks, sizeof(uint32_t));
+    for (int k = 0; k < nblocks; k++)
+    {
+        plan->how[k] = PLAN_WRITE;
+    }
+}
+
+static void plan_free(plan_t *plan)
+{
+    free(plan->how);
+    free(plan->hashes);
+    free(plan->lengths);
+}
+// Take an owner of the block indexed for hash, for a write of the same contents
+// Return the block, or -1 if none is, or it already has as many owners as the share table counts
+static int claim_indexed(uint64_t hash)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int block = dedup_find(hash);
+    if (block >= 0 && block_shares[block] < UINT16_MAX)
+    {
+        block_shares[block]++;
+        mark_shares_dirty(block, 1);
+    }
+    else
+    {
+        block = -1;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return block;
+}
+
+// Plan how to store the blocks [first, last] a write of size bytes of buf at offset touches:
+// one it covers in full and that is all zeros becomes a hole, one whose bytes a stored
+// block already holds shares that block (with an owner taken for the write, which
+// free_run gives back), everything else is written
+// The hash of each full block to write goes to hashes[], 0 for the rest, to index it once written
+static void plan_dedup(const char *buf, size_t size, off_t offset, int first, int last, int *plan, uint64_t *hashes)
+{
+    static const char zeros[BLOCK_SIZE];
+    char stored[BLOCK_SIZE];
+    storage_dedup_stats_t stats = {0};
+
+    for (int b = first; b <= last; b++)
+    {
+        off_t begin = (off_t)b * BLOCK_SIZE;
+        plan[b - first] = PLAN_WRITE;
+        hashes[b - first] = 0;
+        if (begin < offset || begin + BLOCK_SIZE > offset + (off_t)size)
+        {
+            continue;
+        }
+
+        const char *data = buf + (begin - offset);
+        uint64_t t0 = monotonic_ns();
+        stats.blocks++;
+        if (memcmp(data, zeros, BLOCK_SIZE) == 0)
+        {
+            plan[b - first] = PLAN_HOLE;
+            stats.zero++;
+            stats.hash_ns += monotonic_ns() - t0;
+            continue;
+        }
+        uint64_t hash = dedup_hash(data, BLOCK_SIZE);
+        uint64_t t1 = monotonic_ns();
+        stats.hash_ns += t1 - t0;
+
+        // The hash only nominates the block, the bytes decide
+        int block = claim_indexed(hash);
+        if (block >= 0)
+        {
+            if (bcache_read(stored, BLOCK_SIZE, block_offset(block)) >= 0 && memcmp(stored, data, BLOCK_SIZE) == 0)
+            {
+                plan[b - first] = block;
+                stats.shared++;
+            }
+            else
+            {
+                free_run(block, 1);
+                stats.collisions++;
+            }
+            stats.verify_ns += monotonic_ns() - t1;
+        }
+        if (plan[b - first] == PLAN_WRITE)
+        {
+            hashes[b - first] = hash;
+        }
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    dedup_stats.blocks += stats.blocks;
+    dedup_stats.shared += stats.shared;
+    dedup_stats.zero += stats.zero;
+    dedup_stats.collisions += stats.collisions;
+    dedup_stats.hash_ns += stats.hash_ns;
+    dedup_stats.verify_ns += stats.verify_ns;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+// What block k of a write gets: PLAN_WRITE, PLAN_FRESH, or PLAN_HOLE for no block
+// written at all (a hole, or a block shared); without a plan all are written in place
+static int plan_kind(const plan_t *plan, int k)
+{
+    if (plan == NULL)
+    {
+        return PLAN_WRITE;
+    }
+    return plan->how[k] >= 0 ? PLAN_HOLE : plan->how[k];
+}
+
+// Map the blocks plan_dedup chose to share, into the holes cut for them in the list
+// Return the new count, or -EFBIG
+static int map_planned(extent_t *ext, int n, int first, const int *how, int nblocks)
+{
+    for (int k = 0; k < nblocks; k++)
+    {
+        if (how[k] >= 0)
+        {
+            if (n == EXTENT_SCRATCH)
+            {
+                return -EFBIG;
+            }
+            ext[n++] = (extent_t){first + k, how[k], 1};
+        }
+    }
+    qsort(ext, n, sizeof(extent_t), compare_logical);
+    return compact_extents(ext, n);
+}
+
+// Store the bytes of a write to inode i in its blocks as plan says, with its lock
+// held exclusive; without a plan every block is written in place
+// Once the list is stored, the blocks written are indexed and get their length table
+// entries, and a file with a compressed cluster is flagged INODE_COMPRESSED
+static int write_extents(int i, const char *buf, size_t size, off_t offset, const plan_t *plan)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    int nblocks = last - first + 1;
+
+    // Blocks shared with other files are never written in place: cut them out of each
+    // run of blocks to write (all of them for a run to write fresh), then map every
+    // hole in it to new blocks
+    // Blocks not written lose whatever they were mapped to
+    extent_t *fresh = malloc(nblocks * sizeof(extent_t));
+    int nfresh = 0;
+    extent_t cut[EXTENT_SCRATCH];
+    int ncut = 0;
+    int rv = n;
+    for (int b = first; b <= last && rv >= 0;)
+    {
+        int kind = plan_kind(plan, b - first);
+        int e = b + 1;
+        while (e <= last && plan_kind(plan, e - first) == kind)
+        {
+            e++;
+        }
+        rv = cut_extents(ext, rv, b, e, kind == PLAN_WRITE, cut, &ncut);
+        if (rv >= 0 && kind != PLAN_HOLE)
+        {
+            int got = 0;
+            rv = fill_extents(ext, rv, b, e, fresh + nfresh, &got);
+            nfresh += got;
+        }
+        b = e;
+    }
+    if (rv >= 0 && plan != NULL)
+    {
+        rv = map_planned(ext, rv, first, plan->how, nblocks);
+    }
+    if (rv >= 0)
+    {
+        n = rv;
+        rv = n > MAX_EXTENTS ? -EFBIG : 0;
+    }
+
+    // New blocks may hold stale bytes: the parts of them this write does not cover get
+    // what the shared block they replace held, or zeros
+    if (rv == 0 && nfresh > 0)
+    {
+        int head = offset % BLOCK_SIZE;
+        int tail = (offset + size) % BLOCK_SIZE;
+        extent_t *fresh_last = &fresh[nfresh - 1];
+        if (head != 0 && fresh[0].logical == first)
+        {
+            rv = init_block_range(ext, n, first, 0, head, cut, ncut);
+        }
+        if (rv == 0 && tail != 0 && fresh_last->logical + fresh_last->length - 1 == last)
+        {
+            rv = init_block_range(ext, n, last, tail, BLOCK_SIZE, cut, ncut);
+        }
+    }
+    for (int b = first; b <= last && rv == 0;)
+    {
+        int written = plan_kind(plan, b - first) != PLAN_HOLE;
+        int e = b + 1;
+        while (e <= last && (plan_kind(plan, e - first) != PLAN_HOLE) == written)
+        {
+            e++;
+        }
+        if (written)
+        {
+            off_t from = (off_t)b * BLOCK_SIZE > offset ? (off_t)b * BLOCK_SIZE : offset;
+            off_t to = (off_t)e * BLOCK_SIZE < offset + (off_t)size ? (off_t)e * BLOCK_SIZE : offset + (off_t)size;
+            rv = transfer_extents(ext, n, (char *)buf + (from - offset), to - from, from, 1);
+        }
+        b = e;
+    }
+    if (rv == 0)
+    {
+        // Blocks written in place changed already, their checksums go along whatever happens next
+        update_sums(ext, n, buf, size, offset);
+        rv = store_extents(i, ext, n);
+    }
+    if (rv < 0)
+    {
+        // Give back whatever this write allocated or claimed, the inode still holds the old list
+        for (int k = 0; k < nfresh; k++)
+        {
+            unallocate_run(fresh[k].start, fresh[k].length);
+        }
+        for (int k = 0; plan != NULL && k < nblocks; k++)
+        {
+            if (plan->how[k] >= 0)
+            {
+                free_run(plan->how[k], 1);
+            }
+        }
+        free(fresh);
+        TRACE("write of inode %d failed: %d\n", i, rv);
+        return rv;
+    }
+    for (int k = 0; k < ncut; k++)
+    {
+        free_run(cut[k].start, cut[k].length);
+    }
+    free(fresh);
+
+    // What was written is there for later writes of the same bytes to share, and the
+    // lengths tell the compressed clusters apart
+    if (plan != NULL)
+    {
+        int compressed = 0;
+        pthread_mutex_lock(&alloc_lock);
+        for (int k = 0; k < nblocks; k++)
+        {
+            if (plan->hashes[k] != 0)
+            {
+                index_block(map_block(ext, n, first + k), plan->hashes[k]);
+            }
+            if (plan->lengths[k] != 0)
+            {
+                set_length(map_block(ext, n, first + k), plan->lengths[k]);
+                compressed = 1;
+            }
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        if (compressed && !(inode_at(i)->flags & INODE_COMPRESSED))
+        {
+            inode_at(i)->flags |= INODE_COMPRESSED;
+            mark_inode_dirty(i);
+        }
+    }
+
+    if (offset + size > inode_at(i)->size)
+    {
+        inode_at(i)->size = offset + size;
+        mark_inode_dirty(i);
+    }
+    return size;
+}
+
+// Whether a write of [offset, end) to a file of old_size bytes stores cluster c again
+// whole: it is stored compressed, so the write can not change it in place, or with
+// compress the write runs to its end (or the end of the file), and either leaves none
+// of its bytes to keep or fills it up, as appends do once per cluster
+static int rewrites_cluster(const extent_t *ext, int n, int c, off_t offset, off_t end, off_t old_size, int compress)
+{
+    if (cluster_length(ext, n, c) != 0)
+    {
+        return 1;
+    }
+    off_t begin = (off_t)c * COMPRESS_CLUSTER_SIZE;
+    off_t new_size = end > old_size ? end : old_size;
+    off_t live_end = begin + COMPRESS_CLUSTER_SIZE < new_size ? begin + COMPRESS_CLUSTER_SIZE : new_size;
+    return compress && end >= live_end && (offset <= begin || begin >= old_size || end >= begin + COMPRESS_CLUSTER_SIZE);
+}
+
+// Compress the live bytes of a cluster (those up to the end of the file) into packed,
+// which has room for a cluster
+// Return the blocks they take compressed, with the exact length in *clen, or 0 to store
+// the cluster as it is: compressed, it would not save compress_min percent of its
+// blocks, and at least one
+static int compress_cluster(const char *data, int live, char *packed, uint32_t *clen)
+{
+    int blocks = (live + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int save = (blocks * storage_opts.compress_min + 99) / 100;
+    int room = blocks - (save > 1 ? save : 1);
+    if (room < 1)
+    {
+        return 0;
+    }
+
+    uint64_t t0 = monotonic_ns();
+    int len = compress_encode(data, live, packed, room * BLOCK_SIZE);
+    uint64_t t1 = monotonic_ns();
+    int k = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    pthread_mutex_lock(&meta_lock);
+    compress_stats.clusters++;
+    compress_stats.compress_ns += t1 - t0;
+    if (len > 0)
+    {
+        compress_stats.stored++;
+        compress_stats.bytes_in += live;
+        compress_stats.bytes_out += (long)k * BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    *clen = len;
+    return k;
+}
+
+// Plan the blocks [first, last] of a write with plan_dedup if dedup is on, or leave them
+// written in place; plan starts at block base
+static void plan_blocks(plan_t *plan, int base, const char *buf, size_t size, off_t offset, int first, int last,
+                        int dedup)
+{
+    if (dedup)
+    {
+        plan_dedup(buf, size, offset, first, last, plan->how + (first - base), plan->hashes + (first - base));
+    }
+}
+
+// Store a write to inode i in its blocks, with its lock held exclusive
+// With compress, or once the file has compressed clusters, the write goes by cluster:
+// a cluster rewrites_cluster picks is stored again whole, from a copy of the write
+// widened to it with the bytes it keeps read back, compressed if compress is on and
+// that saves enough, to new blocks if it was compressed; the rest is stored as it is
+// With dedup, blocks stored as they are are planned by plan_dedup
+static int write_blocks(int i, const char *buf, size_t size, off_t offset, int dedup, int compress)
+{
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + size - 1) / BLOCK_SIZE;
+    plan_t plan;
+    if (!compress && !(inode_at(i)->flags & INODE_COMPRESSED))
+    {
+        if (!dedup)
+        {
+            return write_extents(i, buf, size, offset, NULL);
+        }
+        plan_init(&plan, last - first + 1);
+        plan_blocks(&plan, first, buf, size, offset, first, last, dedup);
+        int rv = write_extents(i, buf, size, offset, &plan);
+        plan_free(&plan);
+        return rv;
+    }
+
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    // Widen the write to the clusters stored whole at either end
+    off_t end = offset + size;
+    off_t old_size = inode_at(i)->size;
+    off_t new_size = end > old_size ? end : old_size;
+    int c_first = offset / COMPRESS_CLUSTER_SIZE;
+    int c_last = (end - 1) / COMPRESS_CLUSTER_SIZE;
+    off_t begin = offset;
+    off_t stop = end;
+    if (rewrites_cluster(ext, n, c_first, offset, end, old_size, compress))
+    {
+        begin = (off_t)c_first * COMPRESS_CLUSTER_SIZE;
+    }
+    if (rewrites_cluster(ext, n, c_last, offset, end, old_size, compress))
+    {
+        stop = (off_t)(c_last + 1) * COMPRESS_CLUSTER_SIZE;
+        stop = stop < new_size ? stop : new_size;
+    }
+
+    // The bytes of those clusters the write leaves out are read back, zeros past the old end
+    char *stage = calloc(stop - begin, 1);
+    memcpy(stage + (offset - begin), buf, size);
+    int rv = 0;
+    if (begin < offset && begin < old_size)
+    {
+        rv = read_clusters(ext, n, stage, (offset < old_size ? offset : old_size) - begin, begin);
+    }
+    if (rv == 0 && stop > end && end < old_size)
+    {
+        rv = read_clusters(ext, n, stage + (end - begin), (stop < old_size ? stop : old_size) - end, end);
+    }
+    if (rv < 0)
+    {
+        free(stage);
+        return rv;
+    }
+
+    first = begin / BLOCK_SIZE;
+    last = (stop - 1) / BLOCK_SIZE;
+    plan_init(&plan, last - first + 1);
+    char *packed = compress ? malloc(COMPRESS_CLUSTER_SIZE) : NULL;
+    for (int c = c_first; c <= c_last; c++)
+    {
+        int from = c * COMPRESS_CLUSTER_BLOCKS > first ? c * COMPRESS_CLUSTER_BLOCKS : first;
+        int to = (c + 1) * COMPRESS_CLUSTER_BLOCKS - 1 < last ? (c + 1) * COMPRESS_CLUSTER_BLOCKS - 1 : last;
+        if (!rewrites_cluster(ext, n, c, offset, end, old_size, compress))
+        {
+            plan_blocks(&plan, first, stage, stop - begin, begin, from, to, dedup);
+            continue;
+        }
+
+        // Stored compressed, the cluster's first blocks hold the compressed bytes and the rest is a hole
+        off_t cluster_begin = (off_t)c * COMPRESS_CLUSTER_SIZE;
+        off_t live = new_size - cluster_begin < COMPRESS_CLUSTER_SIZE ? new_size - cluster_begin : COMPRESS_CLUSTER_SIZE;
+        char *data = stage + (cluster_begin - begin);
+        uint32_t clen;
+        int k = compress ? compress_cluster(data, live, packed, &clen) : 0;
+        if (k > 0)
+        {
+            memcpy(data, packed, clen);
+            memset(data + clen, 0, (size_t)k * BLOCK_SIZE - clen);
+            for (int b = from; b <= to; b++)
+            {
+                plan.how[b - first] = b - from < k ? PLAN_FRESH : PLAN_HOLE;
+                plan.lengths[b - first] = b == from ? clen : b - from < k ? COMPRESSED_MORE : 0;
+            }
+            continue;
+        }
+
+        // Stored as it is, but not over the blocks holding it compressed
+        plan_blocks(&plan, first, stage, stop - begin, begin, from, to, dedup);
+        for (int b = from; b <= to && cluster_length(ext, n, c) != 0; b++)
+        {
+            if (plan.how[b - first] == PLAN_WRITE)
+            {
+                plan.how[b - first] = PLAN_FRESH;
+            }
+        }
+    }
+
+    rv = write_extents(i, stage, stop - begin, begin, &plan);
+    plan_free(&plan);
+    free(packed);
+    free(stage);
+    return rv < 0 ? rv : (int)size;
+}
+
+// Write to inode i, with its lock held exclusive
+static int write_inode(int i, const char *buf, size_t size, off_t offset)
+{
+    if (S_ISDIR(inode_at(i)->mode))
+    {
+        return -EISDIR;
+    }
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (offset + size > block_offset(sb.total_blocks))
+    {
+        return -EFBIG;
+    }
+
+    // While the file fits in the inode, the write only changes the inode
+    if (inode_at(i)->flags & INODE_INLINE)
+    {
+        if (offset + size <= (size_t)inline_capacity())
+        {
+            memcpy(inline_data(i) + offset, buf, size);
+            if (offset + size > inode_at(i)->size)
+            {
+                inode_at(i)->size = offset + size;
+            }
+            mark_inode_dirty(i);
+            return size;
+        }
+        int rv = promote_inline(i);
+        if (rv < 0)
+        {
+            return rv;
+        }
+    }
+
+    // Holes, shared blocks and compressed clusters split the extent list: a file stops
+    // deduplicating and compressing once it has used half the room, and a write that
+    // runs out of it gets its bytes written as they are
+    int dedup = storage_opts.dedup && inode_at(i)->extent_count < DEDUP_EXTENTS_MAX;
+    int compress = storage_opts.compress && inode_at(i)->extent_count < COMPRESS_EXTENTS_MAX;
+    int rv = write_blocks(i, buf, size, offset, dedup, compress);
+    if (rv == -EFBIG && (dedup || compress))
+    {
+        rv = write_blocks(i, buf, size, offset, 0, 0);
+    }
+    if (rv > 0)
+    {
+        __atomic_store_n(&data_unsynced, 1, __ATOMIC_RELAXED);
+    }
+    return rv;
+}
+
+// Most bytes one file buffers: a write that would take its buffer past this writes the
+// buffer out first, and a larger write is never buffered
+#define WBUF_MAX (4 << 20)
+
+// Write the buffered writes of inode i to their blocks, which are only allocated now,
+// all of them at once, and drop the buffer; on an error the buffer stays for the next try
+// Called inside a transaction, with the inode lock held exclusive
+// Return 0, or the errors of write_inode
+static int write_out(int i)
+{
+    wbuf_t *w = wbufs[i];
+    if (w == NULL)
+    {
+        return 0;
+    }
+    if (w->len > 0)
+    {
+        int rv = write_inode(i, w->data, w->len, w->offset);
+        if (rv < 0)
+        {
+            TRACE("write-out of inode %d failed: %d\n", i, rv);
+            return rv;
+        }
+        pthread_mutex_lock(&wbuf_lock);
+        wbuf_stats.writeouts++;
+        wbuf_stats.merged += w->writes;
+        wbuf_stats.bytes += w->len;
+        pthread_mutex_unlock(&wbuf_lock);
+    }
+    drop_buffer(i);
+    return 0;
+}
+
+// Drop the buffered bytes of inode i from size on, ahead of a truncate to size
+static void trim_buffer(int i, off_t size)
+{
+    wbuf_t *w = wbufs[i];
+    if (w != NULL && w->offset + (off_t)w->len > size)
+    {
+        w->len = size > w->offset ? size - w->offset : 0;
+    }
+}
+
+// Grow the buffer of inode i (making one if it has none) to hold len bytes
+// Return it, or NULL if there is no memory for that
+static wbuf_t *reserve_buffer(int i, size_t len)
+{
+    wbuf_t *w = wbufs[i];
+    if (w != NULL && w->cap >= len)
+    {
+        return w;
+    }
+
+    size_t cap = w != NULL ? w->cap * 2 : BLOCK_SIZE;
+    while (cap < len)
+    {
+        cap *= 2;
+    }
+    cap = cap < WBUF_MAX ? cap : WBUF_MAX;
+    char *data = realloc(w != NULL ? w->data : NULL, cap);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    int fresh = w == NULL;
+    if (fresh)
+    {
+        w = calloc(1, sizeof(wbuf_t));
+        if (w == NULL)
+        {
+            free(data);
+            return NULL;
+        }
+        w->ino = i;
+        wbufs[i] = w;
+    }
+
+    pthread_mutex_lock(&wbuf_lock);
+    wbuf_bytes += cap - w->cap;
+    if (fresh)
+    {
+        w->prev = wbuf_newest;
+        if (wbuf_newest != NULL)
+        {
+            wbuf_newest->next = w;
+        }
+        else
+        {
+            wbuf_oldest = w;
+        }
+        wbuf_newest = w;
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+    w->data = data;
+    w->cap = cap;
+    return w;
+}
+
+// Write to inode i through its buffer, delaying the allocation of blocks until the
+// buffer is written out (on flush, fsync, or when the buffers outgrow their budget),
+// so that the allocator sees everything written by then and gives it one run
+// A write that overlaps or follows the buffered bytes joins them, anything else
+// writes the buffer out first and starts it over
+// Called inside a transaction, with the inode lock held exclusive
+// Return size, or the errors of write_inode
+static int buffer_write(int i, const char *buf, size_t size, off_t offset)
+{
+    if (S_ISDIR(inode_at(i)->mode))
+    {
+        return -EISDIR;
+    }
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (offset + size > block_offset(sb.total_blocks))
+    {
+        return -EFBIG;
+    }
+
+    wbuf_t *w = wbufs[i];
+    off_t from = offset;
+    off_t to = offset + size;
+    if (w != NULL)
+    {
+        off_t w_end = w->offset + (off_t)w->len;
+        from = w->offset < from ? w->offset : from;
+        to = w_end > to ? w_end : to;
+        if (offset > w_end || offset + (off_t)size < w->offset || to - from > WBUF_MAX)
+        {
+            int rv = write_out(i);
+            if (rv < 0)
+            {
+                return rv;
+            }
+            w = NULL;
+            from = offset;
+            to = offset + size;
+        }
+    }
+
+    off_t old_from = w != NULL ? w->offset : offset;
+    size_t old_len = w != NULL ? w->len : 0;
+    w = size <= WBUF_MAX ? reserve_buffer(i, to - from) : NULL;
+    if (w == NULL)
+    {
+        // Too large, or no memory to buffer it: whatever is buffered goes first
+        int rv = write_out(i);
+        pthread_mutex_lock(&wbuf_lock);
+        wbuf_stats.bypassed++;
+        pthread_mutex_unlock(&wbuf_lock);
+        return rv < 0 ? rv : write_inode(i, buf, size, offset);
+    }
+
+    if (old_from > from)
+    {
+        memmove(w->data + (old_from - from), w->data, old_len);
+    }
+    memcpy(w->data + (offset - from), buf, size);
+    w->offset = from;
+    w->len = to - from;
+    w->writes++;
+    pthread_mutex_lock(&wbuf_lock);
+    wbuf_stats.writes++;
+    pthread_mutex_unlock(&wbuf_lock);
+    return size;
+}
+
+// Write out the buffer of the file at path, or inode ino when path is NULL, in a
+// transaction of its own; a file removed meanwhile took its buffer with it
+static int write_out_target(const char *path, int ino)
+{
+    int rv;
+    int retried = 0;
+    do
+    {
+        txn_begin();
+        int i = lock_target(path, ino, 1);
+        if (i < 0)
+        {
+            txn_end();
+            return i == -ENOENT ? 0 : i;
+        }
+
+        rv = write_out(i);
+        unlock_inode(i);
+        txn_end();
+    } while (rv == -ENOSPC && retried++ < ALLOC_RETRIES && should_retry_alloc());
+    return rv;
+}
+
+// Write out every buffer there is as this starts, for fsync and unmount
+// Return 0, or the first error
+static int write_out_all()
+{
+    pthread_mutex_lock(&wbuf_lock);
+    int n = 0;
+    for (wbuf_t *w = wbuf_oldest; w != NULL; w = w->next)
+    {
+        n++;
+    }
+    int *inos = n > 0 ? malloc(n * sizeof(int)) : NULL;
+    n = 0;
+    for (wbuf_t *w = wbuf_oldest; inos != NULL && w != NULL; w = w->next)
+    {
+        inos[n++] = w->ino;
+    }
+    int rv = wbuf_oldest != NULL && inos == NULL ? -ENOMEM : 0;
+    pthread_mutex_unlock(&wbuf_lock);
+
+    for (int k = 0; k < n; k++)
+    {
+        int err = write_out_target(NULL, inos[k]);
+        rv = rv < 0 ? rv : err;
+    }
+    free(inos);
+    return rv;
+}
+
+// While the buffers hold more than their budget, write out the oldest
+// Called outside any transaction and inode lock
+static void reclaim_buffers()
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&wbuf_lock);
+        int ino = wbuf_bytes > wbuf_budget && wbuf_oldest != NULL ? wbuf_oldest->ino : 0;
+        pthread_mutex_unlock(&wbuf_lock);
+        if (ino == 0 || write_out_target(NULL, ino) < 0)
+        {
+            return;
+        }
+        pthread_mutex_lock(&wbuf_lock);
+        wbuf_stats.reclaims++;
+        pthread_mutex_unlock(&wbuf_lock);
+    }
+}
+
+// Write to the file at path, or inode ino when path is NULL
+static int write_target(const char *path, int ino, const char *buf, size_t size, off_t offset)
+{
+    int rv;
+    int retried = 0;
+    do
+    {
+        txn_begin();
+        int i = lock_target(path, ino, 1);
+        if (i < 0)
+        {
+            txn_end();
+            return i;
+        }
+
+        rv = wbuf_budget > 0 ? buffer_write(i, buf, size, offset) : write_inode(i, buf, size, offset);
+        data_changed(i);
+        unlock_inode(i);
+        txn_end();
+    } while (rv == -ENOSPC && retried++ < ALLOC_RETRIES && should_retry_alloc());
+
+    if (rv > 0)
+    {
+        int err = end_operation();
+        rv = err < 0 ? err : rv;
+    }
+    if (wbuf_budget > 0)
+    {
+        reclaim_buffers();
+    }
+    return rv;
+}
+
+// Takes a path, a buffer, a size, a offsset
+//  Write size byte of content from buffer to the file of the path
+//  Start from the offset byte
+int storage_write(const char *path, const char *buf, size_t size, off_t offset)
+{
+    return write_target(path, 0, buf, size, offset);
+}
+
+// Called as a file is closed: write out its buffered writes, and with DURABILITY_FSYNC
+// make what changed so far durable, the other modes already did or will on their own
+static int flush_target(const char *path, int ino)
+{
+    pthread_mutex_lock(&wbuf_lock);
+    int buffered = wbuf_oldest != NULL;
+    pthread_mutex_unlock(&wbuf_lock);
+
+    int rv = buffered ? write_out_target(path, ino) : 0;
+    if (rv == 0 && storage_opts.durability == DURABILITY_FSYNC)
+    {
+        rv = sync_changes();
+    }
+    return rv;
+}
+
+int storage_flush(const char *path)
+{
+    return flush_target(path, 0);
+}
+
+// Data and indirect blocks held by inode i, none for an inline file
+static int count_blocks(int i)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    int blocks = inode_at(i)->indirect != 0;
+    for (int k = 0; k < n; k++)
+    {
+        blocks += ext[k].length;
+    }
+    return blocks;
+}
+
+// Attributes of the file at path, or inode ino when path is NULL
+static int stat_target(const char *path, int ino, struct stat *st)
+{
+    int i = lock_target(path, ino, 0);
+    if (i < 0)
+    {
+        return i;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = i;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mode = inode_at(i)->mode;
+    st->st_nlink = inode_at(i)->nlink;
+    st->st_size = file_size(i);
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = (blkcnt_t)count_blocks(i) * (BLOCK_SIZE / 512);
+    unlock_inode(i);
+    return 0;
+}
+
+int storage_stat(const char *path, struct stat *st)
+{
+    return stat_target(path, 0, st);
+}
+
+// Block and inode usage for df, files kept inline cost no blocks at all
+int storage_statfs(struct statvfs *st)
+{
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_namemax = MAX_NAME_LEN;
+
+    pthread_mutex_lock(&alloc_lock);
+    st->f_blocks = sb.total_blocks - sb.data_start;
+    st->f_bfree = sb.free_blocks;
+    pthread_mutex_unlock(&alloc_lock);
+    st->f_bavail = st->f_bfree;
+
+    pthread_rwlock_rdlock(&ns_lock);
+    st->f_files = sb.inode_count - ROOT_INO;
+    st->f_ffree = free_inodes;
+    pthread_rwlock_unlock(&ns_lock);
+    st->f_favail = st->f_ffree;
+    return 0;
+}
+
+// Change the permissions of the file at path, or inode ino when path is NULL
+// The file type stays what it is, whatever type bits mode carries
+static int chmod_target(const char *path, int ino, mode_t mode)
+{
+    txn_begin();
+    int i = lock_target(path, ino, 1);
+    if (i < 0)
+    {
+        txn_end();
+        return i;
+    }
+
+    inode_at(i)->mode = (inode_at(i)->mode & S_IFMT) | (mode & ~S_IFMT);
+    mark_inode_dirty(i);
+    unlock_inode(i);
+    txn_end();
+
+    return end_operation();
+}
+
+int storage_chmod(const char *path, mode_t mode)
+{
+    return chmod_target(path, 0, mode);
+}
+
+int storage_unlink(const char *path)
+{
+    return remove_path(path, 0);
+}
+
+// Store cluster c of inode i as it is again, keeping its first keep bytes and leaving
+// the rest a hole, so code working block by block can take it apart; a cluster not
+// compressed is left alone
+// Called with the lock held exclusive, the list is stored: callers load it afterwards
+// Return 0, or -ENOSPC / -EFBIG / -EIO
+static int expand_cluster(int i, int c, off_t keep)
+{
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+    uint32_t clen = cluster_length(ext, n, c);
+    off_t begin = (off_t)c * COMPRESS_CLUSTER_SIZE;
+    off_t live = inode_at(i)->size - begin < COMPRESS_CLUSTER_SIZE ? inode_at(i)->size - begin : COMPRESS_CLUSTER_SIZE;
+    if (clen == 0 || live <= 0)
+    {
+        return 0;
+    }
+
+    char *data = malloc(2 * COMPRESS_CLUSTER_SIZE);
+    int rv = load_cluster(ext, n, c, clen, data, data + COMPRESS_CLUSTER_SIZE);
+    if (rv == 0)
+    {
+        keep = keep < live ? keep : live;
+        memset(data + keep, 0, live - keep);
+        int nblocks = (live + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int kept = (keep + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        plan_t plan;
+        plan_init(&plan, nblocks);
+        for (int k = 0; k < nblocks; k++)
+        {
+            plan.how[k] = k < kept ? PLAN_FRESH : PLAN_HOLE;
+        }
+        rv = write_extents(i, data, live, begin, &plan);
+        plan_free(&plan);
+    }
+    free(data);
+    return rv < 0 ? rv : 0;
+}
+
+// Truncate inode i, with its lock held exclusive
+static int truncate_inode(int i, off_t size)
+{
+    if (S_ISDIR(inode_at(i)->mode))
+    {
+        return -EISDIR;
+    }
+    if (size > block_offset(sb.total_blocks))
+    {
+        return -EFBIG;
+    }
+
+    if (inode_at(i)->flags & INODE_INLINE)
+    {
+        if (size <= inline_capacity())
+        {
+            // Keep the bytes past the end zero, a later extension reads them back as such
+            if (size < inode_at(i)->size)
+            {
+                memset(inline_data(i) + size, 0, inode_at(i)->size - size);
+            }
+            inode_at(i)->size = size;
+            mark_inode_dirty(i);
+            return 0;
+        }
+        int rv = promote_inline(i);
+        if (rv < 0)
+        {
+            return rv;
+        }
+    }
+
+    // Growing leaves a hole that reads back as zeros, shrinking releases the blocks past the end
+    if (size < inode_at(i)->size)
+    {
+        // What a compressed cluster cut through keeps is no longer what it holds
+        if ((inode_at(i)->flags & INODE_COMPRESSED) && size % COMPRESS_CLUSTER_SIZE != 0)
+        {
+            int rv = expand_cluster(i, size / COMPRESS_CLUSTER_SIZE, size % COMPRESS_CLUSTER_SIZE);
+            if (rv < 0)
+            {
+                return rv;
+            }
+        }
+
+        extent_t ext[EXTENT_SCRATCH];
+        int n = load_extents(i, ext);
+        if (n < 0)
+        {
+            return n;
+        }
+
+        int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (n > 0)
+        {
+            n = punch_extents(ext, n, keep, ext[n - 1].logical + ext[n - 1].length);
+        }
+
+        // Bytes past the end of a file always read as zero, clear the tail of the last block
+        int old = -1;
+        int copy = -1;
+        int rv = 0;
+        if (size % BLOCK_SIZE != 0)
+        {
+            rv = n = unshare_block(ext, n, size / BLOCK_SIZE, &old, &copy);
+        }
+        if (rv >= 0)
+        {
+            zero_block_range(ext, n, size / BLOCK_SIZE, size % BLOCK_SIZE, BLOCK_SIZE);
+            rv = store_extents(i, ext, n);
+        }
+        if (rv < 0)
+        {
+            if (copy >= 0)
+            {
+                unallocate_run(copy, 1);
+            }
+            return rv;
+        }
+        if (old >= 0)
+        {
+            free_run(old, 1);
+        }
+    }
+    if (size == 0)
+    {
+        inode_at(i)->flags &= ~INODE_COMPRESSED;
+    }
+    inode_at(i)->size = size;
+    mark_inode_dirty(i);
+    return 0;
+}
+
+// Deallocate the bytes [offset, offset + len) of inode i, with its lock held exclusive
+// Whole blocks go back to the allocator and become a hole, the partial blocks at
+// either end are zeroed in place; the size never changes
+static int punch_inode(int i, off_t offset, off_t len)
+{
+    // Nothing can be mapped past the end of the image
+    off_t room = block_offset(sb.total_blocks) - offset;
+    if (room <= 0)
+    {
+        return 0;
+    }
+    off_t end = offset + (len < room ? len : room);
+
+    if (inode_at(i)->flags & INODE_INLINE)
+    {
+        if (offset < inode_at(i)->size)
+        {
+            off_t to = end < inode_at(i)->size ? end : inode_at(i)->size;
+            memset(inline_data(i) + offset, 0, to - offset);
+            mark_inode_dirty(i);
+        }
+        return 0;
+    }
+
+    // A compressed cluster the range covers only in part (up to the end of the file) is
+    // stored as it is first, one it covers goes with its blocks
+    int edge_clusters[2] = {offset / COMPRESS_CLUSTER_SIZE, (end - 1) / COMPRESS_CLUSTER_SIZE};
+    for (int k = 0; k < 2 && (inode_at(i)->flags & INODE_COMPRESSED); k++)
+    {
+        off_t begin = (off_t)edge_clusters[k] * COMPRESS_CLUSTER_SIZE;
+        off_t live_end = begin + COMPRESS_CLUSTER_SIZE < inode_at(i)->size ? begin + COMPRESS_CLUSTER_SIZE : inode_at(i)->size;
+        if (offset > begin || end < live_end)
+        {
+            int rv = expand_cluster(i, edge_clusters[k], COMPRESS_CLUSTER_SIZE);
+            if (rv < 0)
+            {
+                return rv;
+            }
+        }
+    }
+
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    // The partial blocks at either end, zeroed in place once they are this file's own
+    int from = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int to = end / BLOCK_SIZE;
+    int edge[2] = {-1, -1};
+    int edge_from[2];
+    int edge_to[2];
+    if (from > to)
+    {
+        // Inside a single block
+        edge[0] = to;
+        edge_from[0] = offset % BLOCK_SIZE;
+        edge_to[0] = end % BLOCK_SIZE;
+    }
+    else
+    {
+        if (offset % BLOCK_SIZE != 0)
+        {
+            edge[0] = from - 1;
+            edge_from[0] = offset % BLOCK_SIZE;
+            edge_to[0] = BLOCK_SIZE;
+        }
+        if (end % BLOCK_SIZE != 0)
+        {
+            edge[1] = to;
+            edge_from[1] = 0;
+            edge_to[1] = end % BLOCK_SIZE;
+        }
+    }
+
+    int old[2] = {-1, -1};
+    int copy[2] = {-1, -1};
+    int rv = 0;
+    for (int k = 0; k < 2 && rv >= 0; k++)
+    {
+        if (edge[k] >= 0)
+        {
+            rv = n = unshare_block(ext, n, edge[k], &old[k], &copy[k]);
+        }
+        if (rv >= 0 && edge[k] >= 0)
+        {
+            rv = zero_block_range(ext, n, edge[k], edge_from[k], edge_to[k]);
+        }
+    }
+    if (rv >= 0 && from < to)
+    {
+        n = punch_extents(ext, n, from, to);
+    }
+    if (rv >= 0 && (from < to || copy[0] >= 0 || copy[1] >= 0))
+    {
+        rv = store_extents(i, ext, n);
+    }
+    rv = rv < 0 ? rv : 0;
+    for (int k = 0; k < 2; k++)
+    {
+        if (rv < 0 && copy[k] >= 0)
+        {
+            unallocate_run(copy[k], 1);
+        }
+        if (rv == 0 && old[k] >= 0)
+        {
+            free_run(old[k], 1);
+        }
+    }
+    return rv;
+}
+
+// fallocate on inode i, with its lock held exclusive
+// Preallocation maps every hole in the range to blocks as contiguous as the allocator
+// finds them, and zeroes them, so they read back like the hole did; with
+// FALLOC_FL_KEEP_SIZE the blocks may lie past the end of the file
+// Return 0, or -EOPNOTSUPP for any other mode, -ENOSPC / -EFBIG / -EIO
+static int fallocate_inode(int i, int mode, off_t offset, off_t len)
+{
+    if (S_ISDIR(inode_at(i)->mode))
+    {
+        return -EISDIR;
+    }
+    if (offset < 0 || len <= 0)
+    {
+        return -EINVAL;
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    {
+        return -EOPNOTSUPP;
+    }
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+    {
+        // Same as Linux: a punched hole never changes the size
+        return (mode & FALLOC_FL_KEEP_SIZE) ? punch_inode(i, offset, len) : -EOPNOTSUPP;
+    }
+    if (len > block_offset(sb.total_blocks) - offset)
+    {
+        return -EFBIG;
+    }
+
+    off_t end = offset + len;
+    int keep_size = mode & FALLOC_FL_KEEP_SIZE;
+    if (inode_at(i)->flags & INODE_INLINE)
+    {
+        // The inode already holds room for the range
+        if (end <= inline_capacity())
+        {
+            if (!keep_size && end > inode_at(i)->size)
+            {
+                inode_at(i)->size = end;
+                mark_inode_dirty(i);
+            }
+            return 0;
+        }
+        int rv = promote_inline(i);
+        if (rv < 0)
+        {
+            return rv;
+        }
+    }
+
+    // Blocks filled into a compressed cluster would land in the middle of it: the
+    // clusters of the range below the end of the file are stored as they are first
+    for (off_t pos = offset; (inode_at(i)->flags & INODE_COMPRESSED) && pos < end && pos < inode_at(i)->size;
+         pos = (pos / COMPRESS_CLUSTER_SIZE + 1) * COMPRESS_CLUSTER_SIZE)
+    {
+        int rv = expand_cluster(i, pos / COMPRESS_CLUSTER_SIZE, COMPRESS_CLUSTER_SIZE);
+        if (rv < 0)
+        {
+            return rv;
+        }
+    }
+
+    extent_t ext[EXTENT_SCRATCH];
+    int n = load_extents(i, ext);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    int first = offset / BLOCK_SIZE;
+    int last = (end - 1) / BLOCK_SIZE;
+    extent_t *fresh = malloc((last - first + 1) * sizeof(extent_t));
+    int nfresh = 0;
+    int rv = fill_extents(ext, n, first, last + 1, fresh, &nfresh);
+    if (rv >= 0)
+    {
+        n = rv;
+        rv = n > MAX_EXTENTS ? -EFBIG : 0;
+    }
+    for (int k = 0; k < nfresh && rv == 0; k++)
+    {
+        rv = zero_run(fresh[k].start, fresh[k].length);
+    }
+    if (rv == 0)
+    {
+        rv = store_extents(i, ext, n);
+    }
+    if (rv < 0)
+    {
+        for (int k = 0; k < nfresh; k++)
+        {
+            unallocate_run(fresh[k].start, fresh[k].length);
+        }
+        free(fresh);
+        TRACE("fallocate of inode %d failed: %d\n", i, rv);
+        return rv;
+    }
+    free(fresh);
+
+    if (!keep_size && end > inode_at(i)->size)
+    {
+        inode_at(i)->size = end;
+        mark_inode_dirty(i);
+    }
+    return 0;
+}
+
+// fallocate on the file at path, or inode ino when path is NULL
+static int fallocate_target(const char *path, int ino, int mode, off_t offset, off_t len)
+{
+    int rv;
+    int retried = 0;
+    do
+    {
+        txn_begin();
+        int i = lock_target(path, ino, 1);
+        if (i < 0)
+        {
+            txn_end();
+            return i;
+        }
+
+        rv = write_out(i);
+        if (rv == 0)
+        {
+            rv = fallocate_inode(i, mode, offset, len);
+        }
+        data_changed(i);
+        unlock_inode(i);
+        txn_end();
+    } while (rv == -ENOSPC && retried++ < ALLOC_RETRIES && should_retry_alloc());
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+int storage_fallocate(const char *path, int mode, off_t offset, off_t len)
+{
+    return fallocate_target(path, 0, mode, offset, len);
+}
+
+#define COPY_BYTES_MAX (1 << 20)                                        // Most bytes copied in one transaction
+#define COPY_SHARE_MAX ((off_t)(INT_MAX / BLOCK_SIZE) * BLOCK_SIZE) // Most bytes shared in one transaction
+
+// Copy len bytes from inode si at soff to inode di at doff, through read_inode and write_inode
+// Return the bytes copied, or -errno
+static int copy_bytes(int si, int di, off_t soff, off_t doff, int len)
+{
+    char *buf = malloc(len > 0 ? len : 1);
+    int rv = read_inode(si, buf, len, soff);
+    if (rv > 0)
+    {
+        rv = write_inode(di, buf, rv, doff);
+    }
+    free(buf);
+    return rv;
+}
+
+// Map the nblk blocks of inode si from logical block sblk on into inode di at dblk,
+// sharing the disk blocks instead of copying them; whatever di mapped there is released
+// Return 0, or -EMLINK / -EFBIG / -ENOSPC / -EIO
+static int share_blocks(int si, int di, int sblk, int dblk, int nblk)
+{
+    extent_t src[EXTENT_SCRATCH];
+    int n = load_extents(si, src);
+    if (n < 0)
+    {
+        return n;
+    }
+
+    // The source's runs inside the range, placed where they go in di
+    extent_t pieces[EXTENT_SCRATCH];
+    int npieces = 0;
+    for (int k = 0; k < n; k++)
+    {
+        int lo = src[k].logical > sblk ? src[k].logical : sblk;
+        int hi = src[k].logical + src[k].length < sblk + nblk ? src[k].logical + src[k].length : sblk + nblk;
+        if (lo < hi)
+        {
+            pieces[npieces++] = (extent_t){lo - sblk + dblk, src[k].start + (lo - src[k].logical), hi - lo};
+        }
+    }
+
+    int taken = 0;
+    int rv = 0;
+    while (taken < npieces && (rv = take_shares(pieces[taken].start, pieces[taken].length)) == 0)
+    {
+        taken++;
+    }
+
+    extent_t ext[EXTENT_SCRATCH];
+    extent_t cut[EXTENT_SCRATCH];
+    int ncut = 0;
+    if (rv == 0)
+    {
+        rv = load_extents(di, ext);
+    }
+    if (rv >= 0)
+    {
+        rv = cut_extents(ext, rv, dblk, dblk + nblk, 0, cut, &ncut);
+    }
+    if (rv >= 0)
+    {
+        n = rv;
+        rv = n + npieces > EXTENT_SCRATCH ? -EFBIG : 0;
+    }
+    if (rv == 0)
+    {
+        memcpy(ext + n, pieces, npieces * sizeof(extent_t));
+        qsort(ext, n + npieces, sizeof(extent_t), compare_logical);
+        n = compact_extents(ext, n + npieces);
+        rv = store_extents(di, ext, n);
+    }
+    if (rv < 0)
+    {
+        for (int k = 0; k < taken; k++)
+        {
+            drop_shares(pieces[k].start, pieces[k].length);
+        }
+        return rv;
+    }
+    for (int k = 0; k < ncut; k++)
+    {
+        free_run(cut[k].start, cut[k].length);
+    }
+    return 0;
+}
+
+// Copy up to len bytes from inode si at soff to inode di at doff, with both locked exclusive
+// Whole blocks at the same place within a block are shared, the rest is copied; one
+// call shares at most COPY_SHARE_MAX bytes or copies at most COPY_BYTES_MAX
+// Return the bytes copied, 0 at the end of the source, or -errno
+static int copy_inode(int si, int di, off_t soff, off_t doff, off_t len)
+{
+    if (S_ISDIR(inode_at(si)->mode) || S_ISDIR(inode_at(di)->mode))
+    {
+        return -EISDIR;
+    }
+    if (soff < 0 || doff < 0 || len < 0)
+    {
+        return -EINVAL;
+    }
+    off_t size = inode_at(si)->size;
+    if (soff >= size || len == 0)
+    {
+        return 0;
+    }
+    len = len < size - soff ? len : size - soff;
+    if (doff > block_offset(sb.total_blocks) - len)
+    {
+        return -EFBIG;
+    }
+    if (si == di && soff < doff + len && doff < soff + len)
+    {
+        return -EINVAL;
+    }
+
+    // The blocks of a compressed cluster only make sense where they are, such a file
+    // copies its bytes, even into a file that has some
+    if ((inode_at(si)->flags & (INODE_INLINE | INODE_COMPRESSED)) || (inode_at(di)->flags & INODE_COMPRESSED) ||
+        soff % BLOCK_SIZE != doff % BLOCK_SIZE)
+    {
+        return copy_bytes(si, di, soff, doff, len < COPY_BYTES_MAX ? len : COPY_BYTES_MAX);
+    }
+
+    len = len < COPY_SHARE_MAX ? len : COPY_SHARE_MAX;
+    off_t head = (BLOCK_SIZE - soff % BLOCK_SIZE) % BLOCK_SIZE;
+    head = head < len ? head : len;
+    off_t body = (len - head) / BLOCK_SIZE * BLOCK_SIZE;
+    // The source's partial last block goes whole if nothing of the destination follows
+    // it: past the end, the block reads as zeros for both files
+    if (soff + len == size && doff + len >= inode_at(di)->size)
+    {
+        body = len - head;
+    }
+    off_t tail = len - head - body;
+
+    int rv = head > 0 ? copy_bytes(si, di, soff, doff, head) : 0;
+    if (rv >= 0 && body > 0 && (inode_at(di)->flags & INODE_INLINE))
+    {
+        rv = promote_inline(di);
+    }
+    if (rv >= 0 && body > 0)
+    {
+        rv = share_blocks(si, di, (soff + head) / BLOCK_SIZE, (doff + head) / BLOCK_SIZE,
+                          (body + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+    if (rv >= 0 && body > 0 && doff + head + body > inode_at(di)->size)
+    {
+        inode_at(di)->size = doff + head + body;
+        mark_inode_dirty(di);
+    }
+    if (rv >= 0 && tail > 0)
+    {
+        rv = copy_bytes(si, di, soff + head + body, doff + head + body, tail);
+    }
+    return rv < 0 ? rv : len;
+}
+
+// Lock the files a copy goes between, by path or by number, both exclusive
+// Return 0 with *si and *di set, or -ENOENT
+static int lock_copy_targets(const char *from, int from_ino, const char *to, int to_ino, int *si, int *di, lockset_t *set)
+{
+    if (from != NULL)
+    {
+        pthread_rwlock_rdlock(&ns_lock);
+        from_ino = find_inode(from);
+        to_ino = find_inode(to);
+        if (from_ino >= 0 && to_ino >= 0)
+        {
+            int inos[2] = {from_ino, to_ino};
+            lock_inodes(set, inos, 2);
+        }
+        pthread_rwlock_unlock(&ns_lock);
+        if (from_ino < 0 || to_ino < 0)
+        {
+            return from_ino < 0 ? from_ino : to_ino;
+        }
+    }
+    else
+    {
+        if (from_ino < ROOT_INO || from_ino >= sb.inode_count || to_ino < ROOT_INO || to_ino >= sb.inode_count)
+        {
+            return -ENOENT;
+        }
+        int inos[2] = {from_ino, to_ino};
+        lock_inodes(set, inos, 2);
+        if (inode_at(from_ino)->mode == 0 || inode_at(to_ino)->mode == 0)
+        {
+            unlock_inodes(set);
+            return -ENOENT;
+        }
+    }
+    *si = from_ino;
+    *di = to_ino;
+    return 0;
+}
+
+// Copy len bytes between the files at from and to, or inodes from_ino and to_ino when
+// the paths are NULL, one transaction per step of copy_inode
+static off_t copy_target(const char *from, int from_ino, off_t from_offset,
+                         const char *to, int to_ino, off_t to_offset, off_t len)
+{
+    off_t done = 0;
+    int rv = len < 0 ? -EINVAL : 0;
+    while (rv == 0 && done < len)
+    {
+        int retried = 0;
+        do
+        {
+            txn_begin();
+            lockset_t set;
+            int si = -1;
+            int di = -1;
+            rv = lock_copy_targets(from, from_ino, to, to_ino, &si, &di, &set);
+            if (rv == 0)
+            {
+                rv = write_out(si);
+                if (rv == 0)
+                {
+                    rv = write_out(di);
+                }
+                if (rv == 0)
+                {
+                    rv = copy_inode(si, di, from_offset + done, to_offset + done, len - done);
+                }
+                data_changed(di);
+                unlock_inodes(&set);
+            }
+            txn_end();
+        } while (rv == -ENOSPC && retried++ < ALLOC_RETRIES && should_retry_alloc());
+
+        if (rv > 0)
+        {
+            done += rv;
+            rv = 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (done > 0)
+    {
+        int err = end_operation();
+        return err < 0 ? err : done;
+    }
+    return rv;
+}
+
+// Copy len bytes of the file at from, starting at from_offset, into the file at to at
+// to_offset, like copy_file_range; blocks are shared rather than copied wherever the
+// offsets are equal within a block, a write to either file later gives it its own copy
+// Return the bytes copied, short only at the end of the source or on an error, or -errno
+off_t storage_copy_range(const char *from, off_t from_offset, const char *to, off_t to_offset, off_t len)
+{
+    return copy_target(from, 0, from_offset, to, 0, to_offset, len);
+}
+
+// Truncate the file at path, or inode ino when path is NULL
+static int truncate_target(const char *path, int ino, off_t size)
+{
+    int rv;
+    int retried = 0;
+    do
+    {
+        txn_begin();
+        int i = lock_target(path, ino, 1);
+        if (i < 0)
+        {
+            txn_end();
+            return i;
+        }
+
+        trim_buffer(i, size);
+        rv = write_out(i);
+        if (rv == 0)
+        {
+            rv = truncate_inode(i, size);
+        }
+        data_changed(i);
+        unlock_inode(i);
+        txn_end();
+    } while (rv == -ENOSPC && retried++ < ALLOC_RETRIES && should_retry_alloc());
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+int storage_truncate(const char *path, off_t size)
+{
+    return truncate_target(path, 0, size);
+}
+
+// Check if the given path exists, if so, return the inode index of that path
+// If not, return -errno
+int storage_lookup(const char *path)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int i = find_inode(path);
+    pthread_rwlock_unlock(&ns_lock);
+    return i;
+}
+
+// Takes a path of a directory, and add the name of every entry in it to the buffer
+// Only that directory's slots are visited
+void storage_list(const char *path, void *buf, fuse_fill_dir_t filler)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int i = find_inode(path);
+    dir_t *d = i >= 0 ? dirs[i] : NULL;
+    for (int slot = 0; d != NULL && slot < d->nslots; slot++)
+    {
+        if (d->slots[slot] != NULL && filler(buf, d->slots[slot]->name, NULL, 0) != 0)
+        {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ns_lock);
+}
+
+// Takes a path of a firectory, and check if that dir is empty
+// If not, return 0, if so, return 1
+int storage_is_dir_empty(const char *path)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int i = find_inode(path);
+    int empty = i < 0 || dirs[i] == NULL || dir_entries(dirs[i]) == 0;
+    pthread_rwlock_unlock(&ns_lock);
+    return empty;
+}
+
+// The inode-number interface, for the low-level frontend
+// Files are named by inode number and entries by (directory inode, name), so no call
+// parses a path; the root is ROOT_INO
+// Every inode handed out by storage_ino_lookup or storage_ino_create counts one
+// reference the kernel holds, until storage_ino_forget drops it. A removed inode keeps
+// its number out of reuse while referenced, so a late request for it fails with -ENOENT
+// instead of reaching whatever file was created next
+
+// Look up name in directory dir, and take a reference on the inode it names
+// Return the inode, or -ENOENT / -ENAMETOOLONG
+int storage_ino_lookup(int dir, const char *name)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int rv = check_dir(dir);
+    if (rv == 0)
+    {
+        rv = check_name(name);
+    }
+    if (rv == 0)
+    {
+        dentry_t *e = dcache_find(dir, name, strlen(name));
+        rv = e != NULL ? (int)e->ino : -ENOENT;
+    }
+    if (rv > 0)
+    {
+        __atomic_fetch_add(&kernel_refs[rv], 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return rv;
+}
+
+// Resolve path and take a reference on its inode, as storage_ino_lookup does, for
+// a frontend that keeps working on the inode by number, such as an open directory
+// Return the inode, or the errors of resolve
+int storage_ino_open(const char *path)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int i = find_inode(path);
+    if (i > 0)
+    {
+        __atomic_fetch_add(&kernel_refs[i], 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    return i;
+}
+
+// Drop n of the references lookups and creates took on inode ino
+// A forget of more than were taken stops at 0, rather than wrapping around and keeping
+// the inode from ever being reused
+void storage_ino_forget(int ino, uint64_t n)
+{
+    if (ino < ROOT_INO || ino >= sb.inode_count)
+    {
+        return;
+    }
+    uint32_t refs = __atomic_load_n(&kernel_refs[ino], __ATOMIC_RELAXED);
+    uint32_t left;
+    do
+    {
+        left = n < refs ? refs - (uint32_t)n : 0;
+    } while (!__atomic_compare_exchange_n(&kernel_refs[ino], &refs, left, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (n > refs)
+    {
+        printf("inode %d: forget of %llu references, only %u were taken\n", ino, (unsigned long long)n, refs);
+    }
+}
+
+// Create name in directory dir, and take a reference on the new inode
+// Return the inode, or -errno
+int storage_ino_create(int dir, const char *name, mode_t mode)
+{
+    txn_begin();
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = check_dir(dir);
+    if (rv == 0)
+    {
+        rv = check_name(name);
+    }
+    if (rv == 0)
+    {
+        rv = create_entry(dir, name, mode);
+    }
+    if (rv > 0)
+    {
+        __atomic_fetch_add(&kernel_refs[rv], 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    txn_end();
+
+    if (rv > 0)
+    {
+        int err = end_operation();
+        if (err < 0)
+        {
+            // The kernel is not told about the inode, so it will not forget it either
+            __atomic_fetch_sub(&kernel_refs[rv], 1, __ATOMIC_RELAXED);
+            rv = err;
+        }
+    }
+    return rv;
+}
+
+static int ino_remove(int dir, const char *name, int rmdir)
+{
+    txn_begin();
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = check_dir(dir);
+    if (rv == 0)
+    {
+        rv = remove_entry(dir, name, rmdir);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    txn_end();
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+int storage_ino_unlink(int dir, const char *name)
+{
+    return ino_remove(dir, name, 0);
+}
+
+int storage_ino_rmdir(int dir, const char *name)
+{
+    return ino_remove(dir, name, 1);
+}
+
+// Move from_name of from_dir to to_name in to_dir, replacing whatever is there as rename(2) does
+int storage_ino_rename(int from_dir, const char *from_name, int to_dir, const char *to_name)
+{
+    txn_begin();
+    pthread_rwlock_wrlock(&ns_lock);
+    int rv = check_dir(from_dir);
+    if (rv == 0)
+    {
+        rv = check_dir(to_dir);
+    }
+    if (rv == 0)
+    {
+        rv = check_name(to_name);
+    }
+    if (rv == 0)
+    {
+        rv = rename_entry(from_dir, from_name, to_dir, to_name);
+    }
+    pthread_rwlock_unlock(&ns_lock);
+    txn_end();
+
+    if (rv == 0)
+    {
+        rv = end_operation();
+    }
+    return rv;
+}
+
+int storage_ino_stat(int ino, struct stat *st)
+{
+    return stat_target(NULL, ino, st);
+}
+
+int storage_ino_read(int ino, char *buf, size_t size, off_t offset, storage_file_t *f)
+{
+    return read_target(NULL, ino, buf, size, offset, f);
+}
+
+int storage_ino_write(int ino, const char *buf, size_t size, off_t offset)
+{
+    return write_target(NULL, ino, buf, size, offset);
+}
+
+int storage_ino_flush(int ino)
+{
+    return flush_target(NULL, ino);
+}
+
+int storage_ino_chmod(int ino, mode_t mode)
+{
+    return chmod_target(NULL, ino, mode);
+}
+
+int storage_ino_truncate(int ino, off_t size)
+{
+    return truncate_target(NULL, ino, size);
+}
+
+int storage_ino_fallocate(int ino, int mode, off_t offset, off_t len)
+{
+    return fallocate_target(NULL, ino, mode, offset, len);
+}
+
+off_t storage_ino_copy_range(int from, off_t from_offset, int to, off_t to_offset, off_t len)
+{
+    return copy_target(NULL, from, from_offset, NULL, to, to_offset, len);
+}
+
+// The attributes readdir hands out with each entry, those kept in the inode itself
+// Called with ns_lock held, which keeps inode i in use
+static void entry_stat(int i, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = i;
+    pthread_rwlock_rdlock(inode_lock(i));
+    st->st_mode = inode_at(i)->mode;
+    st->st_nlink = inode_at(i)->nlink;
+    st->st_size = file_size(i);
+    pthread_rwlock_unlock(inode_lock(i));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = BLOCK_SIZE;
+}
+
+// List directory dir from offset on, offsets being slot numbers: fn gets every entry
+// with its attributes and the offset to carry on from after it, until it returns nonzero
+// Slots never move, so a listing picked up again at an offset neither repeats nor
+// skips entries that stayed put
+// fn runs with the namespace lock held, and must not call back into this file
+// Return 0, or -ENOENT
+int storage_ino_readdir(int dir, off_t offset, storage_dirent_fn fn, void *ctx)
+{
+    pthread_rwlock_rdlock(&ns_lock);
+    int rv = check_dir(dir);
+    dir_t *d = rv == 0 ? dirs[dir] : NULL;
+    for (off_t slot = offset; d != NULL && slot < d->nslots; slot++)
+    {
+        dentry_t *e = d->slots[slot];
+        if (e == NULL)
+        {
+            continue;
+        }
+        struct stat st;
+        entry_stat(e->ino, &st);
+        if (fn(ctx, e->name, &st, slot + 1) != 0)
+        {
+            break;
         }
     }
-    printf("BreakPoint#YESRM\n");
-    return 1;
+    pthread_rwlock_unlock(&ns_lock);
+    return rv;
 }
@@ -7,54 +7,276 @@
 #include <fuse.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/statvfs.h>
 
 #define BLOCK_SIZE 4096
-#define MAX_FILES 128
 #define MAX_NAME 256
-#define TOTAL_BLOCKS 1024
 
-#define SUPER_BLOCK_START 0
-#define INODES_START 1
-#define DATA_START 18
-
-// Size:
-// 4 + 256 + 4 + 4 + 4 + 256 + 4 = 532 bytes
-// There are 128 files
-// total: 68136 bytes
-// 68136 / 4096 = 17 blocks
-typedef struct
-{
-    int is_used;
-    char name[MAX_NAME];
-    int size;
-    int block;
-    int ref_count;
-    char parent[MAX_NAME];
-    mode_t mode;
+#define NUFS_MAGIC 0x4e554653 // "NUFS"
+#define NUFS_VERSION 10        // Bumped on every change of the on-disk layout
+
+// Geometry storage_format picks for whatever it is not given
+#define DEFAULT_BLOCKS 1024          // 4 MiB
+#define DEFAULT_BYTES_PER_INODE 32768 // One inode for every 32 KiB of the image
+#define DEFAULT_INODE_SIZE 256        // Leaves 224 bytes for inline file contents
+#define MIN_JOURNAL_BLOCKS 64
+#define MAX_JOURNAL_BLOCKS 8192
+#define DEFAULT_WRITEBACK_MS 1000     // Flusher period of DURABILITY_PERIODIC
+
+// A run of length blocks, starting at disk block start, holding the file's
+// blocks logical .. logical + length - 1
+// Size: 4 + 4 + 4 = 12 bytes
+typedef struct
+{
+    int logical;
+    int start;
+    int length;
+} extent_t;
+
+// The first INODE_EXTENTS extents live in the inode itself,
+// the rest spill over into one indirect extent block
+#define INODE_EXTENTS 8
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(extent_t))
+#define MAX_EXTENTS (INODE_EXTENTS + EXTENTS_PER_BLOCK)
+#define EXTENT_SCRATCH (MAX_EXTENTS * 2) // Room for a list while it is being edited
+
+// Inode 0 is never handed out, a directory entry naming inode 0 is a free slot
+#define ROOT_INO 1
+
+#define INODE_INLINE 0x1     // inode_t.flags: the contents live in the inode, not in data blocks
+#define INODE_COMPRESSED 0x2 // inode_t.flags: some cluster of the file was stored compressed
+
+// With compression, a file's blocks are grouped in aligned clusters of COMPRESS_CLUSTER_BLOCKS,
+// as much as one FUSE write carries; a cluster whose bytes (up to the end of the file)
+// compress into fewer blocks is stored in just those, mapped at its first logical blocks,
+// with the rest of the cluster left a hole; the length table tells such a cluster apart
+// from one stored as it is
+#define COMPRESS_CLUSTER_BLOCKS 32
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+#define COMPRESSED_MORE UINT32_MAX // Length table entry of the blocks of a compressed cluster past its first
+
+// Size: 4 + 4 + 8 + 4 + 4 + 4 + 4 + 8 * 12 = 128 bytes
+// The inode table holds sb.inode_count records of sb.inode_size bytes each,
+// a power of two from sizeof(inode_t) up to BLOCK_SIZE; whatever a record
+// has past the struct extends the inline area
+// Names live in the directories, an inode only knows its own contents
+typedef struct
+{
+    uint32_t mode;                    // File type and permissions, 0 while the inode is free
+    uint32_t nlink;                   // Directory entries naming the inode, plus the subdirectories' ".."
+    int64_t size;                     // For a directory, DIRENT_SIZE bytes per slot
+    int extent_count;                 // Number of extents in use, inline and indirect, 0 for an inline file
+    int indirect;                     // Block holding extents past INODE_EXTENTS, 0 if none
+    int parent;                       // For a directory, the directory holding it
+    uint32_t flags;                   // INODE_INLINE, INODE_COMPRESSED
+    union
+    {
+        extent_t extents[INODE_EXTENTS]; // Sorted by logical block
+        char data[INODE_EXTENTS * sizeof(extent_t)]; // With INODE_INLINE: the contents, zero past size,
+                                                      // running on to the end of the record
+    };
 } inode_t;
 
-// Size: 4 + 4 + 128 = 136 bytes
-// Takes the first block
+#define INODE_INLINE_OFFSET offsetof(inode_t, data)
+
+// A directory's data is an array of these slots, DIRENTS_PER_BLOCK to a block
+// Removing an entry leaves a free slot (ino 0), reused by a later entry
+// Size: 4 + 252 = 256 bytes
+#define DIRENT_SIZE 256
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / DIRENT_SIZE)
+#define MAX_NAME_LEN (DIRENT_SIZE - 5) // Longest name a slot holds with its terminating zero
+
 typedef struct
 {
-    int total_blocks;                    // The total availiable block number
-    int free_blocks;                     // The free block number
-    char block_bitmap[TOTAL_BLOCKS / 8]; // The bit map, contains total_block / 8 bytes, each has 8 bit, could represent all blocks
+    uint32_t ino;
+    char name[DIRENT_SIZE - 4];
+} dirent_t;
+
+#define SUPER_BLOCK_START 0
+
+// Size: 22 * 4 = 88 bytes
+// Takes the first block, and says where everything else is: the superblock, bitmap,
+// share table, hash table, length table, checksum table, inode table and journal come
+// first, in that order, then the data
+typedef struct
+{
+    int magic;          // NUFS_MAGIC, anything else is not an image of this layout
+    int version;        // NUFS_VERSION
+    int block_size;     // BLOCK_SIZE of the build that made the image
+    int total_blocks;   // The total availiable block number
+    int free_blocks;    // The free block number
+    int inode_count;    // Inodes in the inode table
+    int inode_size;     // Bytes per inode record
+    int bitmap_start;   // The block bitmap, one bit per block, scanned a 64-bit word at a time
+    int bitmap_blocks;
+    int shares_start;   // The share table, a uint16_t per block: how many files map it besides the first
+    int share_blocks;
+    int hashes_start;   // The hash table, a uint64_t per block: the hash of its contents while
+    int hash_blocks;    // the dedup index holds it, 0 otherwise (see dedup.h)
+    int lengths_start;  // The length table, a uint32_t per block: for the first block of a compressed
+    int length_blocks;  // cluster, the bytes of compressed data; COMPRESSED_MORE for its other blocks,
+                        // 0 for a block holding bytes as they are
+    int sums_start;     // The checksum table, a uint32_t per block: the CRC32C of a file data block
+    int sum_blocks;     // (never 0), 0 for a block without one (free, or directory and extent blocks)
+    int inodes_start;   // The inode table
+    int inode_blocks;
+    int journal_start;  // Write-ahead log of metadata changes, see journal.h
+    int journal_blocks;
+    int data_start;     // First block that can hold file data
 } superblock_t;
 
-void write_inodes_to_disk();
-void storage_init(const char *path);
+// When the changes an operation makes become durable, storage_options_t.durability
+typedef enum
+{
+    DURABILITY_SYNC,     // Before the operation returns
+    DURABILITY_FSYNC,    // On fsync, and as a file that changed is closed (storage_flush)
+    DURABILITY_PERIODIC, // Every writeback_ms, by a background flusher, and on fsync
+} storage_durability_t;
+
+// Mount-time tunables, filled in by the frontend before storage_init
+typedef struct
+{
+    int use_mmap;         // Map the whole image and serve reads/writes with memcpy instead of pread/pwrite
+    int use_uring;        // Submit image I/O through io_uring instead of pread/pwrite, where the kernel has it
+    int direct;           // Open the image O_DIRECT, the block cache being the only one (not with use_mmap)
+    int durability;       // A storage_durability_t, writeback_ms > 0 alone asks for DURABILITY_PERIODIC
+    int writeback_ms;     // Period of the flusher with DURABILITY_PERIODIC, 0 for DEFAULT_WRITEBACK_MS
+    int cache_kb;         // Memory budget of the block cache, 0 disables it
+    int cache_write_back; // Keep written blocks in the cache until the next commit, instead of writing them through
+    int buffer_kb;        // Memory budget of the write buffers, 0 writes straight to the blocks (not with DURABILITY_SYNC)
+    int readahead_kb;     // Most bytes read ahead at once for an open file read in order, 0 turns readahead off
+    int dedup;            // Share full blocks written with the contents of a block already stored, and leave zero blocks as holes
+    int compress;         // Store the clusters a write fills compressed, see COMPRESS_CLUSTER_BLOCKS
+    int compress_min;     // Percent of a cluster's blocks compression has to save, or the cluster is stored as it is
+    int scrub_kbps;       // Rate the scrub thread re-reads file data at to verify it, in KiB/s, 0 for no scrubbing
+} storage_options_t;
+
+// How much metadata I/O the operations have cost so far
+typedef struct
+{
+    long operations;      // Operations that changed metadata
+    long flushes;         // Checkpoints that wrote anything to the home locations
+    long bytes_written;   // Bytes of superblock, bitmap and inode table written home
+    long journal_commits; // Transactions written to the journal
+    long journal_bytes;   // Bytes written to the journal
+    long checkpoints;     // Times the journal was emptied
+} storage_meta_stats_t;
+
+// What deduplication found and cost so far, all zero unless storage_opts.dedup
+typedef struct
+{
+    long blocks;     // Full blocks written and hashed
+    long shared;     // Of those, stored by sharing a block that already held the same bytes
+    long zero;       // Of those, all zeros and left as holes
+    long collisions; // Candidates whose hash matched but whose bytes did not
+    long hash_ns;    // Time spent hashing
+    long verify_ns;  // Time spent comparing candidates byte for byte
+} storage_dedup_stats_t;
+
+// What compression did and cost so far
+typedef struct
+{
+    long clusters;      // Clusters written whole and compressed
+    long stored;        // Of those, stored compressed, the rest saved too little
+    long bytes_in;      // Bytes of the clusters stored compressed
+    long bytes_out;     // Bytes of the blocks they took
+    long compress_ns;   // Time spent compressing
+    long reads;         // Compressed clusters read back
+    long decompress_ns; // Time spent decompressing them
+} storage_compress_stats_t;
+
+// What checksum verification found and cost so far
+typedef struct
+{
+    long verified;         // Blocks verified as reads brought them in
+    long mismatches;       // Of those, blocks that did not match their checksum, failing the read
+    long verify_ns;        // Time spent summing blocks read
+    long scrubbed;         // Blocks the scrub thread verified
+    long scrub_mismatches; // Of those, blocks that did not match
+    long scrub_passes;     // Walks over the whole image the scrub thread finished
+} storage_checksum_stats_t;
+
+// What the write buffers absorbed so far, all zero unless writes are buffered
+typedef struct
+{
+    long writes;    // Writes absorbed into a buffer
+    long bypassed;  // Writes too large to buffer, written straight to their blocks
+    long writeouts; // Buffers written to their blocks, each as one write
+    long merged;    // Writes those buffers held, merged / writeouts writes per image write
+    long bytes;     // Bytes those buffers held
+    long reclaims;  // Of the writeouts, those forced by the memory budget
+} storage_wbuf_stats_t;
+
+// What readahead did so far, for the reads through an open file's state
+typedef struct
+{
+    long reads;        // Reads through the state of an open
+    long sequential;   // Of those, reads that carried on where the last one of the open ended
+    long hits;         // Of those, reads served from the windows read ahead
+    long hit_bytes;    // Bytes they returned
+    long windows;      // Windows read ahead
+    long window_bytes; // Bytes they held
+} storage_readahead_stats_t;
+
+// The state of an open file, see storage_file_open
+typedef struct storage_file storage_file_t;
+
+extern storage_options_t storage_opts;
+
+int storage_format(const char *path, int total_blocks, int inode_count, int inode_size, int journal_blocks);
+int storage_init(const char *path);
+void storage_close();
+int storage_fsync();
+int storage_flush(const char *path);
+void storage_get_meta_stats(storage_meta_stats_t *stats);
+void storage_get_dedup_stats(storage_dedup_stats_t *stats);
+void storage_get_compress_stats(storage_compress_stats_t *stats);
+void storage_get_checksum_stats(storage_checksum_stats_t *stats);
+void storage_get_wbuf_stats(storage_wbuf_stats_t *stats);
+void storage_get_readahead_stats(storage_readahead_stats_t *stats);
 int storage_create(const char *path, mode_t mode);
 int storage_delete(const char *path);
+int storage_rmdir(const char *path);
 int storage_rename(const char *from, const char *to);
-int storage_read(const char *path, char *buf, size_t size, off_t offset);
+storage_file_t *storage_file_open();
+void storage_file_release(storage_file_t *f);
+int storage_read(const char *path, char *buf, size_t size, off_t offset, storage_file_t *f);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_stat(const char *path, struct stat *st);
+int storage_statfs(struct statvfs *st);
 int storage_chmod(const char *path, mode_t mode);
 int storage_unlink(const char *path);
 int storage_truncate(const char *path, off_t size);
+int storage_fallocate(const char *path, int mode, off_t offset, off_t len);
+off_t storage_copy_range(const char *from, off_t from_offset, const char *to, off_t to_offset, off_t len);
 int storage_lookup(const char *path);
 void storage_list(const char *path, void *buf, fuse_fill_dir_t filler);
 int storage_is_dir_empty(const char *path);
+void storage_start_flusher();
+
+// Called by storage_ino_readdir for every entry: its name, its inode's attributes
+// (all but st_blocks) and the offset after it; a nonzero return ends the listing
+typedef int (*storage_dirent_fn)(void *ctx, const char *name, const struct stat *st, off_t next);
+
+// The same operations by inode number, for the low-level frontend (nufs_ll.c)
+// Lookup and create take a reference on the inode they return, forget drops them
+int storage_ino_lookup(int dir, const char *name);
+int storage_ino_open(const char *path);
+void storage_ino_forget(int ino, uint64_t n);
+int storage_ino_create(int dir, const char *name, mode_t mode);
+int storage_ino_unlink(int dir, const char *name);
+int storage_ino_rmdir(int dir, const char *name);
+int storage_ino_rename(int from_dir, const char *from_name, int to_dir, const char *to_name);
+int storage_ino_stat(int ino, struct stat *st);
+int storage_ino_read(int ino, char *buf, size_t size, off_t offset, storage_file_t *f);
+int storage_ino_write(int ino, const char *buf, size_t size, off_t offset);
+int storage_ino_flush(int ino);
+int storage_ino_chmod(int ino, mode_t mode);
+int storage_ino_truncate(int ino, off_t size);
+int storage_ino_fallocate(int ino, int mode, off_t offset, off_t len);
+off_t storage_ino_copy_range(int from, off_t from_offset, int to, off_t to_offset, off_t len);
+int storage_ino_readdir(int dir, off_t offset, storage_dirent_fn fn, void *ctx);
 
 #endif // STORAGE_H
@@ -0,0 +1,21 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// Debug tracing, compiled out unless built with -DNUFS_TRACE (make TRACE=1)
+// The arguments are still type-checked in a normal build, but never evaluated
+#ifdef NUFS_TRACE
+#define TRACE(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TRACE(...)                        \
+    do                                    \
+    {                                     \
+        if (0)                            \
+        {                                 \
+            fprintf(stderr, __VA_ARGS__); \
+        }                                 \
+    } while (0)
+#endif
+
+#endif // TRACE_H
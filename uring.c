@@ -0,0 +1,428 @@
+#include "uring.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifndef HAVE_IO_URING
+
+// Built without the kernel's io_uring header: there is never a ring, callers fall back
+int uring_init(int fd)
+{
+    return -ENOSYS;
+}
+
+void uring_shutdown()
+{
+}
+
+void uring_register_buffers(void *base, size_t size)
+{
+}
+
+int uring_run(uring_op_t *ops, int n)
+{
+    return -ENOSYS;
+}
+
+#else
+
+#define MAX_RINGS 64 // Threads with a ring at once, any more use positioned I/O
+
+typedef struct
+{
+    int fd;               // Ring descriptor, -1 when the slot is free
+    unsigned gen;         // Bumped whenever the slot's ring is torn down
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;         // The same as sq_map when the kernel maps both rings at once
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned buffers_gen; // Registration it holds, see uring_register_buffers
+    int fixed;            // Whether it holds one
+} ring_t;
+
+// Locking: rings_lock guards the slots, and the buffers to register
+// A ring is only used by the thread that set it up, without any lock
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t rings[MAX_RINGS];
+static int image_fd = -1;
+static pthread_key_t ring_key; // Tears a thread's ring down when the thread exits
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread int ring_slot = -1;
+static __thread unsigned ring_gen;
+
+static char *buffers_base = NULL;
+static size_t buffers_size = 0;
+static unsigned buffers_gen = 0;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Called with rings_lock held
+static void teardown(ring_t *r)
+{
+    if (r->sqes)
+    {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_map && r->cq_map != r->sq_map)
+    {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    if (r->sq_map)
+    {
+        munmap(r->sq_map, r->sq_map_size);
+    }
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+    }
+    unsigned gen = r->gen;
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->gen = gen + 1;
+}
+
+// Make a ring and map its queues
+// Return 0, or -errno (-ENOSYS on a kernel without io_uring or with one too old for
+// linked operations and fsync)
+static int setup(ring_t *r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_setup(URING_ENTRIES, &p);
+    if (r->fd < 0)
+    {
+        int err = errno;
+        r->fd = -1;
+        return -err;
+    }
+    if (!(p.features & IORING_FEAT_NODROP))
+    {
+        teardown(r);
+        return -ENOSYS;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->sq_map_size = r->sq_map_size > r->cq_map_size ? r->sq_map_size : r->cq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+    {
+        r->sq_map = NULL;
+        teardown(r);
+        return -ENOMEM;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_map = r->sq_map;
+    }
+    else
+    {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED)
+        {
+            r->cq_map = NULL;
+            teardown(r);
+            return -ENOMEM;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        teardown(r);
+        return -ENOMEM;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->buffers_gen = buffers_gen - 1; // Registered on first use
+    return 0;
+}
+
+// Thread exit: tear down the ring the thread had
+static void release_ring(void *arg)
+{
+    pthread_mutex_lock(&rings_lock);
+    if (ring_slot >= 0 && rings[ring_slot].fd >= 0 && rings[ring_slot].gen == ring_gen)
+    {
+        teardown(&rings[ring_slot]);
+    }
+    ring_slot = -1;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+// In a child after fork: the rings copied belong to the parent's threads
+static void forget_rings()
+{
+    for (int k = 0; k < MAX_RINGS; k++)
+    {
+        if (rings[k].fd >= 0)
+        {
+            teardown(&rings[k]);
+        }
+    }
+    pthread_mutex_init(&rings_lock, NULL);
+}
+
+static void init_slots()
+{
+    pthread_key_create(&ring_key, release_ring);
+    pthread_atfork(NULL, NULL, forget_rings);
+    for (int k = 0; k < MAX_RINGS; k++)
+    {
+        rings[k].fd = -1;
+    }
+}
+
+// The ring of the calling thread, set up the first time
+// Return it, or NULL with *err set if there is none to be had
+static ring_t *thread_ring(int *err)
+{
+    if (ring_slot >= 0 && rings[ring_slot].fd >= 0 && rings[ring_slot].gen == ring_gen)
+    {
+        return &rings[ring_slot];
+    }
+
+    pthread_once(&key_once, init_slots);
+    ring_t *r = NULL;
+    *err = -ENODEV;
+    pthread_mutex_lock(&rings_lock);
+    for (int k = 0; k < MAX_RINGS && image_fd >= 0; k++)
+    {
+        if (rings[k].fd < 0)
+        {
+            *err = setup(&rings[k]);
+            if (*err == 0)
+            {
+                r = &rings[k];
+                ring_slot = k;
+                ring_gen = r->gen;
+                pthread_setspecific(ring_key, r);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+// Bring a ring's registered buffers up to the ones last given to uring_register_buffers
+static void refresh_buffers(ring_t *r)
+{
+    pthread_mutex_lock(&rings_lock);
+    if (r->fixed)
+    {
+        sys_register(r->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        r->fixed = 0;
+    }
+    if (buffers_base != NULL)
+    {
+        // Pinning them can fail, past RLIMIT_MEMLOCK on older kernels: then plain reads and writes do
+        struct iovec iov = {buffers_base, buffers_size};
+        r->fixed = sys_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    }
+    r->buffers_gen = buffers_gen;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+// Submit through io_uring on the image descriptor fd from now on
+// Sets up the calling thread's ring, so a kernel without io_uring shows here
+// Return 0, or -errno
+int uring_init(int fd)
+{
+    pthread_once(&key_once, init_slots);
+    image_fd = fd;
+    int err;
+    return thread_ring(&err) != NULL ? 0 : err;
+}
+
+// Tear down every ring, once nothing is submitting any more
+void uring_shutdown()
+{
+    pthread_once(&key_once, init_slots);
+    pthread_mutex_lock(&rings_lock);
+    for (int k = 0; k < MAX_RINGS; k++)
+    {
+        if (rings[k].fd >= 0)
+        {
+            teardown(&rings[k]);
+        }
+    }
+    image_fd = -1;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+// Register [base, base + size) with every ring, so transfers into it skip mapping the
+// pages on each request; NULL takes the registration back before the memory is freed
+void uring_register_buffers(void *base, size_t size)
+{
+    pthread_mutex_lock(&rings_lock);
+    buffers_base = base;
+    buffers_size = size;
+    __atomic_store_n(&buffers_gen, buffers_gen + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void fill_sqe(ring_t *r, struct io_uring_sqe *sqe, const uring_op_t *op)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = image_fd;
+    sqe->off = op->offset;
+    if (op->sync)
+    {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        return;
+    }
+
+    char *base = op->iov[0].iov_base;
+    if (r->fixed && op->iovcnt == 1 && base >= buffers_base && base + op->iov[0].iov_len <= buffers_base + buffers_size)
+    {
+        sqe->opcode = op->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)base;
+        sqe->len = op->iov[0].iov_len;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t)op->iov;
+        sqe->len = op->iovcnt;
+    }
+}
+
+// Submit up to URING_ENTRIES operations with one system call, and wait for all of them
+// Return 0, or -errno if the ring failed with none of them in flight
+static int run_batch(ring_t *r, uring_op_t *ops, int n)
+{
+    unsigned tail = *r->sq_tail;
+    for (int k = 0; k < n; k++)
+    {
+        unsigned idx = tail & r->sq_mask;
+        fill_sqe(r, &r->sqes[idx], &ops[k]);
+        // A chain ends with the batch: the next one only starts once this one is done anyway
+        r->sqes[idx].flags = ops[k].link && k < n - 1 ? IOSQE_IO_LINK : 0;
+        r->sqes[idx].user_data = k;
+        r->sq_array[idx] = idx;
+        ops[k].result = -ECANCELED;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Submit and wait until nothing is in flight; after a failure only wait
+    int to_submit = n;
+    int reaped = 0;
+    int err = 0;
+    while (reaped < n - to_submit || (to_submit > 0 && err == 0))
+    {
+        int rv = err == 0 ? sys_enter(r->fd, to_submit, n - reaped, IORING_ENTER_GETEVENTS)
+                          : sys_enter(r->fd, 0, n - to_submit - reaped, IORING_ENTER_GETEVENTS);
+        if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            err = err == 0 ? -errno : err;
+        }
+        else if (rv > 0 && err == 0)
+        {
+            to_submit -= rv;
+        }
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            ops[cqe->user_data].result = cqe->res;
+            head++;
+            reaped++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (err != 0 && to_submit > 0)
+    {
+        // Entries left in the queue would go out with the next batch
+        pthread_mutex_lock(&rings_lock);
+        teardown(r);
+        pthread_mutex_unlock(&rings_lock);
+        return err;
+    }
+    return 0;
+}
+
+// Run the operations on the calling thread's ring, URING_ENTRIES to a system call
+// Each one's result is set, -ECANCELED if it did not run; the caller redoes whatever
+// did not complete in full some other way
+// Return 0, or -errno if the thread has no ring and nothing ran
+int uring_run(uring_op_t *ops, int n)
+{
+    int err;
+    ring_t *r = thread_ring(&err);
+    if (r == NULL)
+    {
+        return err;
+    }
+    if (r->buffers_gen != __atomic_load_n(&buffers_gen, __ATOMIC_ACQUIRE))
+    {
+        refresh_buffers(r);
+    }
+
+    for (int done = 0; done < n;)
+    {
+        int batch = n - done < URING_ENTRIES ? n - done : URING_ENTRIES;
+        if (run_batch(r, ops + done, batch) < 0)
+        {
+            for (int k = done; k < n; k++)
+            {
+                ops[k].result = -ECANCELED;
+            }
+            return 0;
+        }
+        done += batch;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// io_uring on the raw system calls, for the image descriptor only
+// Every thread gets a ring of its own the first time it submits, so threads never
+// wait on each other to reach the device, and it goes away when the thread exits
+
+#define URING_ENTRIES 64 // Submission queue entries of each ring
+
+// One operation of a batch
+typedef struct
+{
+    int write;                // Write the buffers, or read into them
+    int sync;                 // Instead, make what was written before it durable (fdatasync)
+    const struct iovec *iov;  // Buffers, back to back from offset
+    int iovcnt;
+    off_t offset;
+    int link;                 // The next operation starts once this one completed in full
+    int result;               // Set by uring_run: bytes transferred, or -errno
+} uring_op_t;
+
+int uring_init(int fd);
+void uring_shutdown();
+void uring_register_buffers(void *base, size_t size);
+int uring_run(uring_op_t *ops, int n);
+
+#endif // URING_H